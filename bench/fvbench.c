@@ -0,0 +1,278 @@
+// fvbench - per-handler throughput microbenchmarks for the emulator core.
+//
+// Each case builds a buffer that exercises one class of handler, then feeds
+// it through libfvterm until enough time has passed to get a stable number.
+// Then a screen the size of a long scrollback is filled with log lines and
+// exported as text with each set of fvterm_export() flags. Results are
+// written to stdout as JSON so they can be tracked per commit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfvterm.h"
+#include "fvcells.h"
+#include "bench.h"
+
+
+#define BENCH_BYTES (1 << 20)
+#define EXPORT_ROWS 100000
+
+
+#pragma mark - Workloads
+
+
+// Printable text, one line per row
+static void gen_ascii(struct buf *b, int rows, int cols)
+{
+    int ch = 0;
+    while(b->len < BENCH_BYTES) {
+        for(int i = 0; i < cols - 1; i++)
+            buf_put(b, &(char) { 0x21 + (ch++ % 94) }, 1);
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+
+// Two- and three-byte UTF-8 sequences
+static void gen_utf8(struct buf *b, int rows, int cols)
+{
+    static const char *glyphs[] = { "\xc3\xa9", "\xce\xbb", "\xe2\x94\x80", "\xe2\x96\x88" };
+    int n = 0;
+    while(b->len < BENCH_BYTES) {
+        for(int i = 0; i < cols - 1; i++) {
+            const char *g = glyphs[n++ & 3];
+            buf_put(b, g, strlen(g));
+        }
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+
+// Colour and attribute changes every few characters
+static void gen_sgr(struct buf *b, int rows, int cols)
+{
+    int n = 0;
+    while(b->len < BENCH_BYTES) {
+        buf_printf(b, "\e[%d;%d;38;5;%d;48;5;%dmab\e[0m",
+                   1 + (n % 4), 30 + (n % 8), n % 256, (n * 7) % 256);
+        n++;
+    }
+}
+
+
+// Cursor addressing all over the screen
+static void gen_cup(struct buf *b, int rows, int cols)
+{
+    int n = 0;
+    while(b->len < BENCH_BYTES) {
+        buf_printf(b, "\e[%d;%dHx", 1 + (n * 7) % rows, 1 + (n * 13) % cols);
+        n++;
+    }
+}
+
+
+// Linefeeds at the bottom of a scroll region
+static void gen_scroll(struct buf *b, int rows, int cols)
+{
+    buf_printf(b, "\e[2;%dr\e[%d;1H", rows - 1, rows - 1);
+    while(b->len < BENCH_BYTES)
+        buf_put(b, "x\n", 2);
+}
+
+
+// Erase in display / line
+static void gen_erase(struct buf *b, int rows, int cols)
+{
+    int n = 0;
+    while(b->len < BENCH_BYTES) {
+        buf_printf(b, "\e[%d;%dH\e[%dK", 1 + n % rows, 1 + (n * 3) % cols, n % 3);
+        if(n % 16 == 0)
+            buf_printf(b, "\e[%dJ", n % 3);
+        n++;
+    }
+}
+
+
+// Insert / delete characters
+static void gen_ichdch(struct buf *b, int rows, int cols)
+{
+    int n = 0;
+    while(b->len < BENCH_BYTES) {
+        buf_printf(b, "\e[%d;%dH\e[%d%c", 1 + n % rows, 1 + (n * 3) % cols,
+                   1 + n % 8, (n & 1) ? '@' : 'P');
+        n++;
+    }
+}
+
+
+// A clipboard transfer (OSC 52) of the whole buffer
+static void gen_osc52(struct buf *b, int rows, int cols)
+{
+    buf_put(b, "\e]52;c;", 7);
+    while(b->len < BENCH_BYTES)
+        buf_put(b, "SGVsbG8sIGNsaXBib2FyZCEgVGhpcyBpcyBhIGxvbmcgcGFzdGUu", 52);
+    buf_put(b, "\a", 1);
+}
+
+
+struct benchCase {
+    const char *name;
+    void (*gen)(struct buf *b, int rows, int cols);
+};
+
+static const struct benchCase cases[] = {
+    { "ascii", gen_ascii },
+    { "utf8", gen_utf8 },
+    { "sgr", gen_sgr },
+    { "cup", gen_cup },
+    { "scroll", gen_scroll },
+    { "ed_el", gen_erase },
+    { "ich_dch", gen_ichdch },
+    { "osc52", gen_osc52 },
+};
+
+
+#pragma mark - Driver
+
+
+// Feeds the buffer repeatedly for at least minTime ns, and returns the best
+// per-pass time seen.
+static uint64_t run_case(const struct buf *b, int rows, int cols, uint64_t minTime)
+{
+    struct fvterm *term = fvterm_init(rows, cols);
+    uint64_t best = ~0ULL, start = now_ns();
+    int passes = 0;
+
+    do {
+        uint64_t t0 = now_ns();
+        fvterm_write(term, b->data, b->len);
+        uint64_t t = now_ns() - t0;
+        if(t < best) best = t;
+        term->outputp = 0; // throw away any responses
+        passes++;
+    } while(now_ns() - start < minTime || passes < 3);
+
+    fvterm_free(term);
+    return best;
+}
+
+
+// Log lines of all lengths, some wrapping and some coloured
+static void gen_history(struct buf *b, int rows, int cols)
+{
+    for(int n = 0; n < rows - 1; n++) {
+        int len = (n * 37) % (cols + cols / 2);
+        if(n % 8 == 0)
+            buf_printf(b, "\e[%dm", 31 + n % 7);
+        buf_printf(b, "%08d ", n);
+        for(int i = 9; i < len; i++)
+            buf_put(b, &(char) { 'a' + (n + i) % 26 }, 1);
+        if(n % 8 == 0)
+            buf_put(b, "\e[m", 3);
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+
+static const struct {
+    const char *name;
+    int flags;
+} exportCases[] = {
+    { "plain", 0 },
+    { "join_trim", FVTERM_EXPORT_JOIN | FVTERM_EXPORT_TRIM },
+    { "sgr", FVTERM_EXPORT_JOIN | FVTERM_EXPORT_TRIM | FVTERM_EXPORT_SGR },
+};
+
+
+static void run_export(int cols, uint64_t minTime)
+{
+    struct fvterm *term = fvterm_init(EXPORT_ROWS, cols);
+    struct buf b = { 0 };
+    gen_history(&b, EXPORT_ROWS, cols);
+    fvterm_write(term, b.data, b.len);
+    free(b.data);
+
+    printf(",\n \"export\": [");
+    for(int i = 0; i < sizeof(exportCases) / sizeof(exportCases[0]); i++) {
+        int flags = exportCases[i].flags;
+        size_t len = fvterm_export(term, 0, EXPORT_ROWS, flags, NULL, 0);
+        char *text = malloc(len + 1);
+
+        uint64_t best = ~0ULL, start = now_ns();
+        int passes = 0;
+        do {
+            uint64_t t0 = now_ns();
+            fvterm_export(term, 0, EXPORT_ROWS, flags, text, len + 1);
+            uint64_t t = now_ns() - t0;
+            if(t < best) best = t;
+            passes++;
+        } while(now_ns() - start < minTime || passes < 3);
+
+        printf("%s\n  {\"name\": \"%s\", \"rows\": %d, \"bytes\": %zu, \"ms\": %.3f, "
+               "\"mb_per_s\": %.1f}",
+               i ? "," : "", exportCases[i].name, EXPORT_ROWS, len, best / 1e6,
+               (len / 1048576.0) / (best / 1e9));
+        free(text);
+    }
+    printf("\n ]");
+    fvterm_free(term);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r rows] [-c cols] [-t ms] [-l label] [case...]\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 24, cols = 80, ms = 200;
+    const char *label = "";
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:c:t:l:")) != -1) {
+        switch(opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 't': ms = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(rows < 2 || cols < 2) usage(argv[0]);
+
+    emu_cells_init();
+    printf("{\"label\": \"%s\", \"rows\": %d, \"cols\": %d, \"cells\": \"%s\", \"results\": [",
+           label, rows, cols, emu_cells.name);
+
+    int first = 1;
+    for(int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if(optind < argc) {
+            int wanted = 0;
+            for(int j = optind; j < argc; j++)
+                wanted |= !strcmp(argv[j], cases[i].name);
+            if(!wanted) continue;
+        }
+
+        struct buf b = { 0 };
+        cases[i].gen(&b, rows, cols);
+        uint64_t ns = run_case(&b, rows, cols, ms * 1000000ULL);
+
+        printf("%s\n  {\"name\": \"%s\", \"bytes\": %zu, \"ns_per_byte\": %.3f, \"mb_per_s\": %.1f}",
+               first ? "" : ",", cases[i].name, b.len,
+               (double) ns / b.len, (b.len / 1048576.0) / (ns / 1e9));
+        first = 0;
+        free(b.data);
+    }
+
+    printf("\n ]");
+
+    if(optind == argc)
+        run_export(cols, ms * 1000000ULL);
+    printf("}\n");
+    return 0;
+}
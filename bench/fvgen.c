@@ -0,0 +1,364 @@
+// fvgen - deterministic synthetic workloads for end-to-end throughput.
+//
+// Where fvbench isolates individual handlers, these streams model whole
+// programs: log tailing, colourful build output, full-screen repaints, pagers
+// and editors scrolling a region, wide Unicode text and very long lines. Each
+// stream is a pure function of its name, seed, size and screen geometry, so
+// MB/s figures are comparable across builds. With -d the stream is written to
+// stdout instead, to compare against other terminals.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfvterm.h"
+#include "bench.h"
+
+
+struct gen {
+    struct buf *b;
+    uint64_t rng;
+    size_t size;
+    int rows, cols;
+};
+
+
+static uint32_t gen_rand(struct gen *g)
+{
+    // xorshift64*
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return (g->rng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+
+static int gen_range(struct gen *g, int lo, int hi)
+{
+    return lo + gen_rand(g) % (hi - lo + 1);
+}
+
+
+static void gen_utf8(struct gen *g, uint32_t ch)
+{
+    uint8_t out[4];
+    int n;
+    if(ch < 0x80) {
+        out[0] = ch;
+        n = 1;
+    } else if(ch < 0x800) {
+        out[0] = 0xc0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3f);
+        n = 2;
+    } else if(ch < 0x10000) {
+        out[0] = 0xe0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3f);
+        out[2] = 0x80 | (ch & 0x3f);
+        n = 3;
+    } else {
+        out[0] = 0xf0 | (ch >> 18);
+        out[1] = 0x80 | ((ch >> 12) & 0x3f);
+        out[2] = 0x80 | ((ch >> 6) & 0x3f);
+        out[3] = 0x80 | (ch & 0x3f);
+        n = 4;
+    }
+    buf_put(g->b, out, n);
+}
+
+
+static const char *words[] = {
+    "connection", "request", "timeout", "worker", "cache", "miss", "hit",
+    "retrying", "session", "closed", "user", "id", "ok", "failed", "queue",
+    "flush", "bytes", "from", "to", "in", "ms", "handler", "index", "build",
+    "compile", "link", "warning", "unused", "variable", "returned", "null",
+};
+
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+
+// Appends words until the line is about len columns long
+static int gen_words(struct gen *g, int len)
+{
+    int col = 0;
+    while(col < len) {
+        const char *w = words[gen_rand(g) % NWORDS];
+        if(col) {
+            buf_put(g->b, " ", 1);
+            col++;
+        }
+        buf_put(g->b, w, strlen(w));
+        col += strlen(w);
+    }
+    return col;
+}
+
+
+#pragma mark - Workloads
+
+
+// Dense timestamped log lines of varying length, some of which wrap
+static void wl_logs(struct gen *g)
+{
+    static const char *levels[] = { "DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR" };
+    unsigned ms = 0;
+    while(g->b->len < g->size) {
+        ms += gen_range(g, 0, 250);
+        buf_printf(g->b, "2011-03-14 %02u:%02u:%02u.%03u [%s] ", (ms / 3600000) % 24,
+                   (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000, levels[gen_rand(g) % 6]);
+        gen_words(g, gen_range(g, 10, g->cols * 3 / 2));
+        buf_put(g->b, "\r\n", 2);
+    }
+}
+
+
+// A 256-colour foreground (and sometimes background) change on every word
+static void wl_color256(struct gen *g)
+{
+    while(g->b->len < g->size) {
+        int col = 0;
+        while(col < g->cols - 12) {
+            if(gen_rand(g) & 3)
+                buf_printf(g->b, "\e[38;5;%dm", gen_range(g, 0, 255));
+            else
+                buf_printf(g->b, "\e[%d;38;5;%d;48;5;%dm", gen_range(g, 1, 4),
+                           gen_range(g, 0, 255), gen_range(g, 0, 255));
+            const char *w = words[gen_rand(g) % NWORDS];
+            buf_printf(g->b, "%s\e[0m ", w);
+            col += strlen(w) + 1;
+        }
+        buf_put(g->b, "\r\n", 2);
+    }
+}
+
+
+// Full-screen frames drawn row by row with cursor addressing, like top(1)
+static void wl_repaint(struct gen *g)
+{
+    while(g->b->len < g->size) {
+        buf_put(g->b, "\e[H", 3);
+        for(int r = 1; r <= g->rows; r++) {
+            buf_printf(g->b, "\e[%d;1H", r);
+            if(r == 1)
+                buf_put(g->b, "\e[7m", 4);
+            else if(gen_rand(g) % 5 == 0)
+                buf_printf(g->b, "\e[1;3%dm", gen_range(g, 1, 7));
+
+            buf_printf(g->b, "%5d ", gen_range(g, 1, 99999));
+            gen_words(g, gen_range(g, 0, g->cols - 18));
+            buf_put(g->b, "\e[K\e[0m", 7);
+        }
+    }
+}
+
+
+// Text scrolling inside a region between a header and a status line, with
+// the occasional reverse scroll, like a pager or editor
+static void wl_scrollregion(struct gen *g)
+{
+    int top = 2, bottom = g->rows - 1, line = 0;
+    buf_printf(g->b, "\e[2J\e[%d;%dr\e[%d;1H", top, bottom, bottom);
+    while(g->b->len < g->size) {
+        if(gen_rand(g) % 16 == 0) {
+            buf_printf(g->b, "\e[%d;1H\eM", top);
+            gen_words(g, gen_range(g, 0, g->cols - 1));
+            buf_printf(g->b, "\e[%d;1H", bottom);
+        } else {
+            buf_put(g->b, "\r\n", 2);
+            gen_words(g, gen_range(g, 0, g->cols - 1));
+        }
+        if(++line % 8 == 0)
+            buf_printf(g->b, "\e7\e[%d;1H\e[7m line %d \e[0m\e[K\e8", g->rows, line);
+    }
+    buf_put(g->b, "\e[r", 3);
+}
+
+
+// CJK and Hangul, emoji, accented text with combining marks and box drawing
+static void wl_unicode(struct gen *g)
+{
+    while(g->b->len < g->size) {
+        for(int i = 0; i < g->cols / 2 - 1; i++) {
+            switch(gen_rand(g) % 6) {
+                case 0: gen_utf8(g, gen_range(g, 0x4e00, 0x9fff)); break;
+                case 1: gen_utf8(g, gen_range(g, 0xac00, 0xd7a3)); break;
+                case 2: gen_utf8(g, gen_range(g, 0x1f300, 0x1f5ff)); break;
+                case 3:
+                    gen_utf8(g, gen_range(g, 'a', 'z'));
+                    gen_utf8(g, gen_range(g, 0x300, 0x36f));
+                    break;
+                case 4: gen_utf8(g, gen_range(g, 0x3b1, 0x3c9)); break;
+                case 5: gen_utf8(g, gen_range(g, 0x2500, 0x257f)); break;
+            }
+        }
+        buf_put(g->b, "\r\n", 2);
+    }
+}
+
+
+// Lines many screens wide with no line breaks, so every row is reached by
+// autowrap
+static void wl_flood(struct gen *g)
+{
+    while(g->b->len < g->size) {
+        int len = gen_range(g, g->cols * 8, g->cols * g->rows * 2);
+        for(int i = 0; i < len; i++)
+            buf_put(g->b, &(char) { gen_range(g, 0x21, 0x7e) }, 1);
+        buf_put(g->b, "\r\n", 2);
+    }
+}
+
+
+struct workload {
+    const char *name;
+    void (*gen)(struct gen *g);
+};
+
+static const struct workload workloads[] = {
+    { "logs", wl_logs },
+    { "color256", wl_color256 },
+    { "repaint", wl_repaint },
+    { "scrollregion", wl_scrollregion },
+    { "unicode", wl_unicode },
+    { "flood", wl_flood },
+};
+
+
+#pragma mark - Driver
+
+
+static void generate(const struct workload *wl, struct buf *b, uint64_t seed,
+                     size_t size, int rows, int cols)
+{
+    struct gen g = {
+        .b = b, .size = size, .rows = rows, .cols = cols,
+        // splitmix64 so that nearby seeds give unrelated streams
+        .rng = seed + 0x9e3779b97f4a7c15ULL,
+    };
+    g.rng = (g.rng ^ (g.rng >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    g.rng = (g.rng ^ (g.rng >> 27)) * 0x94d049bb133111ebULL;
+    g.rng ^= g.rng >> 31;
+    if(!g.rng) g.rng = 1;
+
+    wl->gen(&g);
+}
+
+
+static uint64_t stream_hash(const struct buf *b)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < b->len; i++)
+        h = (h ^ b->data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+// Feeds the stream to a fresh terminal repeatedly for at least minTime ns and
+// returns the best per-pass time
+static uint64_t run_workload(const struct buf *b, int rows, int cols, uint64_t minTime)
+{
+    uint64_t best = ~0ULL, start = now_ns();
+    int passes = 0;
+
+    do {
+        struct fvterm *term = fvterm_init(rows, cols);
+        uint64_t t0 = now_ns();
+        fvterm_write(term, b->data, b->len);
+        uint64_t t = now_ns() - t0;
+        if(t < best) best = t;
+        fvterm_free(term);
+        passes++;
+    } while(now_ns() - start < minTime || passes < 3);
+
+    return best;
+}
+
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t n = strtoul(s, &end, 10);
+    switch(*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+    }
+    return n;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-b bytes[k|m]] [-r rows] [-c cols] [-t ms] [-l label] [workload...]\n"
+                    "       %s -d [-s seed] [-b bytes[k|m]] [-r rows] [-c cols] workload\n", argv0, argv0);
+    fprintf(stderr, "workloads:");
+    for(int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 24, cols = 80, ms = 200, dump = 0;
+    uint64_t seed = 1;
+    size_t size = 4 << 20;
+    const char *label = "";
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:b:r:c:t:l:d")) != -1) {
+        switch(opt) {
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'b': size = parse_size(optarg); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 't': ms = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            case 'd': dump = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(rows < 4 || cols < 16 || size == 0) usage(argv[0]);
+    if(dump && optind != argc - 1) usage(argv[0]);
+
+    int selected = 0;
+    for(int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        for(int j = optind; j < argc; j++)
+            selected += !strcmp(argv[j], workloads[i].name);
+    }
+    if(selected != argc - optind) usage(argv[0]);
+
+    if(!dump)
+        printf("{\"label\": \"%s\", \"seed\": %llu, \"rows\": %d, \"cols\": %d, \"results\": [",
+               label, (unsigned long long) seed, rows, cols);
+
+    int first = 1;
+    for(int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if(optind < argc) {
+            int wanted = 0;
+            for(int j = optind; j < argc; j++)
+                wanted |= !strcmp(argv[j], workloads[i].name);
+            if(!wanted) continue;
+        }
+
+        struct buf b = { 0 };
+        generate(&workloads[i], &b, seed, size, rows, cols);
+
+        if(dump) {
+            fwrite(b.data, 1, b.len, stdout);
+        } else {
+            uint64_t ns = run_workload(&b, rows, cols, ms * 1000000ULL);
+            printf("%s\n  {\"name\": \"%s\", \"bytes\": %zu, \"stream\": \"%016llx\", "
+                   "\"ns_per_byte\": %.3f, \"mb_per_s\": %.1f}",
+                   first ? "" : ",", workloads[i].name, b.len,
+                   (unsigned long long) stream_hash(&b),
+                   (double) ns / b.len, (b.len / 1048576.0) / (ns / 1e9));
+            first = 0;
+        }
+        free(b.data);
+    }
+
+    if(!dump)
+        printf("\n]}\n");
+    return 0;
+}
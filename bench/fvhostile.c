@@ -0,0 +1,203 @@
+// fvhostile - adversarial streams with a worst-case cost limit.
+//
+// Each case repeats a sequence chosen to make some handler do as much work as
+// its parameters allow (huge counts, maximal resizes, unterminated strings,
+// random binary). A terminal should never spend much longer per byte on these
+// than on ordinary output, so the run fails if any case exceeds the limit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfvterm.h"
+#include "bench.h"
+
+
+#define HOSTILE_BYTES (256 << 10)
+
+
+static void repeat(struct buf *b, const char *seq)
+{
+    while(b->len < HOSTILE_BYTES)
+        buf_put(b, seq, strlen(seq));
+}
+
+
+static void gen_il(struct buf *b)       { repeat(b, "\e[H\e[16383L"); }
+static void gen_dl(struct buf *b)       { repeat(b, "\e[H\e[16383M"); }
+static void gen_su(struct buf *b)       { repeat(b, "\e[16383S"); }
+static void gen_sd(struct buf *b)       { repeat(b, "\e[16383T"); }
+static void gen_cnl(struct buf *b)      { repeat(b, "\e[16383E\e[16383F"); }
+static void gen_ichdch(struct buf *b)   { repeat(b, "\e[16383@\e[16383P"); }
+static void gen_tabs(struct buf *b)     { repeat(b, "\e[16383I\e[16383Z"); }
+static void gen_resize(struct buf *b)   { repeat(b, "\e[8;999;999t\e[8;24;80t"); }
+static void gen_decslpp(struct buf *b)  { repeat(b, "\e[998t\e[24t"); }
+static void gen_deccolm(struct buf *b)  { repeat(b, "\e[?40h\e[?3h\e[?3l"); }
+static void gen_region(struct buf *b)   { repeat(b, "\e[1;999r\e[16383;16383H\n\e[r"); }
+static void gen_lrmargin(struct buf *b) { repeat(b, "\e[?69h\e[2;79s\e[16383S\e[16383T\e[?69l"); }
+static void gen_rep(struct buf *b)      { repeat(b, "#\e[16383b"); }
+static void gen_rect(struct buf *b)     { repeat(b, "\e[2;1;;;;1;1$v\e[43$x\e[1$r\e[$z"); }
+static void gen_images(struct buf *b)   { repeat(b, "\ePq#1;2;0;0;100!16383~\e\\"); }
+
+
+// One endless sixel image, wider than the screen and scrolling it every band
+static void gen_sixel(struct buf *b)
+{
+    buf_put(b, "\eP0;1q\"1;1;16383;16383", 22);
+    repeat(b, "#254;1;120;50;100!16383~$#1!99@-");
+}
+
+
+// Far more parameters than fit, and parameters with far too many digits
+static void gen_params(struct buf *b)
+{
+    while(b->len < HOSTILE_BYTES) {
+        buf_put(b, "\e[", 2);
+        for(int i = 0; i < 64; i++)
+            buf_put(b, "99999999999999999999;", 21);
+        buf_put(b, "m", 1);
+    }
+}
+
+
+// One unterminated OSC string
+static void gen_osc(struct buf *b)
+{
+    buf_put(b, "\e]0;", 4);
+    repeat(b, "title ");
+}
+
+
+// One clipboard transfer as long as the whole stream
+static void gen_clipboard(struct buf *b)
+{
+    buf_put(b, "\e]52;c;", 7);
+    repeat(b, "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVo=");
+}
+
+
+// A new link for every character, each with a URI as long as is kept
+static void gen_links(struct buf *b)
+{
+    char seq[512];
+    for(int i = 0; b->len < HOSTILE_BYTES; i++) {
+        int n = snprintf(seq, sizeof(seq), "\e]8;id=%d;http://example.com/%d/%0*d\ax", i, i, 440, 0);
+        buf_put(b, seq, n);
+    }
+}
+
+
+// What cat(1) of a binary file looks like
+static void gen_binary(struct buf *b)
+{
+    uint32_t x = 2463534242u;
+    while(b->len < HOSTILE_BYTES) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf_put(b, &(uint8_t) { x }, 1);
+    }
+}
+
+
+struct hostileCase {
+    const char *name;
+    void (*gen)(struct buf *b);
+};
+
+static const struct hostileCase cases[] = {
+    { "il", gen_il },
+    { "dl", gen_dl },
+    { "su", gen_su },
+    { "sd", gen_sd },
+    { "cnl_cpl", gen_cnl },
+    { "ich_dch", gen_ichdch },
+    { "cht_cbt", gen_tabs },
+    { "resize", gen_resize },
+    { "decslpp", gen_decslpp },
+    { "deccolm", gen_deccolm },
+    { "region", gen_region },
+    { "lrmargin", gen_lrmargin },
+    { "rep", gen_rep },
+    { "rect", gen_rect },
+    { "images", gen_images },
+    { "sixel", gen_sixel },
+    { "params", gen_params },
+    { "osc", gen_osc },
+    { "clipboard", gen_clipboard },
+    { "links", gen_links },
+    { "binary", gen_binary },
+};
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r rows] [-c cols] [-m max ns/byte] [case...]\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 24, cols = 80;
+    double limit = 1000;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:c:m:")) != -1) {
+        switch(opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'm': limit = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(rows < 2 || cols < 2) usage(argv[0]);
+
+    printf("{\"rows\": %d, \"cols\": %d, \"limit_ns_per_byte\": %.0f, \"results\": [",
+           rows, cols, limit);
+
+    double worst = 0;
+    const char *worstName = "";
+    int first = 1;
+    for(int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if(optind < argc) {
+            int wanted = 0;
+            for(int j = optind; j < argc; j++)
+                wanted |= !strcmp(argv[j], cases[i].name);
+            if(!wanted) continue;
+        }
+
+        struct buf b = { 0 };
+        cases[i].gen(&b);
+
+        // A single pass on a fresh terminal: it's the worst case we're after
+        struct fvterm *term = fvterm_init(rows, cols);
+        uint64_t t0 = now_ns();
+        for(size_t off = 0; off < b.len; off += 4096) {
+            fvterm_write(term, b.data + off, b.len - off < 4096 ? b.len - off : 4096);
+            term->outputp = 0;
+        }
+        uint64_t ns = now_ns() - t0;
+        fvterm_free(term);
+
+        double perByte = (double) ns / b.len;
+        if(perByte > worst) {
+            worst = perByte;
+            worstName = cases[i].name;
+        }
+        printf("%s\n  {\"name\": \"%s\", \"bytes\": %zu, \"ns_per_byte\": %.3f}",
+               first ? "" : ",", cases[i].name, b.len, perByte);
+        first = 0;
+        free(b.data);
+    }
+
+    printf("\n], \"worst\": \"%s\", \"worst_ns_per_byte\": %.3f}\n", worstName, worst);
+
+    if(worst > limit) {
+        fprintf(stderr, "%s: %s took %.1f ns/byte, over the %.0f ns/byte limit\n",
+                argv[0], worstName, worst, limit);
+        return 1;
+    }
+    return 0;
+}
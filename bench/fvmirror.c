@@ -0,0 +1,181 @@
+// fvmirror - measures and checks fvterm_diff() by mirroring a stream.
+//
+// The input (a file, or stdin) is fed to a live terminal a frame at a time.
+// After every frame the diff from a shadow terminal to the live one is fed to
+// the shadow, as a host would send it to a remote viewer, and the two screens
+// are compared. Reports how many bytes the diffs took against the input as
+// JSON, and exits non-zero if the shadow ever showed something else.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfvterm.h"
+#include "fvemu.h"
+#include "bench.h"
+
+
+// Whether two cells link to the same URI and id; their indices are in
+// different tables
+static int same_link(struct fvterm *live, struct fvterm *shadow, uint64_t a, uint64_t b)
+{
+    const char *idA = NULL, *idB = NULL;
+    const char *uriA = fvterm_getlink(live, a, &idA), *uriB = fvterm_getlink(shadow, b, &idB);
+    if(!uriA || !uriB)
+        return uriA == uriB;
+    return strcmp(uriA, uriB) == 0 && strcmp(idA, idB) == 0;
+}
+
+
+// Why the shadow differs from the live terminal, or NULL if it doesn't
+static const char * compare(struct fvterm *live, struct fvterm *shadow, uint64_t *a, uint64_t *b)
+{
+    int rows, cols;
+    fvterm_getsize(live, &rows, &cols);
+
+    struct fvtermScreen sa, sb;
+    fvterm_getscreen(live, &sa, NULL, NULL);
+    fvterm_getscreen(shadow, &sb, NULL, NULL);
+
+    for(int r = 0; r < rows; r++) {
+        int fa, fb;
+        fvterm_getrow(live, r, a, &fa);
+        fvterm_getrow(shadow, r, b, &fb);
+        for(int c = 0; c < cols; c++) {
+            if((a[c] ^ b[c]) & ~CELL_LINK_MASK)
+                return "cells";
+            if(((a[c] | b[c]) & CELL_LINK_MASK) && !same_link(live, shadow, a[c], b[c]))
+                return "links";
+        }
+        // The diff can't take TERMROW_WRAPPED away from a row whose cells
+        // are right already, and can only give it to ones above the bottom
+        // margin
+        if((fa & TERMROW_WRAPPED) && !(fb & TERMROW_WRAPPED) && r < sa.scrollBottom)
+            return "wrapped";
+    }
+
+    if(sa.cursorRow != sb.cursorRow || sa.cursorCol != sb.cursorCol)
+        return "cursor";
+    if(sa.scrollTop != sb.scrollTop || sa.scrollBottom != sb.scrollBottom ||
+       sa.scrollLeft != sb.scrollLeft || sa.scrollRight != sb.scrollRight)
+        return "margins";
+    uint64_t shown = MODE_INVERT | MODE_SHOWCURSOR | MODE_CURSORBLINK | MODE_LRMARGINS;
+    if((sa.modes & shown) != (sb.modes & shown))
+        return "modes";
+    if(memcmp(live->state->palette, shadow->state->palette, sizeof(live->state->palette)) != 0)
+        return "palette";
+    if(strcmp(live->title, shadow->title) != 0)
+        return "title";
+    return NULL;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r rows] [-c cols] [-f frame] [-R] [-v] [file]\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 24, cols = 80, flags = 0, verbose = 0;
+    size_t frame = 4096;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:c:f:Rv")) != -1) {
+        switch(opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'f': frame = strtoul(optarg, NULL, 0); break;
+            case 'R': flags |= FVTERM_DIFF_REP; break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind < argc - 1 || rows < 2 || cols < 2 || frame < 1)
+        usage(argv[0]);
+
+    FILE *in = optind < argc ? fopen(argv[optind], "rb") : stdin;
+    if(!in) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct fvterm *live = fvterm_init(rows, cols);
+    struct fvterm *shadow = fvterm_init(rows, cols);
+    uint8_t *buf = malloc(frame);
+    uint64_t *a = NULL, *b = NULL;
+    int cellsCols = 0;
+
+    char *diff = NULL;
+    size_t diffSize = 0;
+    FILE *out = open_memstream(&diff, &diffSize);
+
+    uint64_t inputBytes = 0, diffBytes = 0, frames = 0, resizes = 0, mismatches = 0;
+    uint64_t diffNs = 0;
+    size_t n;
+    while((n = fread(buf, 1, frame, in)) > 0) {
+        fvterm_write(live, buf, n);
+        inputBytes += n;
+        frames++;
+
+        // A host tells the viewer about a resize out of band
+        int lr, lc, sr, sc;
+        fvterm_getsize(live, &lr, &lc);
+        fvterm_getsize(shadow, &sr, &sc);
+        if(lr != sr || lc != sc) {
+            fvterm_setsize(shadow, lr, lc);
+            resizes++;
+        }
+        if(lc > cellsCols) {
+            cellsCols = lc;
+            a = realloc(a, cellsCols * sizeof(uint64_t));
+            b = realloc(b, cellsCols * sizeof(uint64_t));
+        }
+
+        rewind(out);
+        uint64_t start = now_ns();
+        long len = fvterm_diff(shadow, live, flags, out);
+        diffNs += now_ns() - start;
+        fflush(out);
+        if(len < 0) {
+            fprintf(stderr, "fvterm_diff failed at frame %llu\n", (unsigned long long) frames);
+            return 1;
+        }
+        fvterm_write(shadow, (const uint8_t *) diff, len);
+        diffBytes += len;
+
+        const char *what = compare(live, shadow, a, b);
+        if(what) {
+            mismatches++;
+            if(verbose)
+                fprintf(stderr, "frame %llu: %s differ\n", (unsigned long long) frames, what);
+            // Start over from a copy, so one miss isn't counted every frame
+            fvterm_free(shadow);
+            FILE *state = tmpfile();
+            fvterm_save(live, state);
+            rewind(state);
+            shadow = fvterm_restore(state);
+            fclose(state);
+        }
+    }
+
+    printf("{\"rows\": %d, \"cols\": %d, \"frame\": %zu, \"frames\": %llu, \"resizes\": %llu, "
+           "\"input_bytes\": %llu, \"diff_bytes\": %llu, \"ratio\": %.4f, \"diff_ns_per_frame\": %llu, "
+           "\"mismatches\": %llu}\n",
+           rows, cols, frame, (unsigned long long) frames, (unsigned long long) resizes,
+           (unsigned long long) inputBytes, (unsigned long long) diffBytes,
+           inputBytes ? (double) diffBytes / inputBytes : 0.0,
+           (unsigned long long) (frames ? diffNs / frames : 0), (unsigned long long) mismatches);
+
+    fclose(out);
+    free(diff);
+    free(buf);
+    free(a);
+    free(b);
+    fvterm_free(live);
+    fvterm_free(shadow);
+    return mismatches != 0;
+}
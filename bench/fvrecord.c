@@ -0,0 +1,56 @@
+// fvrecord - captures a byte stream as a session recording for fvreplay.
+//
+// Reads stdin in whatever chunks read() returns and passes each one through
+// libfvterm with recording enabled, so pipe timing and emulator responses are
+// preserved:  some-program | fvrecord -o session.fvrec
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libfvterm.h"
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r rows] [-c cols] -o recording\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 24, cols = 80;
+    const char *path = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:c:o:")) != -1) {
+        switch(opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'o': path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(!path || rows < 2 || cols < 2) usage(argv[0]);
+
+    FILE *fp = fopen(path, "wb");
+    if(!fp) {
+        perror(path);
+        return 1;
+    }
+
+    struct fvterm *term = fvterm_init(rows, cols);
+    fvterm_record(term, fp);
+
+    uint8_t buf[4096];
+    ssize_t n;
+    while((n = read(0, buf, sizeof(buf))) > 0) {
+        fvterm_write(term, buf, n);
+        term->outputp = 0;
+    }
+
+    fvterm_record(term, NULL);
+    fvterm_free(term);
+    return fclose(fp) ? 1 : 0;
+}
@@ -0,0 +1,380 @@
+// fvreplay - replays a session recorded with fvterm_record().
+//
+// By default the input is fed as fast as possible (optionally several times
+// over) to measure parse throughput; with -r it is fed at the recorded pace.
+// Reports per-chunk latency percentiles, whether the emulator's responses
+// still match the recorded ones, and a checksum of the final screen, as JSON.
+// Against a library built with FVEMU_STATS it adds the core's counters for
+// the first pass. With -T, the emulator's trace ring is dumped at the end of
+// the first pass, for fvtrace. With -S, the state at the end of the first pass
+// is saved there with fvterm_save(), restored, and saved again to check that
+// nothing was lost on the way.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libfvterm.h"
+#include "fvemu.h"
+#include "bench.h"
+
+
+struct record {
+    int type;
+    uint64_t time; // microseconds since the start of the recording
+    const uint8_t *data;
+    size_t len;
+};
+
+struct recording {
+    int rows, cols;
+    struct record *recs;
+    size_t count;
+};
+
+
+static int varint_decode(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+    uint64_t val = 0;
+    for(int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        val |= (uint64_t) (b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            *out = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static uint8_t * load_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if(!fp) return NULL;
+
+    size_t cap = 1 << 16;
+    uint8_t *data = malloc(cap);
+    *len = 0;
+    for(;;) {
+        if(*len == cap)
+            data = realloc(data, cap *= 2);
+        size_t n = fread(data + *len, 1, cap - *len, fp);
+        if(n == 0) break;
+        *len += n;
+    }
+    fclose(fp);
+    return data;
+}
+
+
+static int parse_recording(const uint8_t *data, size_t len, struct recording *rec)
+{
+    const uint8_t *p = data, *end = data + len;
+    size_t magic = strlen(FVREC_MAGIC);
+    uint64_t rows, cols;
+
+    if(len < magic + 1 || memcmp(p, FVREC_MAGIC, magic) != 0)
+        return 0;
+    p += magic;
+    if(*p++ != FVREC_VERSION)
+        return 0;
+    if(!varint_decode(&p, end, &rows) || !varint_decode(&p, end, &cols))
+        return 0;
+    rec->rows = rows;
+    rec->cols = cols;
+
+    size_t cap = 1024;
+    uint64_t time = 0;
+    rec->recs = malloc(cap * sizeof(struct record));
+    rec->count = 0;
+
+    while(p < end) {
+        uint64_t delta, rlen;
+        int type = *p++;
+        if(!varint_decode(&p, end, &delta) || !varint_decode(&p, end, &rlen))
+            return 0;
+        if(rlen > end - p)
+            return 0;
+
+        if(rec->count == cap)
+            rec->recs = realloc(rec->recs, (cap *= 2) * sizeof(struct record));
+
+        time += delta;
+        rec->recs[rec->count++] = (struct record) {
+            .type = type, .time = time, .data = p, .len = rlen,
+        };
+        p += rlen;
+    }
+    return 1;
+}
+
+
+static uint64_t screen_checksum(struct fvterm *term)
+{
+    // FNV-1a over the cursor position and every cell
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int rows, cols, crow, ccol;
+    fvterm_getsize(term, &rows, &cols);
+    fvterm_getcursor(term, &crow, &ccol);
+
+    h = (h ^ (uint64_t) crow) * 0x100000001b3ULL;
+    h = (h ^ (uint64_t) ccol) * 0x100000001b3ULL;
+    for(int r = 0; r < rows; r++) {
+        for(int c = 0; c < cols; c++)
+            h = (h ^ fvterm_getglyph(term, r, c)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+// Prints the nonzero entries of a per-final-byte table as a JSON object
+static void print_finals(const char *name, const uint64_t *counts, int n)
+{
+    int first = 1;
+    printf("\"%s\": {", name);
+    for(int i = 0; i < n; i++) {
+        if(!counts[i]) continue;
+        if(i >= 0x20 && i < 0x7f)
+            printf("%s\"%s%c\": %llu", first ? "" : ", ",
+                   (i == '"' || i == '\\') ? "\\" : "", i, (unsigned long long) counts[i]);
+        else
+            printf("%s\"\\u%04x\": %llu", first ? "" : ", ", i, (unsigned long long) counts[i]);
+        first = 0;
+    }
+    printf("}");
+}
+
+
+static void print_stats(const struct emuStats *st)
+{
+    static const char *states[EMU_NSTATES] = { "ground", "esc", "csi", "osc", "dcs", "dcs_string" };
+    static const char *classes[STAT_NCLASSES] = { "text", "ctrl", "esc", "csi", "osc", "vt52", "dcs" };
+
+    printf(",\n \"stats\": {\"bytes\": {");
+    for(int i = 0; i < EMU_NSTATES; i++)
+        printf("%s\"%s\": %llu", i ? ", " : "", states[i], (unsigned long long) st->bytes[i]);
+    printf("},\n  \"cycles\": {");
+    for(int i = 0; i < STAT_NCLASSES; i++)
+        printf("%s\"%s\": [%llu, %llu]", i ? ", " : "", classes[i],
+               (unsigned long long) st->cycles[i], (unsigned long long) st->calls[i]);
+    printf("},\n  ");
+    print_finals("ctrl", st->ctrl, 32);
+    printf(",\n  ");
+    print_finals("esc", st->esc, 128);
+    printf(",\n  ");
+    print_finals("csi", st->csi, 128);
+    printf(",\n  \"osc\": %llu, \"scrolls\": %llu, \"scrolled_rows\": %llu, \"rows_dirtied\": %llu}",
+           (unsigned long long) st->osc, (unsigned long long) st->scrolls,
+           (unsigned long long) st->scrolledRows, (unsigned long long) st->rowsDirtied);
+}
+
+
+// Saves term to path, restores it and checks that the copy saves to the same
+// bytes, reporting how long each step took
+static void check_state(struct fvterm *term, const char *path)
+{
+    char *saved = NULL, *again = NULL;
+    size_t savedLen = 0, againLen = 0;
+
+    FILE *fp = open_memstream(&saved, &savedLen);
+    uint64_t t0 = now_ns();
+    fvterm_save(term, fp);
+    fclose(fp);
+    uint64_t saveNs = now_ns() - t0;
+
+    fp = fmemopen(saved, savedLen, "rb");
+    t0 = now_ns();
+    struct fvterm *copy = fvterm_restore(fp);
+    uint64_t restoreNs = now_ns() - t0;
+    fclose(fp);
+
+    if(copy) {
+        fp = open_memstream(&again, &againLen);
+        fvterm_save(copy, fp);
+        fclose(fp);
+        fvterm_free(copy);
+    }
+
+    if((fp = fopen(path, "wb"))) {
+        fwrite(saved, 1, savedLen, fp);
+        fclose(fp);
+    } else {
+        perror(path);
+    }
+
+    printf(",\n \"state\": {\"bytes\": %zu, \"save_ns\": %llu, \"restore_ns\": %llu, "
+           "\"round_trip\": %s}", savedLen, (unsigned long long) saveNs,
+           (unsigned long long) restoreNs,
+           copy && againLen == savedLen && memcmp(saved, again, savedLen) == 0 ? "true" : "false");
+    free(saved);
+    free(again);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r] [-n passes] [-T trace] [-S state] recording\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int realtime = 0, passes = 1;
+    const char *tracePath = NULL, *statePath = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "rn:T:S:")) != -1) {
+        switch(opt) {
+            case 'r': realtime = 1; break;
+            case 'n': passes = atoi(optarg); break;
+            case 'T': tracePath = optarg; break;
+            case 'S': statePath = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || passes < 1) usage(argv[0]);
+    if(realtime) passes = 1;
+
+    size_t fileLen;
+    uint8_t *file = load_file(argv[optind], &fileLen);
+    if(!file) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct recording rec;
+    if(!parse_recording(file, fileLen, &rec)) {
+        fprintf(stderr, "%s: not a valid recording\n", argv[optind]);
+        return 1;
+    }
+
+    size_t chunks = 0, bytes = 0, expectedLen = 0;
+    for(size_t i = 0; i < rec.count; i++) {
+        if(rec.recs[i].type == FVREC_INPUT) {
+            chunks++;
+            bytes += rec.recs[i].len;
+        } else if(rec.recs[i].type == FVREC_OUTPUT) {
+            expectedLen += rec.recs[i].len;
+        }
+    }
+
+    uint8_t *expected = malloc(expectedLen + 1);
+    size_t producedLen = 0;
+    for(size_t i = 0, n = 0; i < rec.count; i++) {
+        if(rec.recs[i].type == FVREC_OUTPUT) {
+            memcpy(expected + n, rec.recs[i].data, rec.recs[i].len);
+            n += rec.recs[i].len;
+        }
+    }
+
+    uint64_t *latency = malloc((chunks * passes + 1) * sizeof(uint64_t));
+    size_t samples = 0;
+    uint64_t busy = 0, checksum = 0;
+    int responsesMatch = 1, haveStats = 0;
+    struct emuStats stats;
+    struct fvterm *final = NULL;
+
+    for(int pass = 0; pass < passes; pass++) {
+        struct fvterm *term = fvterm_init(rec.rows, rec.cols);
+        uint64_t start = now_ns();
+
+        for(size_t i = 0; i < rec.count; i++) {
+            struct record *r = &rec.recs[i];
+
+            if(realtime) {
+                uint64_t due = start + r->time * 1000;
+                uint64_t now = now_ns();
+                if(due > now) {
+                    struct timespec ts = {
+                        .tv_sec = (due - now) / 1000000000ULL,
+                        .tv_nsec = (due - now) % 1000000000ULL,
+                    };
+                    nanosleep(&ts, NULL);
+                }
+            }
+
+            if(r->type == FVREC_INPUT) {
+                uint64_t t0 = now_ns();
+                fvterm_write(term, r->data, r->len);
+                uint64_t t = now_ns() - t0;
+                latency[samples++] = t;
+                busy += t;
+            } else if(r->type == FVREC_SIZE) {
+                const uint8_t *p = r->data;
+                uint64_t rows, cols;
+                if(varint_decode(&p, r->data + r->len, &rows) &&
+                   varint_decode(&p, r->data + r->len, &cols))
+                    fvterm_setsize(term, rows, cols);
+            }
+
+            // Compare responses on the first pass only
+            if(pass == 0 && term->outputp > 0) {
+                if(producedLen + term->outputp > expectedLen ||
+                   memcmp(expected + producedLen, term->output, term->outputp) != 0)
+                    responsesMatch = 0;
+                producedLen += term->outputp;
+            }
+            term->outputp = 0;
+        }
+
+        if(pass == 0) {
+            checksum = screen_checksum(term);
+            haveStats = fvterm_getstats(term, &stats, 0) == 0;
+
+            FILE *fp;
+            if(tracePath && (fp = fopen(tracePath, "wb"))) {
+                fvterm_dumptrace(term, fp);
+                fclose(fp);
+            } else if(tracePath) {
+                perror(tracePath);
+            }
+            if(producedLen != expectedLen)
+                responsesMatch = 0;
+        }
+        if(pass == 0 && statePath)
+            final = term; // saved after the results, which it prints into
+        else
+            fvterm_free(term);
+    }
+
+    qsort(latency, samples, sizeof(uint64_t), cmp_u64);
+#define PCT(p) (samples ? latency[(samples - 1) * (p) / 100] : 0)
+
+    printf("{\"chunks\": %zu, \"bytes\": %zu, \"passes\": %d, \"realtime\": %s,\n",
+           chunks, bytes, passes, realtime ? "true" : "false");
+    printf(" \"busy_ns\": %llu, \"mb_per_s\": %.1f, \"ns_per_byte\": %.3f,\n",
+           (unsigned long long) busy,
+           busy ? (bytes * (double) passes / 1048576.0) / (busy / 1e9) : 0.0,
+           bytes ? (double) busy / (bytes * (double) passes) : 0.0);
+    printf(" \"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+           (unsigned long long) PCT(50), (unsigned long long) PCT(90),
+           (unsigned long long) PCT(99), (unsigned long long) PCT(100));
+    printf(" \"responses_match\": %s, \"checksum\": \"%016llx\"",
+           responsesMatch ? "true" : "false", (unsigned long long) checksum);
+    if(haveStats)
+        print_stats(&stats);
+    if(final) {
+        check_state(final, statePath);
+        fvterm_free(final);
+    }
+    printf("}\n");
+
+#undef PCT
+
+    free(latency);
+    free(expected);
+    free(rec.recs);
+    free(file);
+    return 0;
+}
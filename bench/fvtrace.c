@@ -0,0 +1,139 @@
+// fvtrace - decodes a trace ring dumped with fvterm_dumptrace().
+//
+// Prints one line per entry: the time relative to the oldest entry, the
+// cursor position the sequence was dispatched at (1-based, like CUP), and
+// the sequence itself. Sequences the emulator ignored are marked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfvterm.h"
+#include "fvemu.h"
+
+
+static const char *ctrlNames[32] = {
+    "NUL", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK", "BEL",
+    "BS", "HT", "LF", "VT", "FF", "CR", "SO", "SI",
+    "DLE", "DC1", "DC2", "DC3", "DC4", "NAK", "SYN", "ETB",
+    "CAN", "EM", "SUB", "ESC", "FS", "GS", "RS", "US",
+};
+
+
+// The parser keeps private markers (?, >, ...) and intermediates in the same
+// byte; 255 means there was more than one
+static void print_intermed(uint8_t ch)
+{
+    if(ch == 255)
+        printf("<multiple>");
+    else if(ch)
+        putchar(ch);
+}
+
+
+static void print_params(const struct emuTraceEntry *e)
+{
+    for(int i = 0; i < e->nParams && i < TRACE_PARAMS; i++)
+        printf("%s%d", i ? ";" : "", e->params[i]);
+    if(e->nParams > TRACE_PARAMS)
+        printf(";...");
+}
+
+
+static void print_entry(const struct emuTraceEntry *e)
+{
+    switch(e->kind) {
+        case TRACE_TEXT:
+            printf("text, %d bytes", e->params[0]);
+            break;
+
+        case TRACE_CTRL:
+        case TRACE_VT52_CTRL:
+            printf("%s%s", e->kind == TRACE_VT52_CTRL ? "VT52 " : "", ctrlNames[e->final & 0x1f]);
+            break;
+
+        case TRACE_ESC:
+        case TRACE_VT52_ESC:
+            printf("%sESC ", e->kind == TRACE_VT52_ESC ? "VT52 " : "");
+            if(e->kind == TRACE_ESC) print_intermed(e->intermed);
+            putchar(e->final);
+            break;
+
+        case TRACE_C1:
+            printf("C1 %02x", e->final);
+            break;
+
+        case TRACE_CSI:
+            printf("CSI ");
+            if(e->intermed >= 0x3c && e->intermed < 0x40)
+                putchar(e->intermed);
+            // A lone zero is what the parser records for no parameters
+            if(!(e->nParams == 1 && e->params[0] == 0))
+                print_params(e);
+            if(e->intermed && !(e->intermed >= 0x3c && e->intermed < 0x40))
+                print_intermed(e->intermed);
+            putchar(e->final);
+            break;
+
+        case TRACE_OSC:
+            printf("OSC %d, %d bytes", e->params[0], e->params[1]);
+            break;
+
+        case TRACE_DCS:
+            printf("DCS ");
+            if(e->intermed >= 0x3c && e->intermed < 0x40)
+                putchar(e->intermed);
+            if(!(e->nParams == 1 && e->params[0] == 0))
+                print_params(e);
+            if(e->intermed && !(e->intermed >= 0x3c && e->intermed < 0x40))
+                print_intermed(e->intermed);
+            putchar(e->final);
+            break;
+
+        default:
+            printf("unknown entry kind %d", e->kind);
+            break;
+    }
+    if(e->flags & TRACEFLAG_UNHANDLED)
+        printf("  [unhandled]");
+    putchar('\n');
+}
+
+
+int main(int argc, char **argv)
+{
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s trace\n", argv[0]);
+        return 2;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if(!fp) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct fvtraceHeader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+       memcmp(hdr.magic, FVTRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != FVTRACE_VERSION || hdr.entrySize != sizeof(struct emuTraceEntry)) {
+        fprintf(stderr, "%s: not a trace dump this tool understands\n", argv[1]);
+        return 1;
+    }
+
+    struct emuTraceEntry *entries = calloc(hdr.count, sizeof(struct emuTraceEntry));
+    if(fread(entries, sizeof(struct emuTraceEntry), hdr.count, fp) != hdr.count) {
+        fprintf(stderr, "%s: truncated\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    for(uint32_t i = 0; i < hdr.count; i++) {
+        double us = (entries[i].ticks - entries[0].ticks) * hdr.nsPerTick / 1000.0;
+        printf("%+12.3fus %4d,%-4d ", us, entries[i].row + 1, entries[i].col + 1);
+        print_entry(&entries[i]);
+    }
+
+    free(entries);
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 @class TerminalWindow;
 @class TerminalFont;
+struct rowCache;
 
 #define TERMINALVIEW_HSPACE 4
 #define TERMINALVIEW_VSPACE 2
@@ -10,11 +11,18 @@
 {
     IBOutlet TerminalWindow *parent;
     int redrawCounter;
-    BOOL running, redrawPending;
+    BOOL running, redrawPending, indexedRender;
+    NSTimer *blinkTimer;
+    BOOL cursorBlinkOff;
+    BOOL hasSelection;
+    int selStartRow, selStartCol, selEndRow, selEndCol;
+    struct rowCache *rowCache;
 @public
     TerminalFont *font;
 }
 - (void)resizeForTerminal;
+- (void)setSelectionFromRow:(int)r1 col:(int)c1 toRow:(int)r2 col:(int)c2;
+- (void)clearSelection;
 + (void)releaseBitmaps:(void **)bmap;
 @end
 
@@ -8,6 +8,8 @@ static CGColorSpaceRef cspace = nil;
 
 NSString * const fallbackFont = @"fixed13";
 
+static void rowCacheFree(struct rowCache *cache);
+
 
 @implementation TerminalView
 
@@ -25,6 +27,8 @@ NSString * const fallbackFont = @"fixed13";
 
     [font retain];
 
+    indexedRender = [dflt boolForKey:@"indexedRendering"];
+
     if(cspace == nil)
         cspace = CGColorSpaceCreateDeviceRGB();
 
@@ -48,6 +52,8 @@ NSString * const fallbackFont = @"fixed13";
 
 - (void)dealloc
 {
+    [blinkTimer invalidate];
+    rowCacheFree(rowCache);
     [font release];
     [[NSNotificationCenter defaultCenter] removeObserver:self];
     [[NSRunLoop mainRunLoop] cancelPerformSelectorsWithTarget:self];
@@ -116,95 +122,573 @@ static const uint8_t * getPage(TerminalFont *font, int page, unichar *glyph) {
 } while(0)
 
 
-static void render(TerminalView *view, struct termRow *row)
+// Each row points at a struct rowImage in bitmaps[0], which holds the
+// rasterized pixels and the CGImage wrapping them. Row images are refcounted
+// and shared: they're also kept in a small per-view cache keyed by the cells
+// they were rendered from, so a row whose contents match something rendered
+// recently (a redrawn prompt, a pager going back and forth) reuses that image
+// instead of being rasterized again.
+//
+// Indexed row images store per-row palette indices rather than colours, which
+// are only looked up when the CGImage is built; a palette change then costs a
+// new colour table per image instead of a full re-rasterize, and the pixels
+// take a quarter of the space.
+
+enum {
+    ROWIMAGE_RGBA,
+    ROWIMAGE_INDEXED,
+};
+
+struct rowImage {
+    int refs;
+    int format, cols;
+    int paletteVersion;
+    uint64_t hash;
+    uint64_t *chars; // the cells this was rendered from
+    CGImageRef cgimg;
+    int nColors;
+    uint16_t colors[256]; // local index -> emulator palette index
+    uint8_t pixels[];
+};
+
+#define ROWCACHE_WAYS 4
+
+struct rowCacheEntry {
+    struct rowImage *img;
+    unsigned lastUse;
+};
+
+struct rowCache {
+    int nSets;
+    unsigned tick;
+    struct rowCacheEntry entries[];
+};
+
+struct cellStyle {
+    const uint8_t *glyph; // top pixel row of the glyph in its font page
+    int fg, bg;
+    uint32_t attr;
+};
+
+
+static void imageRelease(struct rowImage *img)
 {
-    TerminalFont *font = view->font;
-    uint32_t *plt = view->parent->state.palette;
-    int charHeight = font->height;
-    int charWidth = font->width;
-    int cols = view->parent->state.wCols;
+    if(--img->refs > 0) return;
+    if(img->cgimg) CGImageRelease(img->cgimg);
+    free(img->chars);
+    free(img);
+}
 
-    size_t rowLen = charWidth * cols * sizeof(uint32_t);
-    uint32_t *rowBitmap = row->bitmaps[0];
-    if(rowBitmap == NULL)
-        rowBitmap = row->bitmaps[0] = malloc(rowLen * charHeight);
 
+static uint64_t hashCells(const uint64_t *chars, int cols)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ cols;
     for(int i = 0; i < cols; i++) {
-        uint64_t ch = row->chars[i];
-        uint16_t charGlyph = ch & 65535;
-        int fontPage = charGlyph >> 8;
-
-        uint32_t charAttr = ch >> 32;
-        int charFG = PAL_DEFAULT_FG, charBG = PAL_DEFAULT_BG;
-        if(charAttr & ATTR_CUSTFG)
-            charFG = (charAttr & ATTR_FG_MASK);
-        if(charAttr & ATTR_CUSTBG)
-            charBG = (charAttr & ATTR_BG_MASK) >> 8;
-
-        // reverse video = swap fg/bg
-        if(!!(view->parent->state.flags & MODE_INVERT) ^ !!(charAttr & ATTR_REVERSE)) {
-            int tmp = charFG;
-            charFG = charBG;
-            charBG = tmp;
+        h ^= chars[i];
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+
+static struct rowCache * rowCacheCreate(int rows)
+{
+    // Roughly two screens' worth of rows, in sets of ROWCACHE_WAYS
+    int nSets = 8;
+    while(nSets * ROWCACHE_WAYS < 2 * rows && nSets < 256)
+        nSets *= 2;
+
+    struct rowCache *cache = calloc(1, sizeof(struct rowCache) +
+                                    nSets * ROWCACHE_WAYS * sizeof(struct rowCacheEntry));
+    cache->nSets = nSets;
+    return cache;
+}
+
+
+static void rowCacheFree(struct rowCache *cache)
+{
+    if(!cache) return;
+    for(int i = 0; i < cache->nSets * ROWCACHE_WAYS; i++) {
+        if(cache->entries[i].img)
+            imageRelease(cache->entries[i].img);
+    }
+    free(cache);
+}
+
+
+static struct rowImage * rowCacheLookup(struct rowCache *cache, uint64_t hash,
+                                        const uint64_t *chars, int cols,
+                                        int paletteVersion)
+{
+    struct rowCacheEntry *set = &cache->entries[(hash & (cache->nSets - 1)) * ROWCACHE_WAYS];
+    for(int w = 0; w < ROWCACHE_WAYS; w++) {
+        struct rowImage *img = set[w].img;
+        if(!img || img->hash != hash || img->cols != cols)
+            continue;
+        if(memcmp(img->chars, chars, cols * sizeof(uint64_t)) != 0)
+            continue;
+
+        // RGBA images have their colours baked in, so they go stale
+        if(img->format == ROWIMAGE_RGBA && img->paletteVersion != paletteVersion) {
+            imageRelease(img);
+            set[w].img = NULL;
+            return NULL;
         }
 
-        if(charAttr & ATTR_INVIS) {
-            charFG = charBG;
+        set[w].lastUse = ++cache->tick;
+        return img;
+    }
+    return NULL;
+}
+
+
+static void rowCacheInsert(struct rowCache *cache, struct rowImage *img)
+{
+    struct rowCacheEntry *set = &cache->entries[(img->hash & (cache->nSets - 1)) * ROWCACHE_WAYS];
+    struct rowCacheEntry *victim = &set[0];
+    for(int w = 0; w < ROWCACHE_WAYS; w++) {
+        if(!set[w].img) {
+            victim = &set[w];
+            break;
         }
+        if(set[w].lastUse < victim->lastUse)
+            victim = &set[w];
+    }
 
-        // make this char bold
-        if(charAttr & ATTR_BOLD) {
-            fontPage += 256;
-            if(font->brightbold) {
-                if(charFG < 8)
-                    charFG += 8;
-                if(charFG == PAL_DEFAULT_FG)
-                    charFG = 15;
-            }
+    if(victim->img)
+        imageRelease(victim->img);
+    img->refs++;
+    victim->img = img;
+    victim->lastUse = ++cache->tick;
+}
+
+
+static void styleCell(TerminalView *view, uint64_t ch, struct cellStyle *cs)
+{
+    TerminalFont *font = view->font;
+    uint16_t charGlyph = ch & 65535;
+    int fontPage = charGlyph >> 8;
+
+    uint32_t charAttr = ch >> 32;
+    int charFG = PAL_DEFAULT_FG, charBG = PAL_DEFAULT_BG;
+    if(charAttr & ATTR_CUSTFG)
+        charFG = (charAttr & ATTR_FG_MASK);
+    if(charAttr & ATTR_CUSTBG)
+        charBG = (charAttr & ATTR_BG_MASK) >> 8;
+
+    // reverse video = swap fg/bg (DECSCNM is an overlay, see below)
+    if(charAttr & ATTR_REVERSE) {
+        int tmp = charFG;
+        charFG = charBG;
+        charBG = tmp;
+    }
+
+    if(charAttr & ATTR_INVIS) {
+        charFG = charBG;
+    }
+
+    // make this char bold
+    if(charAttr & ATTR_BOLD) {
+        fontPage += 256;
+        if(font->brightbold) {
+            if(charFG < 8)
+                charFG += 8;
+            if(charFG == PAL_DEFAULT_FG)
+                charFG = 15;
         }
+    }
+
+    const uint8_t *src = getPage(font, fontPage, &charGlyph);
+    OFFSET_FONT(src, 0, charGlyph);
+
+    cs->glyph = src;
+    cs->fg = charFG;
+    cs->bg = charBG;
+    cs->attr = charAttr;
+}
+
+
+static void rasterizeRGBA(TerminalView *view, const uint64_t *chars, struct rowImage *img)
+{
+    TerminalFont *font = view->font;
+    uint32_t *plt = view->parent->state.palette;
+    int charWidth = font->width;
+    int cols = img->cols;
+    int fontStride = charWidth * FVFONT_CHARS_WIDE;
+    uint32_t *rowBitmap = (uint32_t *) img->pixels;
+
+    for(int i = 0; i < cols; i++) {
+        struct cellStyle cs;
+        styleCell(view, chars[i], &cs);
+        uint32_t fg = plt[cs.fg], bg = plt[cs.bg];
 
-        for(int cr = 0; cr < charHeight; cr++) {
+        for(int cr = 0; cr < font->height; cr++) {
             uint32_t *dst = &rowBitmap[charWidth * (cols * cr + i)];
-            //bmap += charWidth * (cols * cr + i);
-            const uint8_t *src = getPage(font, fontPage, &charGlyph);
-            OFFSET_FONT(src, cr, charGlyph);
+            const uint8_t *src = cs.glyph - cr * fontStride;
             for(int cc = 0; cc < charWidth; cc++)
-                *dst++ = *src++ ? plt[charFG] : plt[charBG];
+                *dst++ = *src++ ? fg : bg;
         }
 
-        if(charAttr & ATTR_UNDERLINE) {
+        if(cs.attr & ATTR_UNDERLINE) {
             uint32_t *dst = &rowBitmap[charWidth * (cols * font->baseline + i)];
-            memset_pattern4(dst, &plt[charFG], charWidth * sizeof(*dst));
+            memset_pattern4(dst, &fg, charWidth * sizeof(*dst));
         }
 
-        if(charAttr & ATTR_STRIKE) {
+        if(cs.attr & ATTR_STRIKE) {
             uint32_t *dst = &rowBitmap[charWidth * (cols * font->midline + i)];
-            memset_pattern4(dst, &plt[charFG], charWidth * sizeof(*dst));
+            memset_pattern4(dst, &fg, charWidth * sizeof(*dst));
+        }
+    }
+}
+
+
+static int localColor(struct rowImage *img, int16_t *map, int color)
+{
+    if(map[color] < 0) {
+        if(img->nColors == 256) return -1;
+        map[color] = img->nColors;
+        img->colors[img->nColors++] = color;
+    }
+    return map[color];
+}
+
+
+static BOOL rasterizeIndexed(TerminalView *view, const uint64_t *chars, struct rowImage *img)
+{
+    TerminalFont *font = view->font;
+    int charWidth = font->width;
+    int cols = img->cols;
+    int fontStride = charWidth * FVFONT_CHARS_WIDE;
+    uint8_t *rowBitmap = img->pixels;
+
+    int16_t map[256 + 2];
+    memset(map, 0xff, sizeof(map));
+    img->nColors = 0;
+
+    for(int i = 0; i < cols; i++) {
+        struct cellStyle cs;
+        styleCell(view, chars[i], &cs);
+        int fg = localColor(img, map, cs.fg);
+        int bg = localColor(img, map, cs.bg);
+        if(fg < 0 || bg < 0)
+            return NO; // more colours on this row than fit in 8 bits
+
+        for(int cr = 0; cr < font->height; cr++) {
+            uint8_t *dst = &rowBitmap[charWidth * (cols * cr + i)];
+            const uint8_t *src = cs.glyph - cr * fontStride;
+            for(int cc = 0; cc < charWidth; cc++)
+                *dst++ = *src++ ? fg : bg;
+        }
+
+        if(cs.attr & ATTR_UNDERLINE)
+            memset(&rowBitmap[charWidth * (cols * font->baseline + i)], fg, charWidth);
+
+        if(cs.attr & ATTR_STRIKE)
+            memset(&rowBitmap[charWidth * (cols * font->midline + i)], fg, charWidth);
+    }
+
+    return YES;
+}
+
+
+static void buildImage(TerminalView *view, struct rowImage *img)
+{
+    uint32_t *plt = view->parent->state.palette;
+    TerminalFont *font = view->font;
+    size_t width = font->width * img->cols;
+    size_t bpp = (img->format == ROWIMAGE_INDEXED) ? 1 : 4;
+
+    CGColorSpaceRef space = cspace, indexed = NULL;
+    CGBitmapInfo info = kCGBitmapByteOrder32Host;
+    if(img->format == ROWIMAGE_INDEXED) {
+        uint8_t table[256 * 3];
+        for(int i = 0; i < img->nColors; i++) {
+            uint32_t color = plt[img->colors[i]];
+            table[3 * i + 0] = color >> 24;
+            table[3 * i + 1] = color >> 16;
+            table[3 * i + 2] = color >> 8;
         }
+        space = indexed = CGColorSpaceCreateIndexed(cspace, img->nColors - 1, table);
+        info = (CGBitmapInfo) kCGImageAlphaNone;
     }
 
-    CGDataProviderRef provider = CGDataProviderCreateWithData(nil, row->bitmaps[0], rowLen * charHeight, nil);
+    CGDataProviderRef provider = CGDataProviderCreateWithData(nil, img->pixels, width * bpp * font->height, nil);
 
-    if(row->bitmaps[1])
-        CGImageRelease(row->bitmaps[1]);
+    if(img->cgimg)
+        CGImageRelease(img->cgimg);
 
-    CGImageRef img = CGImageCreate(cols * charWidth, charHeight,
-                                   8, 32, rowLen,
-                                   cspace, kCGBitmapByteOrder32Host,
-                                   provider, nil, NO,
-                                   kCGRenderingIntentDefault);
+    img->cgimg = CGImageCreate(width, font->height,
+                               8, 8 * bpp, width * bpp,
+                               space, info,
+                               provider, nil, NO,
+                               kCGRenderingIntentDefault);
 
     CGDataProviderRelease(provider);
-    row->bitmaps[1] = img;
+    if(indexed)
+        CGColorSpaceRelease(indexed);
+
+    img->paletteVersion = view->parent->state.paletteVersion;
+}
+
+
+static struct rowImage * allocImage(int format, int cols, size_t pixels)
+{
+    size_t bpp = (format == ROWIMAGE_INDEXED) ? 1 : 4;
+    struct rowImage *img = malloc(sizeof(struct rowImage) + pixels * bpp);
+    img->format = format;
+    img->cols = cols;
+    img->cgimg = NULL;
+    img->chars = NULL;
+    img->refs = 1;
+    return img;
+}
+
+
+static struct rowImage * rasterize(TerminalView *view, const uint64_t *chars, uint64_t hash)
+{
+    TerminalFont *font = view->font;
+    int cols = view->parent->state.wCols;
+    size_t pixels = (size_t) font->width * cols * font->height;
+
+    struct rowImage *img = NULL;
+    if(view->indexedRender) {
+        img = allocImage(ROWIMAGE_INDEXED, cols, pixels);
+        if(!rasterizeIndexed(view, chars, img)) {
+            imageRelease(img);
+            img = NULL;
+        }
+    }
+    if(img == NULL) {
+        img = allocImage(ROWIMAGE_RGBA, cols, pixels);
+        rasterizeRGBA(view, chars, img);
+    }
+
+    img->hash = hash;
+    img->chars = malloc(cols * sizeof(uint64_t));
+    memcpy(img->chars, chars, cols * sizeof(uint64_t));
+    buildImage(view, img);
+    return img;
+}
+
+
+static BOOL rowNeedsRender(TerminalView *view, struct termRow *row)
+{
+    struct rowImage *img = row->bitmaps[0];
+    return (row->flags & TERMROW_DIRTY) || img == NULL ||
+        (img->format == ROWIMAGE_RGBA &&
+         img->paletteVersion != view->parent->state.paletteVersion);
+}
 
+
+// Takes over the caller's reference to img
+static void attachImage(struct termRow *row, struct rowImage *img)
+{
+    if(row->bitmaps[0])
+        imageRelease(row->bitmaps[0]);
+    row->bitmaps[0] = img;
     row->flags &= ~TERMROW_DIRTY;
 }
 
 
+static struct rowImage * cachedImage(TerminalView *view, struct termRow *row, uint64_t hash)
+{
+    struct emuState *S = &view->parent->state;
+    if(view->rowCache == NULL)
+        view->rowCache = rowCacheCreate(S->wRows);
+
+    struct rowImage *img = rowCacheLookup(view->rowCache, hash, row->chars,
+                                          S->wCols, S->paletteVersion);
+    if(img) img->refs++;
+    return img;
+}
+
+
+static void render(TerminalView *view, struct termRow *row)
+{
+    int cols = view->parent->state.wCols;
+    uint64_t hash = hashCells(row->chars, cols);
+    struct rowImage *img = cachedImage(view, row, hash);
+    if(img == NULL) {
+        img = rasterize(view, row->chars, hash);
+        rowCacheInsert(view->rowCache, img);
+    }
+    attachImage(row, img);
+}
+
+
+// Font pages are unpacked lazily and TerminalFont isn't thread-safe, so make
+// sure everything a row needs is loaded before rasterizing it off the main
+// thread.
+static void preloadPages(TerminalView *view, const uint64_t *chars, int cols)
+{
+    TerminalFont *font = view->font;
+    for(int i = 0; i < cols; i++) {
+        int page = (chars[i] & 65535) >> 8;
+        if((chars[i] >> 32) & ATTR_BOLD)
+            page += 256;
+        if(!font->unpackedPages[page])
+            getPage(font, page, NULL);
+    }
+}
+
+
+// Rows below this are rendered on the main thread; dispatching isn't free.
+#define PARALLEL_RENDER_MIN_ROWS 8
+
+static void renderRows(TerminalView *view, int first, int last)
+{
+    struct emuState *S = &view->parent->state;
+    int cols = S->wCols;
+    int n = 0;
+    if(last <= first) return;
+
+    struct termRow **todo = malloc((last - first) * sizeof(struct termRow *));
+    uint64_t *hashes = malloc((last - first) * sizeof(uint64_t));
+    int *same = malloc((last - first) * sizeof(int));
+
+    // Resolve what we can from the cache, and collect the rest. Rows that
+    // are identical to another one in this batch (a freshly cleared screen,
+    // say) are only rasterized once.
+    for(int r = first; r < last; r++) {
+        struct termRow *row = S->rows[r];
+        if(!rowNeedsRender(view, row))
+            continue;
+
+        uint64_t hash = hashCells(row->chars, cols);
+        struct rowImage *img = cachedImage(view, row, hash);
+        if(img) {
+            attachImage(row, img);
+            continue;
+        }
+
+        same[n] = -1;
+        for(int j = 0; j < n; j++) {
+            if(hashes[j] == hash && same[j] < 0 &&
+               memcmp(todo[j]->chars, row->chars, cols * sizeof(uint64_t)) == 0) {
+                same[n] = j;
+                break;
+            }
+        }
+        if(same[n] < 0)
+            preloadPages(view, row->chars, cols);
+
+        todo[n] = row;
+        hashes[n] = hash;
+        n++;
+    }
+
+    struct rowImage **imgs = calloc(n, sizeof(struct rowImage *));
+
+    if(n < PARALLEL_RENDER_MIN_ROWS) {
+        for(int i = 0; i < n; i++) {
+            if(same[i] < 0)
+                imgs[i] = rasterize(view, todo[i]->chars, hashes[i]);
+        }
+    } else {
+        // Each row image is independent; the only shared state the workers
+        // touch (font pages, palette) is read-only by now.
+        dispatch_apply(n, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t i) {
+            if(same[i] < 0)
+                imgs[i] = rasterize(view, todo[i]->chars, hashes[i]);
+        });
+    }
+
+    for(int i = 0; i < n; i++) {
+        struct rowImage *img = imgs[i];
+        if(same[i] >= 0) {
+            img = imgs[same[i]];
+            img->refs++;
+        } else {
+            rowCacheInsert(view->rowCache, img);
+        }
+        attachImage(todo[i], img);
+    }
+
+    free(imgs);
+    free(same);
+    free(hashes);
+    free(todo);
+}
+
+
+// Returns an up-to-date image for a row, only rendering it again if the
+// contents changed or its colours are baked into the pixels.
+static CGImageRef rowImage(TerminalView *view, struct termRow *row)
+{
+    if(rowNeedsRender(view, row))
+        render(view, row);
+
+    struct rowImage *img = row->bitmaps[0];
+    if(img->paletteVersion != view->parent->state.paletteVersion)
+        buildImage(view, img);
+
+    return img->cgimg;
+}
+
+
 + (void)releaseBitmaps:(void **)bmaps
 {
-    if(bmaps[0]) free(bmaps[0]);
-    if(bmaps[1]) CGImageRelease(bmaps[1]);
+    if(bmaps[0]) imageRelease(bmaps[0]);
+}
+
+
+#pragma mark - Compositing
+
+
+// Everything below is drawn over the cached row images rather than baked into
+// them, so toggling any of it never forces a row to be rasterized again.
+
+static CGRect cellRect(TerminalView *view, int row, int col, int ncols)
+{
+    TerminalFont *font = view->font;
+    CGRect r = {
+        .origin = { TERMINALVIEW_HSPACE + font->width * col,
+                    TERMINALVIEW_VSPACE + font->height * row },
+        .size = { font->width * ncols, font->height },
+    };
+    return r;
+}
+
+
+static void drawSelection(TerminalView *view, CGContextRef ctx)
+{
+    int cols = view->parent->state.wCols;
+    int rows = view->parent->state.wRows;
+
+    CGContextSetBlendMode(ctx, kCGBlendModeDifference);
+    CGContextSetGrayFillColor(ctx, 1.0, 1.0);
+    for(int r = view->selStartRow; r <= view->selEndRow && r < rows; r++) {
+        int from = (r == view->selStartRow) ? view->selStartCol : 0;
+        int to = (r == view->selEndRow) ? view->selEndCol : cols - 1;
+        if(to >= cols) to = cols - 1;
+        if(from > to) continue;
+        CGContextFillRect(ctx, cellRect(view, r, from, to - from + 1));
+    }
+    CGContextSetBlendMode(ctx, kCGBlendModeNormal);
+}
+
+
+static void drawInversion(TerminalView *view, CGContextRef ctx)
+{
+    CGRect all = cellRect(view, 0, 0, view->parent->state.wCols);
+    all.size.height *= view->parent->state.wRows;
+
+    CGContextSetBlendMode(ctx, kCGBlendModeDifference);
+    CGContextSetGrayFillColor(ctx, 1.0, 1.0);
+    CGContextFillRect(ctx, all);
+    CGContextSetBlendMode(ctx, kCGBlendModeNormal);
+}
+
+
+static void drawCursor(TerminalView *view, CGContextRef ctx)
+{
+    struct emuState *S = &view->parent->state;
+    if(!(S->flags & MODE_SHOWCURSOR)) return;
+    if((S->flags & MODE_CURSORBLINK) && view->cursorBlinkOff) return;
+
+    CGContextSetRGBFillColor(ctx, 0.0, 1.0, 0.0, 0.7); // XXX: Cursor color shouldn't be constant
+    CGContextFillRect(ctx, cellRect(view, S->cRow, S->cCol, 1));
 }
 
 
@@ -213,34 +697,32 @@ static void render(TerminalView *view, struct termRow *row)
     CGContextRef ctx = [[NSGraphicsContext currentContext] graphicsPort];
 
     CGContextSetGrayFillColor(ctx, 0.133, 1.0); // XXX: constant??
-    CGContextFillRect(ctx, NSRectToCGRect([self frame]));
+    CGContextFillRect(ctx, NSRectToCGRect(rect));
 
-    int width = parent->state.wCols * font->width;
-    CGRect dstRect = {
-        .origin = { TERMINALVIEW_HSPACE, TERMINALVIEW_VSPACE },
-        .size = { width, font->height },
-    };
+    // Only the rows that intersect the invalidated area need drawing; a
+    // cursor blink, for instance, only touches a single one.
+    int rows = parent->state.wRows;
+    int firstRow = (NSMinY(rect) - TERMINALVIEW_VSPACE) / font->height;
+    int lastRow = (NSMaxY(rect) - TERMINALVIEW_VSPACE + font->height - 1) / font->height;
+    if(firstRow < 0) firstRow = 0;
+    if(lastRow > rows) lastRow = rows;
+
+    // Render whatever changed up front, so it can be spread across cores
+    renderRows(self, firstRow, lastRow);
 
-    // Draw rows, rendering as necessary
-    for(int r = 0; r < parent->state.wRows; r++) {
+    // Draw rows
+    for(int r = firstRow; r < lastRow; r++) {
         struct termRow *row = parent->state.rows[r];
-        if(row->flags & TERMROW_DIRTY)
-            render(self, row);
-        CGContextDrawImage(ctx, dstRect, row->bitmaps[1]);
-        dstRect.origin.y += font->height;
+        CGContextDrawImage(ctx, cellRect(self, r, 0, parent->state.wCols), rowImage(self, row));
     }
 
-    if(parent->state.flags & MODE_SHOWCURSOR) {
-        CGRect cursor = {
-            .origin = { TERMINALVIEW_HSPACE, TERMINALVIEW_VSPACE },
-            .size = { font->width, font->height },
-        };
-        cursor.origin.x += font->width  * parent->state.cCol;
-        cursor.origin.y += font->height * parent->state.cRow;
+    if(hasSelection)
+        drawSelection(self, ctx);
 
-        CGContextSetRGBFillColor(ctx, 0.0, 1.0, 0.0, 0.7); // XXX: Cursor color shouldn't be constant
-        CGContextFillRect(ctx, cursor);
-    }
+    if(parent->state.flags & MODE_INVERT)
+        drawInversion(self, ctx);
+
+    drawCursor(self, ctx);
 
     running = YES;
     redrawPending = NO;
@@ -248,6 +730,45 @@ static void render(TerminalView *view, struct termRow *row)
 }
 
 
+#pragma mark - Selection and cursor
+
+
+- (void)setSelectionFromRow:(int)r1 col:(int)c1 toRow:(int)r2 col:(int)c2
+{
+    // Normalize so that the start always comes first in reading order
+    if(r2 < r1 || (r2 == r1 && c2 < c1)) {
+        int tr = r1, tc = c1;
+        r1 = r2; c1 = c2;
+        r2 = tr; c2 = tc;
+    }
+    selStartRow = r1;
+    selStartCol = c1;
+    selEndRow = r2;
+    selEndCol = c2;
+    hasSelection = YES;
+    [self setNeedsDisplay:YES];
+}
+
+
+- (void)clearSelection
+{
+    if(!hasSelection) return;
+    hasSelection = NO;
+    [self setNeedsDisplay:YES];
+}
+
+
+- (void)_blinkCursor:(NSTimer *)timer
+{
+    (void) timer;
+
+    cursorBlinkOff = !cursorBlinkOff;
+    if(parent->state.flags & MODE_CURSORBLINK)
+        [self setNeedsDisplayInRect:NSRectFromCGRect(
+            cellRect(self, parent->state.cRow, parent->state.cCol, 1))];
+}
+
+
 - (BOOL)acceptsFirstResponder
 {
     return YES;
@@ -271,6 +792,11 @@ static void render(TerminalView *view, struct termRow *row)
 
 - (void)resizeForTerminal
 {
+    // The cache is sized for the old geometry, and nothing in it can match
+    // rows of a different width anyway.
+    rowCacheFree(rowCache);
+    rowCache = NULL;
+
     int termWidth = parent->state.wCols * font->width + 2 * TERMINALVIEW_HSPACE;
     int termHeight = parent->state.wRows * font->height + 2 * TERMINALVIEW_VSPACE;
     NSRect new_cr = NSMakeRect(0, 0, termWidth, termHeight);
@@ -303,13 +829,32 @@ static void render(TerminalView *view, struct termRow *row)
 }
 
 
+- (void)viewWillMoveToWindow:(NSWindow *)newWindow
+{
+    // The timer retains us, so it has to go before we can be released
+    if(newWindow == nil) {
+        [blinkTimer invalidate];
+        blinkTimer = nil;
+    }
+}
+
+
 - (void)viewDidMoveToWindow
 {
+    if([self window] == nil) return;
+
     // We're definitely running now, so start observing
     [[NSNotificationCenter defaultCenter] addObserver:self
                                              selector:@selector(_gotResized:)
                                                  name:NSViewFrameDidChangeNotification
                                                object:self];
+
+    if(blinkTimer == nil)
+        blinkTimer = [NSTimer scheduledTimerWithTimeInterval:0.5
+                                                      target:self
+                                                    selector:@selector(_blinkCursor:)
+                                                    userInfo:nil
+                                                     repeats:YES];
 }
 
 
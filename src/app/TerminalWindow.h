@@ -7,6 +7,8 @@
     IBOutlet TerminalView *view;
     TerminalPTY *pty;
     NSString *title;
+    NSMutableData *clipboard; // OSC 52 data so far
+    BOOL clipboardDropped;    // too long: ignore the rest of it
     int lastDragX, lastDragY;
 @public
     struct emuState state;
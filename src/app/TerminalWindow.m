@@ -50,6 +50,7 @@
     emu_core_free(&state);
 
     [title release];
+    [clipboard release];
     [pty release];
     [super dealloc];
 }
@@ -275,4 +276,47 @@ void TerminalEmulator_freeRowBitmaps(struct termRow *r)
 }
 
 
+void TerminalEmulator_lineDone(struct emuState *S, int row, int scrolledOff)
+{
+    // tapLines is never set here
+}
+
+
+// OSC 52 sets the general pasteboard, whichever selection it names, once
+// the whole string has come. Strings longer than this are dropped, and the
+// rest of them ignored, so no program can make us hold more.
+#define CLIPBOARD_MAX (4 << 20)
+
+void TerminalEmulator_clipboard(struct emuState *S, const char *selection,
+                                const uint8_t *data, size_t len, int flags)
+{
+    TerminalWindow *self = S->parent;
+    if(!self->clipboardDropped) {
+        if(!self->clipboard)
+            self->clipboard = [[NSMutableData alloc] init];
+        if([self->clipboard length] + len > CLIPBOARD_MAX) {
+            self->clipboardDropped = YES;
+            [self->clipboard release];
+            self->clipboard = nil;
+        } else {
+            [self->clipboard appendBytes:data length:len];
+        }
+    }
+    if(!(flags & (CLIPBOARD_END | CLIPBOARD_ABORT))) return;
+
+    if((flags & CLIPBOARD_END) && self->clipboard) {
+        NSString *text = [[NSString alloc] initWithData:self->clipboard
+                                               encoding:NSUTF8StringEncoding];
+        if(text) {
+            NSPasteboard *pb = [NSPasteboard generalPasteboard];
+            [pb declareTypes:[NSArray arrayWithObject:NSStringPboardType] owner:nil];
+            [pb setString:text forType:NSStringPboardType];
+            [text release];
+        }
+    }
+    [self->clipboard release];
+    self->clipboard = nil;
+    self->clipboardDropped = NO;
+}
+
 @end
\ No newline at end of file
@@ -0,0 +1,349 @@
+// Cell span kernels, in plain C and in SIMD versions picked at run time.
+// Every version of a kernel has to give the same answers; the SIMD ones work
+// a vector at a time and finish the last few cells like the C ones.
+
+#include "fvcells.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+
+#pragma mark - Plain C
+
+
+static void fill_scalar(uint64_t *cells, size_t count, uint64_t value)
+{
+#ifdef NOT_DARWIN
+    for(size_t i = 0; i < count; i++)
+        cells[i] = value;
+#else
+    // memset_pattern8 is highly optimized on x86 :)
+    memset_pattern8(cells, &value, count * 8);
+#endif
+}
+
+
+static size_t mismatch_scalar(const uint64_t *a, const uint64_t *b, size_t count)
+{
+    size_t i = 0;
+    while(i < count && a[i] == b[i])
+        i++;
+    return i;
+}
+
+
+static size_t find_not_scalar(const uint64_t *cells, size_t count, uint64_t value)
+{
+    size_t i = 0;
+    while(i < count && cells[i] == value)
+        i++;
+    return i;
+}
+
+
+static size_t trim_scalar(const uint64_t *cells, size_t count, uint64_t value)
+{
+    while(count > 0 && cells[count - 1] == value)
+        count--;
+    return count;
+}
+
+
+#define IS_CTRL(b) ((b) < 0x20 || ((b) >= 0x7f && (b) < 0xa0))
+
+static size_t find_ctrl_scalar(const uint8_t *bytes, size_t len)
+{
+    size_t i = 0;
+    while(i < len && !IS_CTRL(bytes[i]))
+        i++;
+    return i;
+}
+
+
+#if defined(__x86_64__)
+#pragma mark - SSE2
+
+
+// SSE2 has no 64-bit compare: two cells are equal when all 8 of their bytes
+// are, so each cell is 8 bits of the byte mask
+#define SSE2_EQ_MASK(x, y) _mm_movemask_epi8(_mm_cmpeq_epi32(x, y))
+
+
+static void fill_sse2(uint64_t *cells, size_t count, uint64_t value)
+{
+    __m128i v = _mm_set1_epi64x(value);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *) &cells[i], v);
+        _mm_storeu_si128((__m128i *) &cells[i + 2], v);
+    }
+    for(; i < count; i++)
+        cells[i] = value;
+}
+
+
+static size_t mismatch_sse2(const uint64_t *a, const uint64_t *b, size_t count)
+{
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        int m = SSE2_EQ_MASK(_mm_loadu_si128((const __m128i *) &a[i]),
+                             _mm_loadu_si128((const __m128i *) &b[i]));
+        if(m != 0xffff)
+            return i + ((m & 0xff) == 0xff);
+    }
+    return i + mismatch_scalar(a + i, b + i, count - i);
+}
+
+
+static size_t find_not_sse2(const uint64_t *cells, size_t count, uint64_t value)
+{
+    __m128i v = _mm_set1_epi64x(value);
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        int m = SSE2_EQ_MASK(_mm_loadu_si128((const __m128i *) &cells[i]), v);
+        if(m != 0xffff)
+            return i + ((m & 0xff) == 0xff);
+    }
+    return i + find_not_scalar(cells + i, count - i, value);
+}
+
+
+static size_t trim_sse2(const uint64_t *cells, size_t count, uint64_t value)
+{
+    __m128i v = _mm_set1_epi64x(value);
+    for(; count >= 2; count -= 2) {
+        int m = SSE2_EQ_MASK(_mm_loadu_si128((const __m128i *) &cells[count - 2]), v);
+        if(m != 0xffff)
+            return count - ((m >> 8) == 0xff);
+    }
+    return trim_scalar(cells, count, value);
+}
+
+
+// With the top bit flipped, bytes compare as signed: C0 is below -96 (0x20)
+// and DEL and C1 are -1 (0x7f) to 31 (0x9f)
+static size_t find_ctrl_sse2(const uint8_t *bytes, size_t len)
+{
+    __m128i flip = _mm_set1_epi8((char) 0x80);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &bytes[i]), flip);
+        __m128i c0 = _mm_cmplt_epi8(v, _mm_set1_epi8(-96));
+        __m128i c1 = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(-2)),
+                                   _mm_cmplt_epi8(v, _mm_set1_epi8(32)));
+        int m = _mm_movemask_epi8(_mm_or_si128(c0, c1));
+        if(m)
+            return i + __builtin_ctz(m);
+    }
+    return i + find_ctrl_scalar(bytes + i, len - i);
+}
+
+
+#pragma mark - AVX2
+
+
+#define AVX2 __attribute__((target("avx2")))
+
+// One bit per cell that's equal
+#define AVX2_EQ_MASK(x, y) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, y)))
+
+
+static AVX2 void fill_avx2(uint64_t *cells, size_t count, uint64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i *) &cells[i], v);
+        _mm256_storeu_si256((__m256i *) &cells[i + 4], v);
+    }
+    for(; i < count; i++)
+        cells[i] = value;
+}
+
+
+static AVX2 size_t mismatch_avx2(const uint64_t *a, const uint64_t *b, size_t count)
+{
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        int m = AVX2_EQ_MASK(_mm256_loadu_si256((const __m256i *) &a[i]),
+                             _mm256_loadu_si256((const __m256i *) &b[i]));
+        if(m != 0xf)
+            return i + __builtin_ctz(~m);
+    }
+    return i + mismatch_scalar(a + i, b + i, count - i);
+}
+
+
+static AVX2 size_t find_not_avx2(const uint64_t *cells, size_t count, uint64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        int m = AVX2_EQ_MASK(_mm256_loadu_si256((const __m256i *) &cells[i]), v);
+        if(m != 0xf)
+            return i + __builtin_ctz(~m);
+    }
+    return i + find_not_scalar(cells + i, count - i, value);
+}
+
+
+static AVX2 size_t trim_avx2(const uint64_t *cells, size_t count, uint64_t value)
+{
+    __m256i v = _mm256_set1_epi64x(value);
+    for(; count >= 4; count -= 4) {
+        int m = AVX2_EQ_MASK(_mm256_loadu_si256((const __m256i *) &cells[count - 4]), v);
+        if(m != 0xf)
+            return count - 4 + (32 - __builtin_clz(~m & 0xf));
+    }
+    return trim_scalar(cells, count, value);
+}
+
+
+static AVX2 size_t find_ctrl_avx2(const uint8_t *bytes, size_t len)
+{
+    __m256i flip = _mm256_set1_epi8((char) 0x80);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &bytes[i]), flip);
+        __m256i c0 = _mm256_cmpgt_epi8(_mm256_set1_epi8(-96), v);
+        __m256i c1 = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-2)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8(32), v));
+        uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(c0, c1));
+        if(m)
+            return i + __builtin_ctz(m);
+    }
+    return i + find_ctrl_sse2(bytes + i, len - i);
+}
+
+
+#elif defined(__aarch64__)
+#pragma mark - NEON
+
+
+static void fill_neon(uint64_t *cells, size_t count, uint64_t value)
+{
+    uint64x2_t v = vdupq_n_u64(value);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        vst1q_u64(&cells[i], v);
+        vst1q_u64(&cells[i + 2], v);
+    }
+    for(; i < count; i++)
+        cells[i] = value;
+}
+
+
+static size_t mismatch_neon(const uint64_t *a, const uint64_t *b, size_t count)
+{
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(&a[i]), vld1q_u64(&b[i]));
+        if(vminvq_u32(vreinterpretq_u32_u64(eq)) == 0)
+            return i + (vgetq_lane_u64(eq, 0) != 0);
+    }
+    return i + mismatch_scalar(a + i, b + i, count - i);
+}
+
+
+static size_t find_not_neon(const uint64_t *cells, size_t count, uint64_t value)
+{
+    uint64x2_t v = vdupq_n_u64(value);
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(&cells[i]), v);
+        if(vminvq_u32(vreinterpretq_u32_u64(eq)) == 0)
+            return i + (vgetq_lane_u64(eq, 0) != 0);
+    }
+    return i + find_not_scalar(cells + i, count - i, value);
+}
+
+
+static size_t trim_neon(const uint64_t *cells, size_t count, uint64_t value)
+{
+    uint64x2_t v = vdupq_n_u64(value);
+    for(; count >= 2; count -= 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(&cells[count - 2]), v);
+        if(vminvq_u32(vreinterpretq_u32_u64(eq)) == 0)
+            return count - (vgetq_lane_u64(eq, 1) != 0);
+    }
+    return trim_scalar(cells, count, value);
+}
+
+
+static size_t find_ctrl_neon(const uint8_t *bytes, size_t len)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(&bytes[i]);
+        uint8x16_t ctrl = vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)),
+                                   vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x7f)),
+                                            vcltq_u8(v, vdupq_n_u8(0xa0))));
+        if(vmaxvq_u8(ctrl))
+            break;
+    }
+    return i + find_ctrl_scalar(bytes + i, len - i);
+}
+#endif
+
+
+#pragma mark - Dispatch
+
+
+#define KERNELS(name) { #name, fill_##name, mismatch_##name, find_not_##name, trim_##name, \
+                        find_ctrl_##name }
+
+// Worst to best
+static const struct emuCellKernels kernels[] = {
+    KERNELS(scalar),
+#if defined(__x86_64__)
+    KERNELS(sse2),
+    KERNELS(avx2),
+#elif defined(__aarch64__)
+    KERNELS(neon),
+#endif
+};
+
+struct emuCellKernels emu_cells = KERNELS(scalar);
+
+
+static int cpu_has(const struct emuCellKernels *k)
+{
+#if defined(__x86_64__)
+    if(k->fill == fill_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+
+static void pick_kernels(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    const char *want = getenv("FVTERM_CELLS");
+    int n = sizeof(kernels) / sizeof(kernels[0]);
+    int best = 0;
+    for(int i = 0; i < n; i++) {
+        if(!cpu_has(&kernels[i])) continue;
+        if(want && strcmp(want, kernels[i].name) == 0) {
+            best = i;
+            break;
+        }
+        best = i;
+    }
+    emu_cells = kernels[best];
+}
+
+
+void emu_cells_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, pick_kernels);
+}
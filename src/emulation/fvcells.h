@@ -0,0 +1,86 @@
+#ifndef _FVCELLS_H
+#define _FVCELLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Kernels over spans of cells, for everything that fills, shifts, copies or
+// scans rows, and over the bytes of control strings. The ones worth
+// vectorizing go through emu_cells, which emu_cells_init() points at the best
+// versions the CPU has (SSE2 or AVX2 on x86-64, NEON on arm64, plain C
+// otherwise); until then it's the plain C ones. Setting FVTERM_CELLS to a
+// kernel set's name picks that one instead, if the CPU has it. Moves and
+// copies are libc's, which already does this.
+
+struct emuCellKernels {
+    const char *name;
+    void (*fill)(uint64_t *cells, size_t count, uint64_t value);
+    // Index of the first cell that differs, or count if none does
+    size_t (*mismatch)(const uint64_t *a, const uint64_t *b, size_t count);
+    // Index of the first cell that isn't value, or count if they all are
+    size_t (*find_not)(const uint64_t *cells, size_t count, uint64_t value);
+    // How many cells are left without the trailing ones that are value
+    size_t (*trim)(const uint64_t *cells, size_t count, uint64_t value);
+    // Index of the first C0, DEL or C1 byte, or len if there's none
+    size_t (*find_ctrl)(const uint8_t *bytes, size_t len);
+};
+
+extern struct emuCellKernels emu_cells;
+
+void emu_cells_init(void);
+
+
+static inline void emu_cells_fill(uint64_t *cells, size_t count, uint64_t value)
+{
+    emu_cells.fill(cells, count, value);
+}
+
+static inline void emu_cells_copy(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    memcpy(dst, src, count * sizeof(uint64_t));
+}
+
+static inline void emu_cells_move(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    memmove(dst, src, count * sizeof(uint64_t));
+}
+
+// Moves the count cells of a span right by shift, filling the ones it opens up
+// at the start with value; cells pushed past the end are lost
+static inline void emu_cells_shift_right(uint64_t *cells, size_t count, size_t shift, uint64_t value)
+{
+    if(shift > count) shift = count;
+    memmove(cells + shift, cells, (count - shift) * sizeof(uint64_t));
+    emu_cells.fill(cells, shift, value);
+}
+
+// Moves the count cells of a span left by shift, filling the end with value
+static inline void emu_cells_shift_left(uint64_t *cells, size_t count, size_t shift, uint64_t value)
+{
+    if(shift > count) shift = count;
+    memmove(cells, cells + shift, (count - shift) * sizeof(uint64_t));
+    emu_cells.fill(cells + count - shift, shift, value);
+}
+
+static inline int emu_cells_equal(const uint64_t *a, const uint64_t *b, size_t count)
+{
+    return emu_cells.mismatch(a, b, count) == count;
+}
+
+static inline size_t emu_cells_find_not(const uint64_t *cells, size_t count, uint64_t value)
+{
+    return emu_cells.find_not(cells, count, value);
+}
+
+static inline size_t emu_cells_trim(const uint64_t *cells, size_t count, uint64_t value)
+{
+    return emu_cells.trim(cells, count, value);
+}
+
+static inline size_t emu_bytes_find_ctrl(const uint8_t *bytes, size_t len)
+{
+    return emu_cells.find_ctrl(bytes, len);
+}
+
+#endif // _FVCELLS_H
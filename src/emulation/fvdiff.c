@@ -0,0 +1,697 @@
+// Screen diffs: the bytes that turn what one terminal shows into what another
+// shows, for mirroring a session to remote viewers. The host keeps a shadow
+// terminal holding what the viewer has, sends it fvterm_diff(shadow, live)
+// and feeds the same bytes to the shadow.
+//
+// Like mosh's display diffs, this looks for a vertical shift first (a scroll
+// is a few bytes however many rows it moves), then repaints the cells that
+// still differ, choosing the cheapest cursor motion, clearing blank tails with
+// EL, blank runs with ECH and, optionally, repeated characters with REP.
+// Only what's visible is synchronized: cells and their OSC 8 links, the
+// cursor and margins, the palette, the title, and the reverse-video and
+// cursor modes. Sixel graphics aren't: viewers get the text around them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfvterm.h"
+#include "fvemu.h"
+#include "fvcells.h"
+#include "fvwidth.h"
+#include "DefaultColors.h"
+
+
+#define BLANK_GLYPH     0x20
+#define MAX_GAP         4   // unchanged cells worth repainting to join two runs
+#define ECH_MIN         6   // blank cells worth an ECH rather than printing them
+#define REP_MIN         6   // repeated cells worth a REP
+#define SCROLL_MIN_GAIN 16  // non-blank cells a scroll must save
+
+#define CELL_ATTR(c)    ((uint32_t) ((c) >> 32))
+#define IS_BLANK(c)     ((uint32_t) (c) == BLANK_GLYPH) // and not linked
+#define NO_GLYPH        FVTERM_GLYPH_MASK // no cell has it, so it matches none
+#define IS_SPACER(c)    (CELL_GLYPH(c) == CELL_SPACER)
+
+struct diff {
+    FILE *fp;
+    size_t len;
+    int flags;
+
+    // Diffs are mostly single characters, so they're gathered here rather
+    // than going through stdio one at a time
+    char buf[4096];
+    int bufLen;
+
+    int rows, cols;
+    int row, col, wrapnext; // the viewer's cursor; row -1 when unknown
+    int top, bottom;        // and its margins
+    uint32_t attr;          // and SGR state
+    int link;               // and OSC 8 link, in to's table; -1 when unknown
+    int wantTop, wantBottom;
+    struct emuState *to;
+};
+
+
+static void flush(struct diff *d)
+{
+    fwrite(d->buf, 1, d->bufLen, d->fp);
+    d->bufLen = 0;
+}
+
+
+static void emit(struct diff *d, const char *bytes, size_t len)
+{
+    if(d->bufLen + len > sizeof(d->buf)) {
+        flush(d);
+        if(len > sizeof(d->buf)) {
+            fwrite(bytes, 1, len, d->fp);
+            d->len += len;
+            return;
+        }
+    }
+    memcpy(d->buf + d->bufLen, bytes, len);
+    d->bufLen += len;
+    d->len += len;
+}
+
+
+static void emit_str(struct diff *d, const char *str)
+{
+    emit(d, str, strlen(str));
+}
+
+
+#pragma mark - Cursor motion and attributes
+
+
+// The cheapest way to get the cursor to row/col, into buf
+static int motion(struct diff *d, int row, int col, char *buf, size_t size)
+{
+    // CUP always works
+    int best;
+    if(col == 0)
+        best = row == 0 ? snprintf(buf, size, "\e[H") : snprintf(buf, size, "\e[%dH", row + 1);
+    else
+        best = snprintf(buf, size, "\e[%d;%dH", row + 1, col + 1);
+
+    // LF moves down a row, as long as that doesn't scroll
+    if(row == d->row + 1 && d->row < d->bottom) {
+        if(col == 0 && best > 2) {
+            memcpy(buf, "\r\n", 3);
+            best = 2;
+        } else if(col == d->col && !d->wrapnext && best > 1) {
+            memcpy(buf, "\n", 2);
+            best = 1;
+        }
+        return best;
+    }
+
+    if(d->row != row || d->wrapnext)
+        return best;
+
+    char alt[32];
+    int n;
+    if(col == 0)
+        n = snprintf(alt, sizeof(alt), "\r");
+    else if(col == d->col + 1)
+        n = snprintf(alt, sizeof(alt), "\e[C");
+    else if(col > d->col)
+        n = snprintf(alt, sizeof(alt), "\e[%dC", col - d->col);
+    else if(col == d->col - 1)
+        n = snprintf(alt, sizeof(alt), "\b");
+    else
+        n = snprintf(alt, sizeof(alt), "\e[%dD", d->col - col);
+    if(n < best) {
+        memcpy(buf, alt, n + 1);
+        best = n;
+    }
+    return best;
+}
+
+
+static void move_to(struct diff *d, int row, int col)
+{
+    if(d->row == row && d->col == col && !d->wrapnext)
+        return;
+    char buf[32];
+    emit(d, buf, motion(d, row, col, buf, sizeof(buf)));
+    d->row = row;
+    d->col = col;
+    d->wrapnext = 0;
+}
+
+
+static void set_attr(struct diff *d, uint32_t attr)
+{
+    char buf[FVTERM_SGR_MAX];
+    emit(d, buf, fvterm_sgr(buf, d->attr, attr));
+    d->attr = attr;
+}
+
+
+static void set_link(struct diff *d, int link)
+{
+    if(d->link == link) return;
+    const char *id = "";
+    const char *uri = link ? emu_core_getlink(d->to, link, &id) : NULL;
+    emit_str(d, "\e]8;");
+    if(*id) {
+        emit_str(d, "id=");
+        emit_str(d, id);
+    }
+    emit_str(d, ";");
+    if(uri)
+        emit_str(d, uri);
+    emit_str(d, "\a");
+    d->link = link;
+}
+
+
+static void put_cell(struct diff *d, uint64_t cell)
+{
+    set_attr(d, CELL_ATTR(cell));
+    set_link(d, CELL_LINK(cell));
+
+    uint32_t ch = CELL_GLYPH(cell);
+    char buf[4];
+    int n;
+    // Controls can only be printed as overlong UTF-8, which the parser takes
+    if(ch < 0x20) {
+        buf[0] = 0xe0;
+        buf[1] = 0x80;
+        buf[2] = 0x80 | ch;
+        n = 3;
+    } else if(ch < 0x80) {
+        buf[0] = ch;
+        n = 1;
+    } else if(ch < 0x800) {
+        buf[0] = 0xc0 | (ch >> 6);
+        buf[1] = 0x80 | (ch & 0x3f);
+        n = 2;
+    } else if(ch < 0x10000) {
+        buf[0] = 0xe0 | (ch >> 12);
+        buf[1] = 0x80 | ((ch >> 6) & 0x3f);
+        buf[2] = 0x80 | (ch & 0x3f);
+        n = 3;
+    } else {
+        buf[0] = 0xf0 | (ch >> 18);
+        buf[1] = 0x80 | ((ch >> 12) & 0x3f);
+        buf[2] = 0x80 | ((ch >> 6) & 0x3f);
+        buf[3] = 0x80 | (ch & 0x3f);
+        n = 4;
+    }
+    emit(d, buf, n);
+
+    // Printing in the last column leaves a wrap pending rather than moving.
+    // Wide characters are printed over their spacers too.
+    int width = emu_char_width(ch) == 2 ? 2 : 1;
+    if(d->col + width >= d->cols) {
+        d->col = d->cols - 1;
+        d->wrapnext = 1;
+    } else {
+        d->col += width;
+    }
+}
+
+
+#pragma mark - Rows
+
+
+static uint64_t hash_row(const uint64_t *cells, int cols)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int c = 0; c < cols; c++)
+        h = (h ^ cells[c]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+// Cells a scroll would save repainting: the row's non-blank ones
+static int row_weight(const uint64_t *cells, int cols)
+{
+    int n = 0;
+    for(int c = 0; c < cols; c++)
+        n += !IS_BLANK(cells[c]);
+    return n;
+}
+
+
+// Repaints the cells of row r that differ between have and want, from column
+// start on. With wrapInto, the row above is meant to wrap into this one, so
+// the cursor can get to the start of the row by printing past the end of that.
+// Where the EL that ends a row's update starts, if it has one (cols if not):
+// a trailing run of blank cells with the same attributes is one EL
+static int erase_tail(struct diff *d, const uint64_t *have, const uint64_t *want, int start)
+{
+    int cols = d->cols;
+    if(!IS_BLANK(want[cols - 1]))
+        return cols;
+    int tail = start + emu_cells_trim(want + start, cols - start, want[cols - 1]);
+    if(cols - tail < 3 || emu_cells_equal(have + tail, want + tail, cols - tail))
+        tail = cols;
+    return tail;
+}
+
+
+static void diff_row(struct diff *d, int r, const uint64_t *have, const uint64_t *want,
+                     int start, int wrapInto)
+{
+    int cols = d->cols;
+    int tail = erase_tail(d, have, want, start);
+
+    for(int c = start; c < tail; ) {
+        if(have[c] == want[c]) {
+            c++;
+            continue;
+        }
+
+        // Extend the run over short stretches of unchanged cells
+        int end = c + 1;
+        for(int e = end; e < tail && e - end <= MAX_GAP; e++) {
+            if(have[e] != want[e])
+                end = e + 1;
+        }
+
+        // Wide characters are printed whole, and printing over half of one
+        // the viewer has blanks the other half, so runs take both
+        if(c > start && (IS_SPACER(want[c]) || IS_SPACER(have[c])))
+            c--;
+        if(end < cols && (IS_SPACER(want[end]) || IS_SPACER(have[end])))
+            end++;
+
+        while(c < end) {
+            if(IS_SPACER(want[c])) {
+                c++; // printed with the character before
+                continue;
+            }
+            int same = 1;
+            while(c + same < end && want[c + same] == want[c])
+                same++;
+
+            int ech = same >= ECH_MIN && IS_BLANK(want[c]) && c + same < cols;
+            if(c == 0 && wrapInto && !ech && d->wrapnext && d->row == r - 1) {
+                d->row = r;
+                d->col = d->wrapnext = 0;
+            } else {
+                move_to(d, r, c);
+            }
+
+            if(ech) {
+                // ECH doesn't move the cursor
+                set_attr(d, CELL_ATTR(want[c]));
+                char buf[16];
+                emit(d, buf, snprintf(buf, sizeof(buf), "\e[%dX", same));
+                c += same;
+            } else if(same >= REP_MIN && (d->flags & FVTERM_DIFF_REP) && c + same < cols) {
+                put_cell(d, want[c]);
+                char buf[16];
+                emit(d, buf, snprintf(buf, sizeof(buf), "\e[%db", same - 1));
+                c += same;
+                d->col = c;
+            } else {
+                for(int i = 0; i < same; i++)
+                    put_cell(d, want[c++]);
+            }
+        }
+    }
+
+    if(tail < cols) {
+        move_to(d, r, tail);
+        set_attr(d, CELL_ATTR(want[cols - 1]));
+        emit_str(d, "\e[K");
+    }
+}
+
+
+// What scrolling rows top..bottom by shift costs, over scrolling just
+// inner..innerBottom: the non-blank cells of the rows outside that are in
+// place now but wouldn't be, less those that would be but aren't
+static int scroll_loss(struct diff *d, const uint64_t **have, const uint64_t **want, int shift,
+                       int top, int bottom, int inner, int innerBottom)
+{
+    int cols = d->cols;
+    int loss = 0;
+    for(int r = top; r <= bottom; r++) {
+        if(r == inner) {
+            r = innerBottom;
+            continue;
+        }
+        int from = r + shift;
+        int before = emu_cells_equal(have[r], want[r], cols);
+        int after = from >= top && from <= bottom && emu_cells_equal(have[from], want[r], cols);
+        if(before != after)
+            loss += (before - after) * (row_weight(want[r], cols) + 1);
+    }
+    return loss;
+}
+
+
+// Finds the vertical shift of the screen that would leave the most non-blank
+// cells in place, and scrolls the viewer by it. rows[] is updated to what the
+// viewer has afterwards.
+static void diff_scroll(struct diff *d, const uint64_t **have, int *haveFlags,
+                        const uint64_t **want, uint64_t *blank)
+{
+    int rows = d->rows, cols = d->cols;
+    uint64_t *hHave = malloc(rows * sizeof(uint64_t));
+    uint64_t *hWant = malloc(rows * sizeof(uint64_t));
+    int *weight = malloc(rows * sizeof(int));
+    for(int r = 0; r < rows; r++) {
+        hHave[r] = hash_row(have[r], cols);
+        hWant[r] = hash_row(want[r], cols);
+        weight[r] = hWant[r] == hHave[r] ? 0 : row_weight(want[r], cols);
+    }
+
+    // Content that moved up by k has want[i] == have[i + k]
+    int bestShift = 0, bestGain = SCROLL_MIN_GAIN - 1, first = 0, last = 0;
+    for(int k = 1 - rows; k < rows; k++) {
+        if(k == 0) continue;
+        int gain = 0, lo = -1, hi = -1;
+        for(int i = k > 0 ? 0 : -k; i < rows && i + k < rows; i++) {
+            if(weight[i] && hWant[i] == hHave[i + k] &&
+               emu_cells_equal(want[i], have[i + k], cols)) {
+                gain += weight[i];
+                if(lo < 0) lo = i;
+                hi = i;
+            }
+        }
+        if(gain > bestGain) {
+            bestGain = gain;
+            bestShift = k;
+            first = lo;
+            last = hi;
+        }
+    }
+    free(hHave);
+    free(hWant);
+    free(weight);
+    if(!bestShift) return;
+
+    // Scroll the rows between the first and last that matched, or all of the
+    // margins that'll be wanted anyway if that doesn't cost anything more
+    int k = bestShift > 0 ? bestShift : -bestShift;
+    int top = bestShift > 0 ? first : first + bestShift;
+    int bottom = bestShift > 0 ? last + bestShift : last;
+    if(d->wantTop <= top && d->wantBottom >= bottom &&
+       scroll_loss(d, have, want, bestShift, d->wantTop, d->wantBottom, top, bottom) <= 0) {
+        top = d->wantTop;
+        bottom = d->wantBottom;
+    }
+
+    char buf[32];
+    if(top != d->top || bottom != d->bottom) {
+        emit(d, buf, snprintf(buf, sizeof(buf), "\e[%d;%dr", top + 1, bottom + 1));
+        d->top = top;
+        d->bottom = bottom;
+        d->row = d->col = d->wrapnext = 0; // DECSTBM homes the cursor
+    }
+    emit(d, buf, snprintf(buf, sizeof(buf), k == 1 ? "\e[%c" : "\e[%d%c",
+                          k == 1 ? (bestShift > 0 ? 'S' : 'T') : k,
+                          bestShift > 0 ? 'S' : 'T'));
+
+    // The rows scrolled in are blank in the current attributes, and haven't
+    // wrapped
+    emu_cells_fill(blank, cols, ((uint64_t) d->attr << 32) | BLANK_GLYPH);
+    if(bestShift > 0) {
+        memmove(&have[top], &have[top + k], (bottom - top + 1 - k) * sizeof(uint64_t *));
+        memmove(&haveFlags[top], &haveFlags[top + k], (bottom - top + 1 - k) * sizeof(int));
+        for(int r = bottom - k + 1; r <= bottom; r++) {
+            have[r] = blank;
+            haveFlags[r] = 0;
+        }
+    } else {
+        memmove(&have[top + k], &have[top], (bottom - top + 1 - k) * sizeof(uint64_t *));
+        memmove(&haveFlags[top + k], &haveFlags[top], (bottom - top + 1 - k) * sizeof(int));
+        for(int r = top; r < top + k; r++) {
+            have[r] = blank;
+            haveFlags[r] = 0;
+        }
+    }
+}
+
+
+#pragma mark - Links
+
+
+// The viewer's links are in its own table, so its cells can only be compared
+// with the live ones once they're translated to the live terminal's: map
+// takes an index in from's table to the one in to's with the same URI and
+// id, or to -1 if to has no such link. Entries are looked up as they're met.
+static int map_link(struct emuState *from, struct emuState *to, int *map, int link)
+{
+    if(map[link] == -2) {
+        const char *id, *uri = emu_core_getlink(from, link, &id);
+        int found = uri ? emu_core_findlink(to, uri, id) : 0;
+        map[link] = found ? found : -1;
+    }
+    return map[link];
+}
+
+
+// Points the rows of have that have links at copies with them translated, in
+// cells, and a link to has no counterpart for can't match anything
+static void translate_links(struct diff *d, struct emuState *from, int *map,
+                            const uint64_t **have, uint64_t *cells)
+{
+    for(int r = 0; r < d->rows; r++) {
+        const uint64_t *row = have[r];
+        uint64_t any = 0;
+        for(int c = 0; c < d->cols; c++)
+            any |= row[c];
+        if(!(any & CELL_LINK_MASK)) continue;
+
+        uint64_t *copy = cells + (size_t) r * d->cols;
+        for(int c = 0; c < d->cols; c++) {
+            int link = CELL_LINK(row[c]);
+            int to = link ? map_link(from, d->to, map, link) : 0;
+            if(to < 0)
+                copy[c] = NO_GLYPH;
+            else
+                copy[c] = (row[c] & ~CELL_LINK_MASK) | ((uint64_t) to << CELL_LINK_SHIFT);
+        }
+        have[r] = copy;
+    }
+}
+
+
+#pragma mark - Everything else that shows
+
+
+static void diff_palette(struct diff *d, const uint32_t *have, const uint32_t *want)
+{
+    // OSC 4 takes several colors at once, up to the parser's buffer size
+    char buf[400];
+    int n = 0;
+    for(int i = 0; i < 256; i++) {
+        if(have[i] == want[i]) continue;
+        if(!n)
+            n = snprintf(buf, sizeof(buf), "\e]4");
+        n += snprintf(buf + n, sizeof(buf) - n, ";%d;#%06x", i, want[i] >> 8);
+        if(n > sizeof(buf) - 32) {
+            buf[n++] = '\a';
+            emit(d, buf, n);
+            n = 0;
+        }
+    }
+    if(n) {
+        buf[n++] = '\a';
+        emit(d, buf, n);
+    }
+
+    for(int i = 0; i < 2; i++) {
+        if(have[256 + i] == want[256 + i]) continue;
+        n = snprintf(buf, sizeof(buf), "\e]%d;#%06x\a", 10 + i, want[256 + i] >> 8);
+        emit(d, buf, n);
+    }
+}
+
+
+static void diff_modes(struct diff *d, uint64_t have, uint64_t want)
+{
+    static const struct { uint64_t flag; int mode; } modes[] = {
+        { MODE_INVERT, 5 },
+        { MODE_CURSORBLINK, 12 },
+        { MODE_SHOWCURSOR, 25 },
+    };
+    for(int i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if((have ^ want) & modes[i].flag) {
+            char buf[16];
+            emit(d, buf, snprintf(buf, sizeof(buf), "\e[?%d%c", modes[i].mode,
+                                  (want & modes[i].flag) ? 'h' : 'l'));
+        }
+    }
+}
+
+
+// Writes to fp the bytes that make a terminal showing what "from" shows show
+// what "to" does, and returns how many there were, or -1 if the two aren't the
+// same size. FVTERM_DIFF_REP allows REP, which not every terminal has.
+long fvterm_diff(struct fvterm *from, struct fvterm *to, int flags, FILE *fp)
+{
+    struct emuState *A = from->state, *B = to->state;
+    if(A->wRows != B->wRows || A->wCols != B->wCols)
+        return -1;
+
+    struct diff d = {
+        .fp = fp,
+        .flags = flags,
+        .rows = B->wRows,
+        .cols = B->wCols,
+        .row = A->cRow,
+        .col = A->cCol,
+        .wrapnext = A->wrapnext,
+        .top = A->tScroll,
+        .bottom = A->bScroll,
+        .wantTop = B->tScroll,
+        .wantBottom = B->bScroll,
+        .attr = A->cursorAttr,
+        .to = B,
+    };
+
+    // Get the viewer into a state where what follows means what it says
+    int resync = 0;
+    if(A->state == ST_OSC) {
+        // Ends the string, which may dispatch it, so whatever it could have
+        // changed is sent again in full
+        emit_str(&d, "\a");
+        resync = 1;
+        d.link = -1;
+    } else if(A->state != ST_GROUND || A->utf8state) {
+        // ESC abandons a sequence, and ESC \ does nothing
+        emit_str(&d, "\e\\");
+    }
+    if(A->flags & MODE_VT52)
+        emit_str(&d, "\e<");
+    if(A->flags & MODE_INSERT)
+        emit_str(&d, "\e[4l");
+    if(A->flags & MODE_ORIGIN) {
+        emit_str(&d, "\e[?6l");
+        d.row = d.col = d.wrapnext = 0;
+    }
+    if(A->flags & MODE_LRMARGINS)
+        emit_str(&d, "\e[?69l"); // and the left and right margins with it
+    if(A->charset == '0' || A->charset == 'A')
+        emit_str(&d, "\e(B\x0f");
+
+    const uint64_t **have = malloc(d.rows * sizeof(uint64_t *));
+    const uint64_t **want = malloc(d.rows * sizeof(uint64_t *));
+    int *haveFlags = malloc(d.rows * sizeof(int));
+    uint64_t *blank = malloc(d.cols * sizeof(uint64_t));
+    for(int r = 0; r < d.rows; r++) {
+        have[r] = A->rows[r]->chars;
+        haveFlags[r] = A->rows[r]->flags;
+        want[r] = B->rows[r]->chars;
+    }
+
+    int *map = NULL;
+    uint64_t *linked = NULL;
+    if(A->links) {
+        map = malloc(LINKS_MAX * sizeof(int));
+        for(int i = 0; i < LINKS_MAX; i++)
+            map[i] = -2;
+        linked = malloc((size_t) d.rows * d.cols * sizeof(uint64_t));
+        translate_links(&d, A, map, have, linked);
+        if(d.link == 0 && A->cursorLink)
+            d.link = map_link(A, B, map, CELL_LINK(A->cursorLink));
+    }
+
+    if(A->utf8state) {
+        // The ESC printed the bytes of the partial character as they were,
+        // wherever that left things, so start from a clear screen
+        emit_str(&d, "\e[m\e[2J");
+        d.attr = 0;
+        d.row = -1;
+        emu_cells_fill(blank, d.cols, BLANK_GLYPH);
+        for(int r = 0; r < d.rows; r++) {
+            have[r] = blank;
+            haveFlags[r] = 0;
+        }
+    } else {
+        diff_scroll(&d, have, haveFlags, want, blank);
+    }
+    if(d.top != B->tScroll || d.bottom != B->bScroll) {
+        char buf[32];
+        emit(&d, buf, snprintf(buf, sizeof(buf), "\e[%d;%dr", B->tScroll + 1, B->bScroll + 1));
+        d.top = B->tScroll;
+        d.bottom = B->bScroll;
+        d.row = d.col = d.wrapnext = 0;
+    }
+
+    for(int r = 0, skip = 0; r < d.rows; r++) {
+        int start = skip;
+        skip = 0;
+        int wrapInto = r > 0 && (B->rows[r - 1]->flags & TERMROW_WRAPPED) &&
+                       r - 1 < d.bottom && (A->flags & MODE_WRAPAROUND);
+
+        // Erasing a whole row unwraps it
+        if(start == 0 && have[r] != want[r] && erase_tail(&d, have[r], want[r], 0) == 0)
+            haveFlags[r] &= ~TERMROW_WRAPPED;
+
+        // Reproduce a soft wrap by printing across it, which only leaves the
+        // screen alone above the bottom margin. There's no unwrapping a row.
+        if((B->rows[r]->flags & TERMROW_WRAPPED) && !(haveFlags[r] & TERMROW_WRAPPED) &&
+           r < d.bottom && (A->flags & MODE_WRAPAROUND)) {
+            diff_row(&d, r, have[r], want[r], start, wrapInto);
+            int last = d.cols - 1;
+            if(IS_SPACER(want[r][last]) && last > 0)
+                last--;
+            move_to(&d, r, last);
+            put_cell(&d, want[r][last]);
+            put_cell(&d, want[r + 1][0]); // wraps
+            haveFlags[r] |= TERMROW_WRAPPED;
+            skip = IS_SPACER(want[r + 1][1 % d.cols]) ? 2 : 1;
+            d.row = r + 1;
+            d.col = skip < d.cols ? skip : d.cols - 1;
+            d.wrapnext = skip >= d.cols;
+            continue;
+        }
+
+        if(have[r] != want[r] && !emu_cells_equal(have[r] + start, want[r] + start, d.cols - start))
+            diff_row(&d, r, have[r], want[r], start, wrapInto);
+    }
+
+    if(resync) {
+        emit_str(&d, "\e]104\a");
+        uint32_t defaults[258];
+        for(int i = 0; i < 256; i++)
+            defaults[i] = (default_colormap[i] << 8) | 0xff;
+        // OSC 104 leaves the default colors alone; they're sent regardless
+        defaults[256] = ~B->palette[256];
+        defaults[257] = ~B->palette[257];
+        diff_palette(&d, defaults, B->palette);
+    } else {
+        diff_palette(&d, A->palette, B->palette);
+    }
+    if(resync || strcmp(from->title, to->title) != 0) {
+        emit_str(&d, "\e]2;");
+        emit_str(&d, to->title);
+        emit_str(&d, "\a");
+    }
+    diff_modes(&d, A->flags, B->flags);
+
+    // Left and right margins only get in the way until everything's drawn
+    if(B->flags & MODE_LRMARGINS) {
+        emit_str(&d, "\e[?69h");
+        if(B->lScroll != 0 || B->rScroll != B->wCols - 1) {
+            char buf[32];
+            emit(&d, buf, snprintf(buf, sizeof(buf), "\e[%d;%ds", B->lScroll + 1, B->rScroll + 1));
+            // DECSLRM homes the cursor. Sideways moves stop at the margins
+            // now, so pretend it's about to wrap to rule them out.
+            d.row = d.col = 0;
+            d.wrapnext = 1;
+        }
+    }
+
+    set_link(&d, CELL_LINK(B->cursorLink));
+    move_to(&d, B->cRow, B->cCol);
+    flush(&d);
+
+    free(map);
+    free(linked);
+    free(have);
+    free(haveFlags);
+    free(want);
+    free(blank);
+    return ferror(fp) ? -1 : (long) d.len;
+}
@@ -1,9 +1,13 @@
 #include "fvemu.h"
+#include "fvcells.h"
+#include "fvwidth.h"
 #include "DefaultColors.h"
 
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 
 
 #pragma mark Macros and debug utils
@@ -42,37 +46,241 @@
 
 #define EMPTY_FIELD APPLY_ATTR(0x20)
 
+// Text takes the cursor's link too; erased cells don't
+#define APPLY_TEXT(ch) (APPLY_ATTR(ch) | S->cursorLink)
+
+// Whether there are left and right margins narrower than the screen
+#define HAS_LR_MARGINS(S) ((S)->lScroll != 0 || (S)->rScroll != (S)->wCols - 1)
+
+// Where a carriage return takes the cursor: the left margin, unless it's
+// already left of it
+#define LEFT_EDGE(S) ((S)->cCol >= (S)->lScroll ? (S)->lScroll : 0)
+
+#ifdef FVEMU_STATS
+#define STAT(expr) ((void) (S->stats.expr))
+#define STAT_TIMED(cls, call) do { \
+    uint64_t statStart = emu_core_ticks(); \
+    call; \
+    S->stats.cycles[cls] += emu_core_ticks() - statStart; \
+    S->stats.calls[cls]++; \
+} while(0)
+#else
+#define STAT(expr) ((void) 0)
+#define STAT_TIMED(cls, call) call
+#endif
+
+#define MARK_DIRTY(row) do { \
+    if(!((row)->flags & TERMROW_DIRTY)) STAT(rowsDirtied++); \
+    (row)->flags = ((row)->flags | TERMROW_DIRTY) & ~(TERMROW_TAPPED | TERMROW_CONTINUED); \
+} while(0)
+
 #define APPLY_FLAG(mask, val) do { \
 if(val) S->flags |= (mask); \
 else S->flags &= ~(mask); \
 } while(0)
 
 
-#ifdef DEBUG
-static const char * safeHex(uint32_t ch)
-{
-    // Remember, kids, always practice safe hex.
-    static char buf[64];
-    if(ch < 0x20) {
-        snprintf(buf, sizeof(buf), "^%c", ch + 0x40);
-    } else if(ch > 0x20 && ch < 0x7f) {
-        snprintf(buf, sizeof(buf), "%c", ch);
-    } else if(ch <= 0xff) {
-        snprintf(buf, sizeof(buf), "%02x", ch);
-    } else if(ch <= 0xffff) {
-        int lo = ch & 0xff, hi = (ch >> 8) & 0xff;
-        if(lo > 0x20 && lo < 0x7f && hi > 0x20 && hi < 0x7f) {
-            snprintf(buf, sizeof(buf), "%c%c", hi, lo);
+uint64_t emu_core_nanotime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// A cheap timestamp: the TSC (or its equivalent) where there is one
+uint64_t emu_core_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    return emu_core_nanotime();
+#endif
+}
+
+
+#ifndef FVEMU_NO_TRACE
+static inline struct emuTraceEntry * trace_add(struct emuState *S, int kind, uint8_t final)
+{
+    struct emuTraceEntry *e = &S->trace[S->traceNext++ & (TRACE_ENTRIES - 1)];
+    e->ticks = S->traceTicks;
+    e->kind = kind;
+    e->flags = 0;
+    e->intermed = S->intermed;
+    e->final = final;
+    e->row = S->cRow;
+    e->col = S->cCol;
+    e->nParams = 0;
+    return e;
+}
+
+
+static void trace_params(struct emuTraceEntry *e, const int *params, int count)
+{
+    e->nParams = count;
+    for(int i = 0; i < count && i < TRACE_PARAMS; i++)
+        e->params[i] = params[i];
+}
+
+#define TRACE(kind, final) ((void) trace_add(S, kind, final))
+#define TRACE_CSI(final) trace_params(trace_add(S, TRACE_CSI, final), S->params, S->paramPtr)
+#define TRACE_OSC(op, len) trace_params(trace_add(S, TRACE_OSC, 0), (int[]) { op, (len) > 0xffff ? 0xffff : (len) }, 2)
+#define TRACE_DCS(final) trace_params(trace_add(S, TRACE_DCS, final), S->params, S->paramPtr)
+#define TRACE_TEXT(len) trace_params(trace_add(S, TRACE_TEXT, 0), (int[]) { (len) > 0xffff ? 0xffff : (len) }, 1)
+#define TRACE_UNHANDLED() (S->trace[(S->traceNext - 1) & (TRACE_ENTRIES - 1)].flags |= TRACEFLAG_UNHANDLED)
+#else
+#define TRACE(kind, final) ((void) 0)
+#define TRACE_CSI(final) ((void) 0)
+#define TRACE_OSC(op, len) ((void) 0)
+#define TRACE_DCS(final) ((void) 0)
+#define TRACE_TEXT(len) ((void) 0)
+#define TRACE_UNHANDLED() ((void) 0)
+#endif
+
+
+#pragma mark - Buffer manipulation utils
+
+
+// Drops a row's claim on its cells, keeping a few buffers around for the next
+// rows that need one
+static void release_cells(struct emuState *S, struct termRow *r)
+{
+    if(!r->chars) return;
+
+    if(r->flags & TERMROW_BLANK) {
+        for(int i = 0; i < BLANK_ROWS; i++) {
+            if(S->blanks[i].cells == r->chars) {
+                S->blanks[i].refs--;
+                break;
+            }
+        }
+        r->flags &= ~TERMROW_BLANK;
+    } else if(S->nFreeCells < FREE_CELLS_MAX) {
+        *(uint64_t **) r->chars = S->freeCells;
+        S->freeCells = r->chars;
+        S->nFreeCells++;
+    } else {
+        free(r->chars);
+    }
+    r->chars = NULL;
+}
+
+
+static void image_release(struct emuImage *image)
+{
+    if(--image->refs == 0)
+        free(image);
+}
+
+
+// Frees the graphics on a row, from slice on
+static void free_slices(struct emuSlice *slice)
+{
+    while(slice) {
+        struct emuSlice *next = slice->next;
+        image_release(slice->image);
+        free(slice);
+        slice = next;
+    }
+}
+
+
+static void __attribute__((noinline)) row_drop_slices(struct emuState *S, struct termRow *r)
+{
+    free_slices(r->slices);
+    r->slices = NULL;
+    MARK_DIRTY(r);
+}
+
+
+// Gives a blank row cells of its own, with the same contents
+static void __attribute__((noinline)) row_materialize(struct emuState *S, struct termRow *r)
+{
+    uint64_t *cells = S->freeCells;
+    if(cells) {
+        S->freeCells = *(uint64_t **) cells;
+        S->nFreeCells--;
+    } else {
+        cells = malloc(S->wCols * sizeof(uint64_t));
+    }
+    emu_cells_fill(cells, S->wCols, r->chars[0]);
+    release_cells(S, r);
+    r->chars = cells;
+}
+
+// Call before writing to a row's cells
+#define ROW_WRITABLE(r) do { \
+    if(unlikely((r)->flags & TERMROW_BLANK)) row_materialize(S, r); \
+} while(0)
+
+
+// Points a row at the shared blank row for value, making one if needed. If
+// all of them are taken by other values, the row is filled the hard way.
+static void row_blank(struct emuState *S, struct termRow *r, uint64_t value)
+{
+    if((r->flags & TERMROW_BLANK) && r->chars[0] == value) return;
+
+    struct emuBlankRow *blank = NULL;
+    for(int i = 0; i < BLANK_ROWS; i++) {
+        struct emuBlankRow *b = &S->blanks[i];
+        if(b->cells && b->cells[0] == value) {
+            blank = b;
+            break;
+        }
+        if(!blank && b->refs == 0)
+            blank = b;
+    }
+
+    if(!blank) {
+        if(r->chars) {
+            ROW_WRITABLE(r);
         } else {
-            snprintf(buf, sizeof(buf), "%04x", ch);
+            r->chars = malloc(S->wCols * sizeof(uint64_t));
         }
+        emu_cells_fill(r->chars, S->wCols, value);
+        return;
+    }
+
+    if(!blank->cells) {
+        blank->cells = malloc(S->wCols * sizeof(uint64_t));
+        emu_cells_fill(blank->cells, S->wCols, value);
+    } else if(blank->cells[0] != value) {
+        emu_cells_fill(blank->cells, S->wCols, value); // an unused one
     }
-    return buf;
+
+    release_cells(S, r);
+    blank->refs++;
+    r->chars = blank->cells;
+    r->flags |= TERMROW_BLANK;
 }
-#endif
 
 
-#pragma mark - Buffer manipulation utils
+#define IS_SPACER(c) (CELL_GLYPH(c) == CELL_SPACER)
+#define IS_WIDE(c) (emu_char_width(CELL_GLYPH(c)) == 2)
+
+// Blanks what's left of a wide character split at col (between the cells at
+// col - 1 and col), keeping its attributes: a character without its spacer,
+// a spacer without its character, or the two with different attributes or
+// links. Call it at both ends of anything that writes part of a row.
+static void row_mend(struct emuState *S, struct termRow *r, int col)
+{
+    const uint64_t *cells = r->chars;
+    int spacer = col < S->wCols && IS_SPACER(cells[col]);
+    int wide = col > 0 && IS_WIDE(cells[col - 1]);
+    if(likely(!spacer && !wide)) return;
+    if(spacer && wide && CELL_GLYPH(cells[col] ^ cells[col - 1]) == (cells[col] ^ cells[col - 1]))
+        return;
+
+    ROW_WRITABLE(r);
+    if(spacer)
+        r->chars[col] = (r->chars[col] & ~0xffffffffULL) | 0x20;
+    if(wide)
+        r->chars[col - 1] = (r->chars[col - 1] & ~0xffffffffULL) | 0x20;
+}
 
 
 static void row_fill(struct emuState *S, int row, int start, int count, uint64_t value)
@@ -85,15 +293,69 @@ static void row_fill(struct emuState *S, int row, int start, int count, uint64_t
     assert(start + count <= S->wCols);
 
     struct termRow *r = S->rows[row];
-#ifdef NOT_DARWIN
-    // bah, we have to do this the hard way
-    for(int i = 0; i < count; i++)
-        r->chars[start + i] = value;
-#else
-    // memset_pattern8 is highly optimized on x86 :)
-    memset_pattern8(&r->chars[start], &value, count * 8);
-#endif
-    r->flags |= TERMROW_DIRTY;
+    if(start == 0 && count == S->wCols) {
+        // A row with nothing on it doesn't run on into the next
+        row_blank(S, r, value);
+        r->flags &= ~TERMROW_WRAPPED;
+    } else {
+        ROW_WRITABLE(r);
+        emu_cells_fill(&r->chars[start], count, value);
+        row_mend(S, r, start);
+        row_mend(S, r, start + count);
+    }
+    MARK_DIRTY(r);
+}
+
+
+// row_fill() for erasing: a whole row erased takes any graphics on it too
+static void row_erase(struct emuState *S, int row, int start, int count, uint64_t value)
+{
+    struct termRow *r = S->rows[row];
+    if(unlikely(r->slices != NULL) && start == 0 && count == S->wCols)
+        row_drop_slices(S, r);
+    row_fill(S, row, start, count, value);
+}
+
+
+// Rotates the rows top..btm so that row top + count ends up at top
+static void rotate_rows(struct emuState *S, int top, int btm, int count)
+{
+    struct termRow *keepBuf[64];
+    while(count > 0) {
+        int n = count < 64 ? count : 64;
+        memcpy(keepBuf, &S->rows[top], n * sizeof(struct termRow *));
+        memmove(&S->rows[top], &S->rows[top + n],
+                (btm - top + 1 - n) * sizeof(struct termRow *));
+        memcpy(&S->rows[btm - n + 1], keepBuf, n * sizeof(struct termRow *));
+        count -= n;
+    }
+}
+
+
+// scroll_down() and scroll_up() between left and right margins: only the
+// cells between them move, a span at a time, and the rest of each row stays.
+// Positive counts move the cells up.
+static void scroll_span(struct emuState *S, int top, int btm, int count)
+{
+    int left = S->lScroll, width = S->rScroll - S->lScroll + 1;
+    int rows = btm - top + 1;
+    int shift = count > 0 ? count : -count;
+    CAP_MAX(shift, rows);
+
+    for(int i = 0; i < rows; i++) {
+        int dst = count > 0 ? top + i : btm - i;
+        if(i >= rows - shift) {
+            row_erase(S, dst, left, width, EMPTY_FIELD);
+            continue;
+        }
+        struct termRow *to = S->rows[dst];
+        struct termRow *from = S->rows[count > 0 ? dst + shift : dst - shift];
+        ROW_WRITABLE(to);
+        emu_cells_copy(&to->chars[left], &from->chars[left], width);
+        row_mend(S, to, left);
+        row_mend(S, to, left + width);
+        MARK_DIRTY(to);
+    }
 }
 
 
@@ -105,6 +367,14 @@ static void scroll_down(struct emuState *S, int top, int btm, int count)
     assert(top < S->wRows);
     assert(btm < S->wRows);
 
+    STAT(scrolls++);
+    STAT(scrolledRows += count);
+
+    if(unlikely(HAS_LR_MARGINS(S))) {
+        scroll_span(S, top, btm, count);
+        return;
+    }
+
     int clearStart;
     if(count > btm - top) {
         // every row's getting cleared, so we don't need to bother
@@ -112,17 +382,11 @@ static void scroll_down(struct emuState *S, int top, int btm, int count)
         clearStart = top;
     } else {
         clearStart = btm - count + 1;
-        struct termRow *keepBuf[count];
-        memcpy(keepBuf, &S->rows[top],
-               count * sizeof(struct termRow *));
-        memmove(&S->rows[top], &S->rows[top + count],
-                (clearStart - top) * sizeof(struct termRow *));
-        memcpy(&S->rows[clearStart], keepBuf,
-               count * sizeof(struct termRow *));
+        rotate_rows(S, top, btm, count);
     }
 
     for(int i = clearStart; i <= btm; i++)
-        row_fill(S, i, 0, S->wCols, EMPTY_FIELD);
+        row_erase(S, i, 0, S->wCols, EMPTY_FIELD);
 }
 
 
@@ -134,14 +398,50 @@ static void scroll_up(struct emuState *S, int top, int btm, int count)
     assert(top < S->wRows);
     assert(btm < S->wRows);
 
-    // FIXME: this is unoptimized.
-    while(count--) {
-        struct termRow *movingRow = S->rows[btm];
-        for(int i = btm; i > top; i--)
-            S->rows[i] = S->rows[i - 1];
-        S->rows[top] = movingRow;
-        row_fill(S, top, 0, S->wCols, EMPTY_FIELD);
+    STAT(scrolls++);
+    STAT(scrolledRows += count);
+
+    if(unlikely(HAS_LR_MARGINS(S))) {
+        scroll_span(S, top, btm, -count);
+        return;
+    }
+
+    int clearEnd;
+    if(count > btm - top) {
+        clearEnd = btm;
+    } else {
+        clearEnd = top + count - 1;
+        rotate_rows(S, top, btm, btm - top + 1 - count);
+    }
+
+    for(int i = top; i <= clearEnd; i++)
+        row_erase(S, i, 0, S->wCols, EMPTY_FIELD);
+}
+
+
+// Resizes on the application's behalf, as long as it has the budget for it
+static void request_resize(struct emuState *S, int rows, int cols)
+{
+    if(rows == S->wRows && cols == S->wCols) return;
+
+    int64_t cells = (int64_t) rows * cols;
+    if(cells > S->resizeBudget) {
+        TRACE_UNHANDLED();
+        return;
     }
+    S->resizeBudget -= cells;
+    emu_core_resize(S, rows, cols);
+}
+
+
+// Tells the host about the rows that are about to scroll off the top of the
+// screen, if it wants to know
+static void tap_scroll(struct emuState *S, int count)
+{
+    if(likely(!S->tapLines) || S->tScroll != 0 || HAS_LR_MARGINS(S)) return;
+    CAP_MAX(count, S->bScroll + 1);
+    for(int i = 0; i < count; i++)
+        TerminalEmulator_lineDone(S, i, 1);
 }
 
 
@@ -151,11 +451,16 @@ static void cursor_index(struct emuState *S, int count)
 
     if(likely(count > 0)) {
         // positive scroll - scroll down
+        if(unlikely(S->tapLines) && !(S->rows[S->cRow]->flags & TERMROW_WRAPPED))
+            TerminalEmulator_lineDone(S, S->cRow, 0);
+
         int dist = S->bScroll - S->cRow;
         if(dist >= count) {
             S->cRow += count;
         } else {
             S->cRow = S->bScroll;
+            if(unlikely(S->cCol < S->lScroll || S->cCol > S->rScroll)) return;
+            tap_scroll(S, count - dist);
             scroll_down(S, S->tScroll, S->bScroll, count - dist);
         }
     } else {
@@ -165,12 +470,25 @@ static void cursor_index(struct emuState *S, int count)
             S->cRow -= count;
         else {
             S->cRow = S->tScroll;
+            if(unlikely(S->cCol < S->lScroll || S->cCol > S->rScroll)) return;
             scroll_up(S, S->tScroll, S->bScroll, count - dist);
         }
     }
 }
 
 
+// Moves to the start of the next line, where text that ran into the right
+// margin goes on. Rows only count as wrapped when they wrapped at the edge
+// of the screen.
+static void wrap_line(struct emuState *S)
+{
+    if(!HAS_LR_MARGINS(S))
+        S->rows[S->cRow]->flags |= TERMROW_WRAPPED;
+    cursor_index(S, 1);
+    S->cCol = S->lScroll;
+}
+
+
 #pragma mark - Control sequences
 
 
@@ -182,8 +500,9 @@ static void do_BEL(struct emuState *S)
 
 static void do_BS(struct emuState *S)
 {
+    int edge = LEFT_EDGE(S);
     S->cCol -= 1;
-    CAP_MIN_MAX(S->cCol, 0, S->wCols - 1);
+    CAP_MIN_MAX(S->cCol, edge, S->wCols - 1);
     S->wrapnext = 0;
 }
 
@@ -231,7 +550,7 @@ static void do_CNL(struct emuState *S)
 {
     int p1 = GETARG(S, 0, 1);
     cursor_index(S, p1);
-    S->cCol = 0;
+    S->cCol = LEFT_EDGE(S);
     S->wrapnext = 0;
 }
 
@@ -240,14 +559,14 @@ static void do_CPL(struct emuState *S)
 {
     int p1 = GETARG(S, 0, 1);
     cursor_index(S, -p1);
-    S->cCol = 0;
+    S->cCol = LEFT_EDGE(S);
     S->wrapnext = 0;
 }
 
 
 static void do_CR(struct emuState *S)
 {
-    S->cCol = 0;
+    S->cCol = LEFT_EDGE(S);
     S->wrapnext = 0;
 }
 
@@ -263,16 +582,18 @@ static void do_CSI(struct emuState *S)
 
 static void do_CUB(struct emuState *S)
 {
+    int edge = LEFT_EDGE(S);
     S->cCol -= GETARG(S, 0, 1);
-    CAP_MIN_MAX(S->cCol, 0, S->wCols - 1);
+    CAP_MIN_MAX(S->cCol, edge, S->wCols - 1);
     S->wrapnext = 0;
 }
 
 
 static void do_CUF(struct emuState *S)
 {
+    int edge = S->cCol <= S->rScroll ? S->rScroll : S->wCols - 1;
     S->cCol += GETARG(S, 0, 1);
-    CAP_MIN_MAX(S->cCol, 0, S->wCols - 1);
+    CAP_MIN_MAX(S->cCol, 0, edge);
     S->wrapnext = 0;
 }
 
@@ -306,11 +627,13 @@ static void do_CUP_HVP(struct emuState *S)
     S->wrapnext = 0;
     if(S->flags & MODE_ORIGIN) {
         S->cRow += S->tScroll;
+        S->cCol += S->lScroll;
         CAP_MIN_MAX(S->cRow, S->tScroll, S->bScroll);
+        CAP_MIN_MAX(S->cCol, S->lScroll, S->rScroll);
     } else {
         CAP_MIN_MAX(S->cRow, 0, S->wRows - 1);
+        CAP_MIN_MAX(S->cCol, 0, S->wCols - 1);
     }
-    CAP_MIN_MAX(S->cCol, 0, S->wCols - 1);
 }
 
 
@@ -332,23 +655,44 @@ static void do_DA2(struct emuState *S)
 }
 
 
+// The cells from the cursor that ICH and DCH shift: up to the right margin,
+// or none if the cursor's outside the margins
+static int shift_span(struct emuState *S)
+{
+    if(S->cCol < S->lScroll || S->cCol > S->rScroll) return 0;
+    return S->rScroll - S->cCol + 1;
+}
+
+
 static void do_DCH(struct emuState *S)
 {
+    int span = shift_span(S);
+    if(span == 0) return;
     int del = GETARG(S, 0, 1);
-    CAP_MIN_MAX(del, 0, S->wCols);
-    uint64_t *chars = S->rows[S->cRow]->chars;
-    for(int i = S->cCol; i < S->wCols; i++) {
-        int src = i + del;
-        chars[i] = (src < S->wCols) ? chars[src] : EMPTY_FIELD;
-    }
-    S->rows[S->cRow]->flags |= TERMROW_DIRTY;
+    CAP_MIN_MAX(del, 0, span);
+    struct termRow *r = S->rows[S->cRow];
+    ROW_WRITABLE(r);
+    emu_cells_shift_left(&r->chars[S->cCol], span, del, EMPTY_FIELD);
+    row_mend(S, r, S->cCol);
+    row_mend(S, r, S->cCol + span - del);
+    row_mend(S, r, S->cCol + span);
+    MARK_DIRTY(r);
+}
+
+
+static void do_DCS(struct emuState *S)
+{
+    S->state = ST_DCS;
+    S->paramPtr = S->paramVal = 0;
+    S->intermed = 0;
+    bzero(S->params, sizeof(S->params));
 }
 
 
 static void do_DECALN(struct emuState *S)
 {
     for(int i = 0; i < S->wRows; i++)
-        row_fill(S, i, 0, S->wCols, APPLY_ATTR('E'));
+        row_erase(S, i, 0, S->wCols, APPLY_ATTR('E'));
 }
 
 
@@ -391,17 +735,43 @@ static void do_DECSTBM(struct emuState *S)
     CAP_MIN(p1, 1);
     CAP_MAX(p2, S->wRows);
     if(p2 > p1) { // confirmed: xterm ignores other STBMs
+        // Row 0 no longer goes on from what scrolled off before
+        S->rows[0]->flags &= ~TERMROW_CONTINUED;
         S->tScroll = p1 - 1;
         S->bScroll = p2 - 1;
         S->cRow = (S->flags & MODE_ORIGIN) ? S->tScroll : 0;
-        S->cCol = 0;
+        S->cCol = (S->flags & MODE_ORIGIN) ? S->lScroll : 0;
+        S->wrapnext = 0;
+    }
+}
+
+
+// DECSLRM: sets the left and right margins, once DECLRMM allows it (CSI s
+// is otherwise SCOSC, which we don't do)
+static void do_DECSLRM(struct emuState *S)
+{
+    if(!(S->flags & MODE_LRMARGINS)) {
+        TRACE_UNHANDLED();
+        return;
+    }
+    int p1 = GETARG(S, 0, 1);
+    int p2 = GETARG(S, 1, S->wCols);
+    CAP_MIN(p1, 1);
+    CAP_MAX(p2, S->wCols);
+    if(p2 > p1) {
+        S->lScroll = p1 - 1;
+        S->rScroll = p2 - 1;
+        S->cRow = (S->flags & MODE_ORIGIN) ? S->tScroll : 0;
+        S->cCol = (S->flags & MODE_ORIGIN) ? S->lScroll : 0;
+        S->wrapnext = 0;
     }
 }
 
 
 static void do_DL(struct emuState *S)
 {
-    if(S->cRow >= S->tScroll && S->cRow <= S->bScroll)
+    if(S->cRow >= S->tScroll && S->cRow <= S->bScroll &&
+       S->cCol >= S->lScroll && S->cCol <= S->rScroll)
         scroll_down(S, S->cRow, S->bScroll, GETARG(S, 0, 1));
 }
 
@@ -409,7 +779,7 @@ static void do_DL(struct emuState *S)
 static void do_DSR(struct emuState *S)
 {
     char buf[32];
-    int line;
+    int line, col;
     switch(GETARG(S, 0, 0)) {
         case 5:
             TerminalEmulator_writeStr(S, "\x1b[0n"); // OK response
@@ -417,9 +787,12 @@ static void do_DSR(struct emuState *S)
 
         case 6:
             line = S->cRow;
-            if(S->flags & MODE_ORIGIN)
+            col = S->cCol;
+            if(S->flags & MODE_ORIGIN) {
                 line -= S->tScroll;
-            snprintf(buf, sizeof(buf), "\x1b[%d;%dR", line + 1, S->cCol + 1);
+                col -= S->lScroll;
+            }
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dR", line + 1, col + 1);
             TerminalEmulator_writeStr(S, buf);
             break;
     }
@@ -430,7 +803,7 @@ static void do_ECH(struct emuState *S)
 {
     int count = GETARG(S, 0, 1);
     CAP_MAX(count, S->wCols - S->cCol);
-    row_fill(S, S->cRow, S->cCol, count, EMPTY_FIELD);
+    row_erase(S, S->cRow, S->cCol, count, EMPTY_FIELD);
 }
 
 
@@ -451,12 +824,12 @@ static void do_ED(struct emuState *S)
             break;
     }
     for(int i = from; i <= to; i++)
-        row_fill(S, i, 0, S->wCols, EMPTY_FIELD);
+        row_erase(S, i, 0, S->wCols, EMPTY_FIELD);
     // ED erases partial lines too...
     if(p1 == 1)
-        row_fill(S, S->cRow, 0, S->cCol + 1, EMPTY_FIELD);
+        row_erase(S, S->cRow, 0, S->cCol + 1, EMPTY_FIELD);
     else if(p1 != 2) // 0 or default
-        row_fill(S, S->cRow, S->cCol, S->wCols - S->cCol, EMPTY_FIELD);
+        row_erase(S, S->cRow, S->cCol, S->wCols - S->cCol, EMPTY_FIELD);
 }
 
 
@@ -475,7 +848,7 @@ static void do_EL(struct emuState *S)
         case 2:
             break;
     }
-    row_fill(S, S->cRow, from, to - from + 1, EMPTY_FIELD);
+    row_erase(S, S->cRow, from, to - from + 1, EMPTY_FIELD);
 }
 
 
@@ -514,20 +887,24 @@ static void do_HTS(struct emuState *S)
 
 static void do_ICH(struct emuState *S)
 {
+    int span = shift_span(S);
+    if(span == 0) return;
     int ins = GETARG(S, 0, 1);
-    CAP_MIN_MAX(ins, 0, S->wCols);
-    uint64_t *chars = S->rows[S->cRow]->chars;
-    for(int i = S->wCols - 1; i >= S->cCol; i--) {
-        int src = i - ins;
-        chars[i] = (src >= S->cCol) ? chars[src] : EMPTY_FIELD;
-    }
-    S->rows[S->cRow]->flags |= TERMROW_DIRTY;
+    CAP_MIN_MAX(ins, 0, span);
+    struct termRow *r = S->rows[S->cRow];
+    ROW_WRITABLE(r);
+    emu_cells_shift_right(&r->chars[S->cCol], span, ins, EMPTY_FIELD);
+    row_mend(S, r, S->cCol);
+    row_mend(S, r, S->cCol + ins);
+    row_mend(S, r, S->cCol + span);
+    MARK_DIRTY(r);
 }
 
 
 static void do_IL(struct emuState *S)
 {
-    if(S->cRow >= S->tScroll && S->cRow <= S->bScroll)
+    if(S->cRow >= S->tScroll && S->cRow <= S->bScroll &&
+       S->cCol >= S->lScroll && S->cCol <= S->rScroll)
         scroll_up(S, S->cRow, S->bScroll, GETARG(S, 0, 1));
 }
 
@@ -541,7 +918,7 @@ static void do_IND(struct emuState *S)
 static void do_NEL(struct emuState *S)
 {
     cursor_index(S, 1);
-    S->cCol = 0;
+    S->cCol = LEFT_EDGE(S);
     S->wrapnext = 0;
 }
 
@@ -550,7 +927,7 @@ static void do_NL(struct emuState *S)
 {
     cursor_index(S, 1);
     if(S->flags & MODE_NEWLINE)
-        S->cCol = 0;
+        S->cCol = LEFT_EDGE(S);
     S->wrapnext = 0;
 }
 
@@ -560,10 +937,76 @@ static void do_OSC(struct emuState *S)
     S->state = ST_OSC;
     S->paramPtr = S->paramVal = 0;
     S->intermed = 0;
+    S->oscStream.length = 0;
     bzero(S->oscBuf, sizeof(S->oscBuf));
 }
 
 
+static void do_unichar(struct emuState *S, uint32_t uc); // see Ground-state output
+
+// REP: writes the last character written count more times, a row's worth at a
+// time, wrapping as do_unichar does
+static void do_REP(struct emuState *S)
+{
+    uint32_t uc = S->lastChar;
+    if(!uc) return;
+
+    // Beyond a screenful, another row's worth just scrolls by another row of
+    // the same, so those are dropped. Rows after the first wrap to the left
+    // margin, so they're as wide as the margins. Wide characters take two
+    // cells each, and leave an odd one over.
+    int count = GETARG(S, 0, 1);
+    int most = (S->wRows + 1) * S->wCols;
+    int wide = emu_char_width(uc) != 1;
+    int width = S->rScroll - S->lScroll + 1;
+    if(wide)
+        width /= 2;
+    if(count > most && width > 0)
+        count -= (count - most) / width * width;
+
+    // Wide characters don't come in rows' worths of cells
+    if(unlikely(wide)) {
+        while(count-- > 0)
+            do_unichar(S, uc);
+        return;
+    }
+
+    while(count > 0) {
+        if(S->wrapnext) {
+            if(!(S->flags & MODE_WRAPAROUND)) {
+                do_unichar(S, uc); // they'd all go on the last column
+                return;
+            }
+            wrap_line(S);
+            S->wrapnext = 0;
+        }
+
+        // Whole rows of it can share cells, like blank ones
+        int edge = S->cCol <= S->rScroll ? S->rScroll + 1 : S->wCols;
+        int n = edge - S->cCol;
+        CAP_MAX(n, count);
+        if(unlikely(S->flags & MODE_INSERT) && n < edge - S->cCol) {
+            struct termRow *thisRow = S->rows[S->cRow];
+            ROW_WRITABLE(thisRow);
+            emu_cells_shift_right(&thisRow->chars[S->cCol], edge - S->cCol, n, APPLY_TEXT(uc));
+            row_mend(S, thisRow, S->cCol);
+            row_mend(S, thisRow, S->cCol + n);
+            row_mend(S, thisRow, edge);
+            MARK_DIRTY(thisRow);
+        } else {
+            row_fill(S, S->cRow, S->cCol, n, APPLY_TEXT(uc));
+        }
+
+        S->cCol += n;
+        count -= n;
+        if(S->cCol == edge) {
+            S->cCol--;
+            S->wrapnext = 1;
+        }
+    }
+}
+
+
 static void do_RI(struct emuState *S)
 {
     cursor_index(S, -1);
@@ -701,10 +1144,8 @@ static void do_SGR(struct emuState *S)
                 S->cursorAttr |= ATTR_CUSTBG | (8 + S->params[i] - 100) << 8;
                 break;
 
-#ifdef DEBUG
             default:
-                printf("unhandled SGR %d\n", S->params[i]);
-#endif
+                TRACE_UNHANDLED();
         }
     }
 }
@@ -726,10 +1167,17 @@ static void do_SI(struct emuState *S)
 
 static void do_SU(struct emuState *S)
 {
+    tap_scroll(S, GETARG(S, 0, 1));
     scroll_down(S, S->tScroll, S->bScroll, GETARG(S, 0, 1));
 }
 
 
+// ST on its own: strings we take end by themselves, so there's nothing to do
+static void do_ST(struct emuState *S)
+{
+}
+
+
 static void do_TBC(struct emuState *S)
 {
     switch(GETARG(S, 0, 0)) {
@@ -793,7 +1241,7 @@ static void do_dterm_window(struct emuState *S)
 
         case 8: // resize (text)
             if(p2 >= 1 && p3 >= 1 && p2 <= 999 && p3 <= 999)
-                emu_core_resize(S, p2, p3);
+                request_resize(S, p2, p3);
             break;
 
         case 9: // zoom
@@ -827,11 +1275,9 @@ static void do_dterm_window(struct emuState *S)
 
         default:
             if(p1 >= 24 && p1 < 999) { // resize to lines (DECSLPP)
-                emu_core_resize(S, p1, S->wCols);
+                request_resize(S, p1, S->wCols);
             } else {
-#ifdef DEBUG
-                printf("unhandled xterm window manipulation %d\n", p1);
-#endif
+                TRACE_UNHANDLED();
             }
     }
 }
@@ -920,68 +1366,760 @@ static void do_VT52_tab(struct emuState *S)
 }
 
 
-#pragma mark - Modes
+#pragma mark - Rectangular areas
 
 
-static void do_modes(struct emuState *S, int flag)
+// Reads the top;left;bottom;right of a rectangle from params[first...], with
+// the usual defaults (the whole page), into screen coordinates. In origin
+// mode they count from the margins and stay inside them. Returns 0
+// if there are no rows in it; the columns may still be backwards.
+static int get_rect(struct emuState *S, int first, int *top, int *left, int *bottom, int *right)
 {
-    for(int i = 0; i < S->paramPtr; i++) {
-        switch(MODE(S->intermed, S->params[i])) {
-
-            case MODE(0, 4): // IRM (insert/replace mode)
-                APPLY_FLAG(MODE_INSERT, flag);
-                break;
+    int base = 0, last = S->wRows - 1, baseCol = 0, lastCol = S->wCols - 1;
+    if(S->flags & MODE_ORIGIN) {
+        base = S->tScroll;
+        last = S->bScroll;
+        baseCol = S->lScroll;
+        lastCol = S->rScroll;
+    }
+    *top = base + GETARG(S, first, 1) - 1;
+    *left = baseCol + GETARG(S, first + 1, 1) - 1;
+    *bottom = base + GETARG(S, first + 2, last - base + 1) - 1;
+    *right = baseCol + GETARG(S, first + 3, lastCol - baseCol + 1) - 1;
+    CAP_MAX(*bottom, last);
+    CAP_MAX(*right, lastCol);
+    return *top <= *bottom;
+}
 
-            case MODE(0, 20): // LNM (normal linefeed mode)
-                APPLY_FLAG(MODE_LINEFEED, flag);
-                break;
 
-            case MODE('?', 1): // DECCKM (cursor key mode)
-                APPLY_FLAG(MODE_CURSORKEYS, flag);
-                break;
+// Sets every cell of the rectangle in params[first...] to value
+static void rect_fill(struct emuState *S, int first, uint64_t value)
+{
+    int top, left, bottom, right;
+    if(!get_rect(S, first, &top, &left, &bottom, &right) || left > right) return;
+    for(int r = top; r <= bottom; r++)
+        row_erase(S, r, left, right - left + 1, value);
+}
 
-            case MODE('?', 2): // DECANM (vt52 mode)
-                if(flag == 0) { // this flag is weirdly inverted.
-                    S->flags |= MODE_VT52;
-                    S->charset = 'B';
-                    S->vt52Hack = 0;
-                }
-                break;
 
-            case MODE('?', 3): // DECCOLM (132/80 switch)
-                if(!(S->flags & MODE_ALLOW_DECCOLM)) break;
-                emu_core_resize(S, S->wRows, flag ? 132 : 80);
-                // clear screen and reset cursor to 0/0
-                for(int i = 0; i < S->wRows; i++)
-                    row_fill(S, i, 0, S->wCols, EMPTY_FIELD);
-                S->cCol = 0;
-                S->cRow = (S->flags & MODE_ORIGIN) ? S->tScroll : 0;
-                break;
+// DECCARA: changes the attributes of the cells in a rectangle (or, after
+// DECSACE 0 or 1, of the stream of cells from its top left to its bottom
+// right), leaving the characters and colors alone
+static void do_DECCARA(struct emuState *S)
+{
+    int top, left, bottom, right;
+    if(!get_rect(S, 0, &top, &left, &bottom, &right)) return;
+    int rect = S->flags & MODE_RECT_EXTENT;
+    if((rect || top == bottom) && left > right) return;
 
-            case MODE('?', 4): // DECSCLM (smooth scrolling)
-                // Ignored - we don't implement this feature
-                break;
+    const uint32_t all = ATTR_BOLD | ATTR_UNDERLINE | ATTR_BLINK | ATTR_REVERSE | ATTR_INVIS;
+    uint32_t set = 0, clear = 0;
+    int nParams = S->paramPtr > 4 ? S->paramPtr : 5; // none means 0
+    for(int i = 4; i < nParams; i++) {
+        uint32_t attr = 0;
+        switch(S->params[i]) {
+            case 0: clear = all; set = 0; continue;
+            case 1: case 22: attr = ATTR_BOLD; break;
+            case 4: case 24: attr = ATTR_UNDERLINE; break;
+            case 5: case 25: attr = ATTR_BLINK; break;
+            case 7: case 27: attr = ATTR_REVERSE; break;
+            case 8: case 28: attr = ATTR_INVIS; break;
+            default: continue;
+        }
+        if(S->params[i] < 20) {
+            set |= attr;
+            clear &= ~attr;
+        } else {
+            clear |= attr;
+            set &= ~attr;
+        }
+    }
+    if(set & ATTR_BOLD)
+        clear |= ATTR_FAINT;
+    uint64_t keep = ~((uint64_t) clear << 32), add = (uint64_t) set << 32;
+
+    for(int r = top; r <= bottom; r++) {
+        int from = left, to = right;
+        if(!rect) {
+            if(r != top) from = 0;
+            if(r != bottom) to = S->wCols - 1;
+        }
+        // A stream's top row may start right of the screen
+        if(from > to) continue;
+        struct termRow *row = S->rows[r];
+        if((row->flags & TERMROW_BLANK) && from == 0 && to == S->wCols - 1) {
+            row_blank(S, row, (row->chars[0] & keep) | add);
+            MARK_DIRTY(row);
+            continue;
+        }
+        ROW_WRITABLE(row);
+        uint64_t *cells = row->chars;
+        // Wide characters change as a whole
+        if(from > 0 && IS_SPACER(cells[from]))
+            from--;
+        if(to < S->wCols - 1 && IS_SPACER(cells[to + 1]))
+            to++;
+        for(int c = from; c <= to; c++)
+            cells[c] = (cells[c] & keep) | add;
+        MARK_DIRTY(row);
+    }
+}
 
-            case MODE('?', 5): // DECSCNM (reverse video)
-                APPLY_FLAG(MODE_INVERT, flag);
-                for(int i = 0; i < S->wRows; i++)
-                    S->rows[i]->flags |= TERMROW_DIRTY; // redraw everything!
-                break;
 
-            case MODE('?', 6): // DECOM (origin mode)
-                APPLY_FLAG(MODE_ORIGIN, flag);
-                // Origin flag homes the cursor when set/reset
-                S->cRow = flag ? S->tScroll : 0;
-                S->cCol = 0;
-                break;
+// DECCRA: copies a rectangle to another place on the screen, where it may
+// overlap the original
+static void do_DECCRA(struct emuState *S)
+{
+    int top, left, bottom, right;
+    if(!get_rect(S, 0, &top, &left, &bottom, &right) || left > right) return;
 
-            case MODE('?', 7): // DECAWM (wraparound mode)
-                APPLY_FLAG(MODE_WRAPAROUND, flag);
-                break;
+    int base = 0, last = S->wRows - 1, baseCol = 0, lastCol = S->wCols - 1;
+    if(S->flags & MODE_ORIGIN) {
+        base = S->tScroll;
+        last = S->bScroll;
+        baseCol = S->lScroll;
+        lastCol = S->rScroll;
+    }
+    int dTop = base + GETARG(S, 5, 1) - 1;
+    int dLeft = baseCol + GETARG(S, 6, 1) - 1;
+    if(dTop > last || dLeft > lastCol) return;
+
+    if(dTop == top && dLeft == left) return;
+
+    int rows = bottom - top + 1, cols = right - left + 1;
+    CAP_MAX(rows, last - dTop + 1);
+    CAP_MAX(cols, lastCol - dLeft + 1);
+
+    // Go against the direction of the copy, so no row is overwritten before
+    // it's been copied
+    int down = dTop > top;
+    for(int i = 0; i < rows; i++) {
+        int n = down ? rows - 1 - i : i;
+        struct termRow *src = S->rows[top + n], *dst = S->rows[dTop + n];
+        if((src->flags & TERMROW_BLANK) && cols == S->wCols) {
+            row_blank(S, dst, src->chars[0]);
+        } else {
+            ROW_WRITABLE(dst);
+            emu_cells_move(&dst->chars[dLeft], &src->chars[left], cols);
+            row_mend(S, dst, dLeft);
+            row_mend(S, dst, dLeft + cols);
+        }
+        MARK_DIRTY(dst);
+    }
+}
 
-            case MODE('?', 8): // DECARM (autorepeat mode)
-                // Ignored - neither of these make sense on a software terminal.
-                break;
+
+// DECERA: erases a rectangle
+static void do_DECERA(struct emuState *S)
+{
+    rect_fill(S, 0, EMPTY_FIELD);
+}
+
+
+// DECFRA: fills a rectangle with a character, in the current attributes
+static void do_DECFRA(struct emuState *S)
+{
+    int ch = S->params[0];
+    if((ch >= 0x20 && ch < 0x7f) || (ch >= 0xa0 && ch <= 0xff))
+        rect_fill(S, 1, APPLY_ATTR(ch));
+}
+
+
+// DECSACE: whether DECCARA works on rectangles (2) or streams (0, 1)
+static void do_DECSACE(struct emuState *S)
+{
+    switch(S->params[0]) {
+        case 0:
+        case 1:
+            S->flags &= ~MODE_RECT_EXTENT;
+            break;
+        case 2:
+            S->flags |= MODE_RECT_EXTENT;
+            break;
+    }
+}
+
+
+#pragma mark - Sixel graphics
+
+
+// DCS P1;P2;P3 q starts a sixel image, which is decoded as it arrives, a chunk
+// of input at a time, straight into the slices of the rows it covers (see
+// struct emuSlice). Each sixel is a column of 6 pixels; a band of them goes
+// across the image, and "-" starts the next band down. When the image grows
+// past the bottom margin it scrolls the screen like text would, so a stream of
+// any length only ever holds a screenful of pixels.
+
+#define SIXEL_BAND      6
+#define SIXEL_MIN_WIDTH 64 // pixels the first slices of an image get
+
+struct emuSixel {
+    struct emuImage *image;
+    int row, col;       // cell the image's top left is in (row moves up as it scrolls)
+    int x, y;           // pixel column of the next sixel, top line of its band
+    int maxWidth;       // pixels that fit to the right of col
+    int width;          // pixels wide new slices are made
+    int height;         // lines down to the lowest pixel drawn
+    int color;          // pixel value being drawn: register + 1
+    int repeat;
+    int scrolling;      // DECSDM reset: the image can scroll the screen
+    uint8_t command;    // '#', '!' or '"' while their parameters come in
+    int nParams, params[5];
+
+    // Where the lines of the current band are, once a sixel's been put in it
+    int bandReady;
+    struct termRow *bandRows[SIXEL_BAND];
+    struct emuSlice *bandSlices[SIXEL_BAND];
+};
+
+
+// The VT340's default color registers, in percent
+static const uint8_t sixel_default_colors[16][3] = {
+    {  0,  0,  0 }, { 20, 20, 80 }, { 80, 13, 13 }, { 20, 80, 20 },
+    { 80, 20, 80 }, { 20, 80, 80 }, { 80, 80, 20 }, { 53, 53, 53 },
+    { 26, 26, 26 }, { 33, 33, 60 }, { 60, 26, 26 }, { 33, 60, 33 },
+    { 60, 33, 60 }, { 33, 60, 60 }, { 60, 60, 33 }, { 80, 80, 80 },
+};
+
+
+static uint32_t sixel_rgb(int r, int g, int b)
+{
+    CAP_MAX(r, 100);
+    CAP_MAX(g, 100);
+    CAP_MAX(b, 100);
+    return ((uint32_t) (r * 255 / 100) << 24) | ((uint32_t) (g * 255 / 100) << 16) |
+           ((uint32_t) (b * 255 / 100) << 8) | 0xff;
+}
+
+
+// DEC's HLS puts blue at 0 degrees, where everyone else has red. All in
+// percent, and in integers, which is plenty for 8-bit channels.
+static uint32_t sixel_hls(int h, int l, int s)
+{
+    CAP_MAX(l, 100);
+    CAP_MAX(s, 100);
+    h = (h + 240) % 360;
+    int c = (100 - abs(2 * l - 100)) * s / 100;
+    int x = c * (60 - abs(h % 120 - 60)) / 60;
+    int m = l - c / 2;
+    const int rgb[6][3] = {
+        { c, x, 0 }, { x, c, 0 }, { 0, c, x }, { 0, x, c }, { x, 0, c }, { c, 0, x },
+    };
+    const int *p = rgb[h / 60];
+    return sixel_rgb(p[0] + m, p[1] + m, p[2] + m);
+}
+
+
+static void sixel_free(struct emuState *S)
+{
+    image_release(S->sixel->image);
+    free(S->sixel);
+    S->sixel = NULL;
+}
+
+
+// The slice of the image on row r, made if it hasn't got one. Rows only keep
+// the newest SLICES_MAX images, so redrawing one in place can't pile them up.
+static struct emuSlice * sixel_slice(struct emuState *S, struct emuSixel *six, struct termRow *r)
+{
+    int n = 0;
+    for(struct emuSlice **p = &r->slices; *p; p = &(*p)->next) {
+        if((*p)->image == six->image)
+            return *p;
+        if(++n == SLICES_MAX - 1) {
+            free_slices((*p)->next);
+            (*p)->next = NULL;
+            break;
+        }
+    }
+
+    struct emuSlice *s = calloc(1, sizeof(struct emuSlice) + (size_t) six->width * S->cellHeight);
+    s->image = six->image;
+    s->image->refs++;
+    s->col = six->col;
+    s->width = six->width;
+    s->next = r->slices;
+    r->slices = s;
+    return s;
+}
+
+
+// Gives a slice room for width pixels across
+static struct emuSlice * sixel_widen(struct emuState *S, struct termRow *r, struct emuSlice *old, int width)
+{
+    struct emuSlice *s = calloc(1, sizeof(struct emuSlice) + (size_t) width * S->cellHeight);
+    *s = *old;
+    s->width = width;
+    for(int line = 0; line < S->cellHeight; line++)
+        memcpy(&s->pixels[line * width], &old->pixels[line * old->width], old->width);
+
+    struct emuSlice **p = &r->slices;
+    while(*p != old)
+        p = &(*p)->next;
+    *p = s;
+    free(old);
+    return s;
+}
+
+
+// Finds the rows and slices of the current band's lines, scrolling to bring
+// them on screen if the image may
+static void sixel_band(struct emuState *S, struct emuSixel *six)
+{
+    int scrolls = six->scrolling && six->row <= S->bScroll && !HAS_LR_MARGINS(S);
+    int limit = scrolls ? S->bScroll : S->wRows - 1;
+    int bottom = six->row + (six->y + SIXEL_BAND - 1) / S->cellHeight;
+    if(bottom > limit && scrolls) {
+        int n = bottom - limit;
+        tap_scroll(S, n);
+        scroll_down(S, S->tScroll, S->bScroll, n);
+        six->row -= n;
+
+        // Forget the rows that went off the top, so however long the image
+        // goes on the numbers stay small
+        int gone = six->y / S->cellHeight;
+        CAP_MAX(gone, -six->row);
+        if(gone > 0) {
+            six->row += gone;
+            six->y -= gone * S->cellHeight;
+            six->height -= gone * S->cellHeight;
+        }
+    }
+
+    for(int b = 0; b < SIXEL_BAND; b++) {
+        int row = six->row + (six->y + b) / S->cellHeight;
+        if(row < 0 || row > limit) {
+            six->bandRows[b] = NULL;
+            six->bandSlices[b] = NULL;
+            continue;
+        }
+        struct termRow *r = S->rows[row];
+        six->bandRows[b] = r;
+        six->bandSlices[b] = b > 0 && six->bandRows[b - 1] == r ?
+            six->bandSlices[b - 1] : sixel_slice(S, six, r);
+    }
+    six->bandReady = 1;
+}
+
+
+// Shows the current band as it is so far
+static void sixel_dirty(struct emuState *S, struct emuSixel *six)
+{
+    if(!six->bandReady) return;
+    for(int b = 0; b < SIXEL_BAND; b++) {
+        if(six->bandRows[b])
+            MARK_DIRTY(six->bandRows[b]);
+    }
+}
+
+
+// Draws count sixels of bits (the top line in bit 0) at the current position
+static void sixel_put(struct emuState *S, struct emuSixel *six, int bits, int count)
+{
+    int x = six->x;
+    six->x += count;
+    CAP_MAX(six->x, six->maxWidth);
+    if(!bits || x >= six->maxWidth) return;
+    count = six->x - x;
+
+    if(!six->bandReady)
+        sixel_band(S, six);
+
+    // Slices start narrow and double as the image turns out to be wider
+    if(six->x > six->width) {
+        while(six->width < six->x)
+            six->width *= 2;
+        CAP_MAX(six->width, six->maxWidth);
+    }
+
+    for(int b = 0; b < SIXEL_BAND; b++) {
+        struct emuSlice *s = six->bandSlices[b];
+        if(!(bits & (1 << b)) || !s) continue;
+        if(unlikely(s->width < six->x)) {
+            struct termRow *r = six->bandRows[b];
+            s = sixel_widen(S, r, s, six->width);
+            for(int o = 0; o < SIXEL_BAND; o++) {
+                if(six->bandRows[o] == r)
+                    six->bandSlices[o] = s;
+            }
+        }
+        uint8_t *line = &s->pixels[((six->y + b) % S->cellHeight) * s->width];
+        if(count == 1)
+            line[x] = six->color;
+        else
+            memset(line + x, six->color, count);
+        CAP_MIN(s->used, six->x);
+    }
+    CAP_MIN(six->height, six->y + 32 - __builtin_clz(bits));
+}
+
+
+static void sixel_command(struct emuState *S, struct emuSixel *six)
+{
+    int *p = six->params;
+    switch(six->command) {
+        case '!':
+            six->repeat = p[0] > 0 ? p[0] : 1;
+            break;
+
+        case '#': {
+            int reg = p[0];
+            CAP_MAX(reg, SIXEL_COLORS - 2);
+            if(six->nParams >= 4 && (p[1] == 1 || p[1] == 2)) {
+                uint32_t rgba = p[1] == 1 ? sixel_hls(p[2], p[3], p[4]) : sixel_rgb(p[2], p[3], p[4]);
+                six->image->colors[reg + 1] = rgba;
+                if(reg == 0 && six->image->opaque)
+                    six->image->colors[0] = rgba;
+            }
+            six->color = reg + 1;
+            break;
+        }
+
+        case '"':
+            // Raster attributes: the width, if it comes before any pixels,
+            // sizes the slices
+            if(six->nParams >= 2 && p[2] > 0 && !six->height) {
+                six->width = p[2];
+                CAP_MAX(six->width, six->maxWidth);
+            }
+            break;
+    }
+    six->command = 0;
+}
+
+
+// Takes sixel data up to the first control or 8-bit byte, which ends it, and
+// returns how much it took
+static size_t sixel_feed(struct emuState *S, const uint8_t *bytes, size_t len)
+{
+    struct emuSixel *six = S->sixel;
+    size_t i;
+    for(i = 0; i < len; i++) {
+        uint8_t ch = bytes[i];
+        if(unlikely(ch < 0x20 || ch >= 0x80)) break;
+
+        if(six->command) {
+            if(ch >= '0' && ch <= '9') {
+                int *p = &six->params[six->nParams];
+                *p = 10 * *p + (ch - '0');
+                CAP_MAX(*p, 16383);
+                continue;
+            } else if(ch == ';') {
+                if(six->nParams < 4)
+                    six->nParams++;
+                continue;
+            }
+            sixel_command(S, six);
+        }
+
+        if(ch >= '?' && ch <= '~') {
+            sixel_put(S, six, ch - '?', six->repeat);
+            six->repeat = 1;
+        } else if(ch == '!' || ch == '#' || ch == '"') {
+            six->command = ch;
+            six->nParams = 0;
+            memset(six->params, 0, sizeof(six->params));
+        } else if(ch == '$') {
+            six->x = 0;
+        } else if(ch == '-') {
+            sixel_dirty(S, six);
+            six->x = 0;
+            six->y += SIXEL_BAND;
+            six->bandReady = 0;
+        }
+    }
+    // The host may change the rows before the next chunk comes
+    sixel_dirty(S, six);
+    six->bandReady = 0;
+    return i;
+}
+
+
+// DCS q: P2 = 1 leaves what isn't drawn transparent
+static void sixel_start(struct emuState *S)
+{
+    struct emuSixel *six = calloc(1, sizeof(struct emuSixel));
+    struct emuImage *image = calloc(1, sizeof(struct emuImage));
+    image->refs = 1;
+    for(int i = 0; i < SIXEL_COLORS - 1; i++) {
+        const uint8_t *c = sixel_default_colors[i % 16];
+        image->colors[i + 1] = i < 16 ? sixel_rgb(c[0], c[1], c[2]) : 0xff;
+    }
+    image->opaque = S->params[1] != 1;
+    if(image->opaque)
+        image->colors[0] = image->colors[1];
+
+    six->image = image;
+    six->scrolling = !(S->flags & MODE_SIXEL_DISPLAY);
+    if(six->scrolling) {
+        six->row = S->cRow;
+        six->col = S->cCol;
+    }
+    six->maxWidth = (S->wCols - six->col) * S->cellWidth;
+    six->width = SIXEL_MIN_WIDTH < six->maxWidth ? SIXEL_MIN_WIDTH : six->maxWidth;
+    six->color = 1;
+    six->repeat = 1;
+    S->sixel = six;
+}
+
+
+// The end of the string: the cursor goes to the line under the image
+static void sixel_end(struct emuState *S)
+{
+    struct emuSixel *six = S->sixel;
+    if(six->command)
+        sixel_command(S, six);
+    sixel_dirty(S, six);
+    if(six->scrolling && six->height > 0) {
+        int last = six->row + (six->height - 1) / S->cellHeight;
+        if(last >= 0 && last < S->wRows) {
+            S->cRow = last;
+            cursor_index(S, 1);
+        }
+        S->cCol = six->col;
+        S->wrapnext = 0;
+    }
+    sixel_free(S);
+}
+
+
+#pragma mark - Hyperlinks
+
+
+#define LINK_BUCKETS    256
+#define LINKS_MIN       64  // entries a table starts out with room for
+
+struct emuLink {
+    char *uri;  // NULL if the entry is free
+    char *id;   // "" if it has none; shares uri's allocation
+    uint32_t hash;
+    int next;   // the next entry in its bucket, 0 at the end
+    int refs;   // cells and cursors using it, as of the last sweep
+};
+
+struct emuLinks {
+    int count, size;    // entries in use, and room (index 0 is never used)
+    int added;          // entries added since the last sweep
+    int hint;           // where to start looking for a free one
+    int buckets[LINK_BUCKETS];
+    struct emuLink entries[];
+};
+
+
+static uint32_t link_hash(const char *uri, const char *id)
+{
+    uint32_t h = 2166136261u;
+    for(const char *p = uri; *p; p++)
+        h = (h ^ (uint8_t) *p) * 16777619u;
+    h *= 16777619u;
+    for(const char *p = id; *p; p++)
+        h = (h ^ (uint8_t) *p) * 16777619u;
+    return h;
+}
+
+
+static int link_find(struct emuLinks *L, uint32_t hash, const char *uri, const char *id)
+{
+    for(int i = L->buckets[hash % LINK_BUCKETS]; i; i = L->entries[i].next) {
+        struct emuLink *e = &L->entries[i];
+        if(e->hash == hash && strcmp(e->uri, uri) == 0 && strcmp(e->id, id) == 0)
+            return i;
+    }
+    return 0;
+}
+
+
+static void link_put(struct emuLinks *L, int i, const char *uri, const char *id, uint32_t hash)
+{
+    struct emuLink *e = &L->entries[i];
+    size_t uriLen = strlen(uri) + 1, idLen = strlen(id) + 1;
+    e->uri = malloc(uriLen + idLen);
+    e->id = e->uri + uriLen;
+    memcpy(e->uri, uri, uriLen);
+    memcpy(e->id, id, idLen);
+    e->hash = hash;
+    e->refs = 0;
+    e->next = L->buckets[hash % LINK_BUCKETS];
+    L->buckets[hash % LINK_BUCKETS] = i;
+    L->count++;
+    L->added++;
+}
+
+
+static void link_remove(struct emuLinks *L, int i)
+{
+    struct emuLink *e = &L->entries[i];
+    int *p = &L->buckets[e->hash % LINK_BUCKETS];
+    while(*p != i)
+        p = &L->entries[*p].next;
+    *p = e->next;
+    free(e->uri);
+    e->uri = e->id = NULL;
+    L->count--;
+}
+
+
+// Makes room for entries up to index
+static struct emuLinks * link_grow(struct emuState *S, int index)
+{
+    struct emuLinks *L = S->links;
+    int size = L ? L->size : LINKS_MIN;
+    while(size <= index)
+        size *= 2;
+    if(L && size == L->size)
+        return L;
+
+    int old = L ? L->size : 0;
+    L = realloc(L, sizeof(*L) + size * sizeof(struct emuLink));
+    if(!old) {
+        memset(L, 0, sizeof(*L));
+        L->hint = 1;
+    }
+    memset(&L->entries[old], 0, (size - old) * sizeof(struct emuLink));
+    L->size = size;
+    return S->links = L;
+}
+
+
+// Counts the cells on the screen and the cursors using each link, and frees
+// the ones nothing uses
+static void link_sweep(struct emuState *S)
+{
+    struct emuLinks *L = S->links;
+    for(int i = 0; i < L->size; i++)
+        L->entries[i].refs = 0;
+    for(int r = 0; r < S->wRows; r++) {
+        const uint64_t *cells = S->rows[r]->chars;
+        for(int c = 0; c < S->wCols; c++)
+            L->entries[CELL_LINK(cells[c])].refs++;
+    }
+    L->entries[CELL_LINK(S->cursorLink)].refs++;
+
+    for(int i = 1; i < L->size; i++) {
+        if(L->entries[i].uri && L->entries[i].refs == 0)
+            link_remove(L, i);
+    }
+    L->added = 0;
+}
+
+
+// The index of the link to uri with id, added if it's new; 0 if the table is
+// full of links still in use. Sweeping costs a pass over the screen, so it
+// waits until the table is full and a good part of it was added since the
+// last one, and the table doubles when a sweep leaves it mostly full.
+static int link_add(struct emuState *S, const char *uri, const char *id)
+{
+    struct emuLinks *L = S->links ? S->links : link_grow(S, 0);
+    uint32_t hash = link_hash(uri, id);
+    int i = link_find(L, hash, uri, id);
+    if(i) return i;
+
+    if(L->count == L->size - 1) {
+        if(L->added >= L->size / 4)
+            link_sweep(S);
+        if(L->count >= L->size * 3 / 4 && L->size < LINKS_MAX)
+            L = link_grow(S, L->size);
+        if(L->count == L->size - 1)
+            return 0;
+    }
+
+    for(i = L->hint; L->entries[i].uri; )
+        i = i + 1 < L->size ? i + 1 : 1;
+    link_put(L, i, uri, id, hash);
+    L->hint = i + 1 < L->size ? i + 1 : 1;
+    return i;
+}
+
+
+// Drops the links of cells that the table doesn't have, as cells from
+// elsewhere (a saved screen) may
+static void link_check(struct emuState *S, uint64_t *cells, int count)
+{
+    for(int c = 0; c < count; c++) {
+        int i = CELL_LINK(cells[c]);
+        if(i && !emu_core_getlink(S, i, NULL))
+            cells[c] &= ~CELL_LINK_MASK;
+    }
+}
+
+
+static void link_free(struct emuState *S)
+{
+    struct emuLinks *L = S->links;
+    if(!L) return;
+    for(int i = 1; i < L->size; i++)
+        free(L->entries[i].uri);
+    free(L);
+    S->links = NULL;
+}
+
+
+#pragma mark - Modes
+
+
+static void do_modes(struct emuState *S, int flag)
+{
+    for(int i = 0; i < S->paramPtr; i++) {
+        switch(MODE(S->intermed, S->params[i])) {
+
+            case MODE(0, 4): // IRM (insert/replace mode)
+                APPLY_FLAG(MODE_INSERT, flag);
+                break;
+
+            case MODE(0, 20): // LNM (normal linefeed mode)
+                APPLY_FLAG(MODE_LINEFEED, flag);
+                break;
+
+            case MODE('?', 1): // DECCKM (cursor key mode)
+                APPLY_FLAG(MODE_CURSORKEYS, flag);
+                break;
+
+            case MODE('?', 2): // DECANM (vt52 mode)
+                if(flag == 0) { // this flag is weirdly inverted.
+                    S->flags |= MODE_VT52;
+                    S->charset = 'B';
+                    S->vt52Hack = 0;
+                }
+                break;
+
+            case MODE('?', 3): // DECCOLM (132/80 switch)
+                if(!(S->flags & MODE_ALLOW_DECCOLM)) break;
+                request_resize(S, S->wRows, flag ? 132 : 80);
+                // clear screen, margins and reset cursor to 0/0
+                S->tScroll = 0;
+                S->bScroll = S->wRows - 1;
+                S->lScroll = 0;
+                S->rScroll = S->wCols - 1;
+                for(int i = 0; i < S->wRows; i++)
+                    row_erase(S, i, 0, S->wCols, EMPTY_FIELD);
+                S->cCol = 0;
+                S->cRow = (S->flags & MODE_ORIGIN) ? S->tScroll : 0;
+                break;
+
+            case MODE('?', 4): // DECSCLM (smooth scrolling)
+                // Ignored - we don't implement this feature
+                break;
+
+            case MODE('?', 5): // DECSCNM (reverse video)
+                // The host applies this as an overlay when compositing, so
+                // there's no need to touch the rows themselves.
+                APPLY_FLAG(MODE_INVERT, flag);
+                break;
+
+            case MODE('?', 6): // DECOM (origin mode)
+                APPLY_FLAG(MODE_ORIGIN, flag);
+                // Origin flag homes the cursor when set/reset
+                S->cRow = flag ? S->tScroll : 0;
+                S->cCol = flag ? S->lScroll : 0;
+                break;
+
+            case MODE('?', 7): // DECAWM (wraparound mode)
+                APPLY_FLAG(MODE_WRAPAROUND, flag);
+                break;
+
+            case MODE('?', 8): // DECARM (autorepeat mode)
+                // Ignored - neither of these make sense on a software terminal.
+                break;
 
             case MODE('?', 9): // DECINLM (interlace) / X10 mouse tracking
                 // DECINLM makes no sense on a software terminal.
@@ -990,8 +2128,16 @@ static void do_modes(struct emuState *S, int flag)
                 APPLY_FLAG(MODE_MOUSE_X10, flag);
                 break;
 
+            case MODE('?', 69): // DECLRMM (left/right margin mode)
+                APPLY_FLAG(MODE_LRMARGINS, flag);
+                if(!flag) {
+                    S->lScroll = 0;
+                    S->rScroll = S->wCols - 1;
+                }
+                break;
+
             case MODE('?', 12): // cursor blink
-                // TODO
+                APPLY_FLAG(MODE_CURSORBLINK, flag);
                 break;
 
             case MODE('?', 25): // visible cursor
@@ -1015,6 +2161,10 @@ static void do_modes(struct emuState *S, int flag)
                 APPLY_FLAG(MODE_REVWRAP, flag);
                 break;
 
+            case MODE('?', 80): // DECSDM (sixel display mode)
+                APPLY_FLAG(MODE_SIXEL_DISPLAY, flag);
+                break;
+
             case MODE('?', 1000): // mouse tracking
                 S->flags &= ~MODE_MOUSE_MASK;
                 APPLY_FLAG(MODE_MOUSE_1000, flag);
@@ -1040,11 +2190,8 @@ static void do_modes(struct emuState *S, int flag)
                 // TODO
                 break;
 
-#ifdef DEBUG
             default:
-                printf("unhandled mode %x/%d (flag: %d)\n",
-                       S->intermed, S->params[i], flag);
-#endif
+                TRACE_UNHANDLED();
         }
     }
 }
@@ -1070,6 +2217,7 @@ static void do_RM(struct emuState *S)
 
 static void emu_ops_do_ctrl(struct emuState *S, uint8_t ch)
 {
+    STAT(ctrl[ch & 0x1f]++);
     switch(ch) {
             //CASE(0x05, do_ENQ);
             CASE(0x07, do_BEL);
@@ -1084,16 +2232,16 @@ static void emu_ops_do_ctrl(struct emuState *S, uint8_t ch)
 
             CASE(0x1B, do_ESC);
 
-#ifdef DEBUG
         default:
-            printf("Unknown control char %s\n", safeHex(ch));
-#endif
+            TRACE_UNHANDLED();
     }
 }
 
 
 static void emu_ops_do_esc(struct emuState *S, uint8_t lastch)
 {
+    STAT(esc[lastch & 0x7f]++);
+
     // Ugh, this bit grinds my gears.
     switch(S->intermed) {
         case '(':
@@ -1126,13 +2274,13 @@ static void emu_ops_do_esc(struct emuState *S, uint8_t lastch)
             CASE('M', do_RI);
             //CASE('N', do_SS2);
             //CASE('O', do_SS3);
-            //CASE('P', do_DCS);
+            CASE('P', do_DCS);
             //CASE('V', do_SPA);
             //CASE('W', do_EPA);
             //CASE('X', do_SOS);
             //CASE('Z', do_DECID);
             CASE('[', do_CSI);
-            //CASE('\\', do_ST);
+            CASE('\\', do_ST);
             CASE(']', do_OSC);
             //CASE('^', do_PM);
             //CASE('_', do_APC);
@@ -1140,17 +2288,16 @@ static void emu_ops_do_esc(struct emuState *S, uint8_t lastch)
             // Extended ESC ops
             CASE2('#', '8', do_DECALN);
 
-#ifdef DEBUG
         default:
-            printf("unknown ESC %s\n", safeHex(PACK2(S->intermed, lastch)));
+            TRACE_UNHANDLED();
             break;
-#endif
     }
 }
 
 
 static void emu_ops_do_c1(struct emuState *S, uint8_t lastch)
 {
+    STAT(esc[lastch - 0x40]++);
     switch(lastch) {
             CASE(0x84, do_IND);
             CASE(0x85, do_NEL);
@@ -1158,28 +2305,27 @@ static void emu_ops_do_c1(struct emuState *S, uint8_t lastch)
             CASE(0x8D, do_RI);
             //CASE(0x8E, do_SS2);
             //CASE(0x8F, do_SS3);
-            //CASE(0x90, do_DCS);
+            CASE(0x90, do_DCS);
             //CASE(0x96, do_SPA);
             //CASE(0x97, do_EPA);
             //CASE(0x98, do_SOS);
             //CASE(0x9A, do_DECID);
             CASE(0x9B, do_CSI);
-            //CASE(0x9C, do_ST);
+            CASE(0x9C, do_ST);
             CASE(0x9D, do_OSC);
             //CASE(0x9E, do_PM);
             //CASE(0x9F, do_APC);
 
-#ifdef DEBUG
         default:
-            printf("unknown C1 %02x\n", lastch);
+            TRACE_UNHANDLED();
             break;
-#endif
     }
 }
 
 
 static void emu_ops_do_csi(struct emuState *S, uint8_t lastch)
 {
+    STAT(csi[lastch & 0x7f]++);
     switch(PACK2(S->intermed, lastch)) {
             CASE('@', do_ICH);
             CASE('A', do_CUU);
@@ -1201,7 +2347,7 @@ static void emu_ops_do_csi(struct emuState *S, uint8_t lastch)
             CASE('X', do_ECH);
             CASE('Z', do_CBT);
             CASE('`', do_HPA);
-            //CASE('b', do_REP); (ugh!)
+            CASE('b', do_REP);
             CASE('c', do_DA);
             CASE2('>', 'c', do_DA2);
             //CASE2('=', 'c', do_DA3);
@@ -1221,9 +2367,15 @@ static void emu_ops_do_csi(struct emuState *S, uint8_t lastch)
             //CASE2('"', 'p', do_DECSCL);
             //CASE2('"', 'q', do_DECSCA);
             CASE('r', do_DECSTBM);
+            CASE('s', do_DECSLRM);
             //CASE2('?', 'r', DEC mode restore
             //CASE2('?', 's', DEC mode save
             CASE('t', do_dterm_window);
+            CASE2('$', 'r', do_DECCARA);
+            CASE2('$', 'v', do_DECCRA);
+            CASE2('$', 'x', do_DECFRA);
+            CASE2('*', 'x', do_DECSACE);
+            CASE2('$', 'z', do_DECERA);
             //CASE2(0x27, 'w', do_DECEFR);
             //CASE2('&', 'w', do_DECLRP);
             //CASE('x', do_DECREQTPARM);
@@ -1231,21 +2383,111 @@ static void emu_ops_do_csi(struct emuState *S, uint8_t lastch)
             //CASE2(0x27, '{', do_DECSLE);
             //CASE2(0x27, '|', do_DECRQLP);
 
-#ifdef DEBUG
         default:
-            printf("unhandled CSI");
-            if(S->paramPtr > 0)
-                printf(" %d", S->params[0]);
-            for(int i = 1; i < S->paramPtr; i++)
-                printf("; %d", S->params[i]);
-            printf(" %s\n", safeHex(PACK2(S->intermed, lastch)));
-#endif
+            TRACE_UNHANDLED();
+    }
+}
+
+
+static int parse_color(const char *spec, uint32_t *rgba)
+{
+    uint32_t comp[3];
+
+    if(spec[0] == '#') {
+        unsigned int v;
+        if(strlen(spec) != 7 || sscanf(spec + 1, "%6x", &v) != 1)
+            return 0;
+        comp[0] = (v >> 16) & 0xff;
+        comp[1] = (v >> 8) & 0xff;
+        comp[2] = v & 0xff;
+    } else if(strncmp(spec, "rgb:", 4) == 0) {
+        // XParseColor-style: 1 to 4 hex digits per component, scaled
+        const char *p = spec + 4;
+        for(int i = 0; i < 3; i++) {
+            int digits = 0, val = 0;
+            for(; isxdigit((unsigned char) *p) && digits < 5; p++, digits++)
+                val = 16 * val + (isdigit((unsigned char) *p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+            if(digits < 1 || digits > 4)
+                return 0;
+            comp[i] = val * 255 / ((1 << (4 * digits)) - 1);
+            if(i < 2 && *p++ != '/')
+                return 0;
+        }
+        if(*p) return 0;
+    } else {
+        return 0; // named colors aren't supported
+    }
+
+    *rgba = (comp[0] << 24) | (comp[1] << 16) | (comp[2] << 8) | 0xff;
+    return 1;
+}
+
+
+static void do_OSC_palette(struct emuState *S)
+{
+    // "idx;spec;idx;spec..." - queries ("?") are ignored
+    char *save = NULL;
+    for(char *idx = strtok_r(S->oscBuf, ";", &save); idx;
+        idx = strtok_r(NULL, ";", &save)) {
+        char *spec = strtok_r(NULL, ";", &save);
+        if(!spec) break;
+        int i = atoi(idx);
+        if(i >= 0 && i < 256 && parse_color(spec, &S->palette[i]))
+            S->paletteVersion++;
+    }
+}
+
+
+static void do_OSC_palette_reset(struct emuState *S)
+{
+    if(S->oscBuf[0] == 0) {
+        for(int i = 0; i < 256; i++)
+            S->palette[i] = (default_colormap[i] << 8) | 0xff;
+    } else {
+        char *save = NULL;
+        for(char *idx = strtok_r(S->oscBuf, ";", &save); idx;
+            idx = strtok_r(NULL, ";", &save)) {
+            int i = atoi(idx);
+            if(i >= 0 && i < 256)
+                S->palette[i] = (default_colormap[i] << 8) | 0xff;
+        }
+    }
+    S->paletteVersion++;
+}
+
+
+static void do_OSC_default_color(struct emuState *S, int which)
+{
+    if(parse_color(S->oscBuf, &S->palette[which]))
+        S->paletteVersion++;
+}
+
+
+// OSC 8: "params;URI" links the text that follows to URI, or ends the link
+// if URI is empty. params are key=value pairs separated by colons, of which
+// only id means anything. A URI too long for oscBuf was cut off, so it's
+// taken as no link rather than the wrong one.
+static void do_OSC_hyperlink(struct emuState *S)
+{
+    S->cursorLink = 0;
+    char *uri = strchr(S->oscBuf, ';');
+    if(!uri || !uri[1] || S->oscStream.length > S->paramPtr)
+        return;
+    *uri++ = 0;
+
+    const char *id = "";
+    char *save = NULL;
+    for(char *kv = strtok_r(S->oscBuf, ":", &save); kv; kv = strtok_r(NULL, ":", &save)) {
+        if(strncmp(kv, "id=", 3) == 0)
+            id = kv + 3;
     }
+    S->cursorLink = (uint32_t) link_add(S, uri, id) << CELL_LINK_SHIFT;
 }
 
 
 static void emu_ops_do_osc(struct emuState *S, int op)
 {
+    STAT(osc++);
     switch(op) {
         case 0: // xterm: set icon name and window title
             //case 1: // xterm: set icon name
@@ -1253,10 +2495,217 @@ static void emu_ops_do_osc(struct emuState *S, int op)
             TerminalEmulator_setTitle(S, S->oscBuf);
             break;
 
-#ifdef DEBUG
+        case 4: // xterm: change color number
+            do_OSC_palette(S);
+            break;
+
+        case 8: // hyperlink
+            do_OSC_hyperlink(S);
+            break;
+
+        case 10: // xterm: change default foreground
+            do_OSC_default_color(S, PAL_DEFAULT_FG);
+            break;
+
+        case 11: // xterm: change default background
+            do_OSC_default_color(S, PAL_DEFAULT_BG);
+            break;
+
+        case 104: // xterm: reset color number(s)
+            do_OSC_palette_reset(S);
+            break;
+
         default:
-            printf("unhandled OSC %d; '%s'\n", op, S->oscBuf);
-#endif
+            TRACE_UNHANDLED();
+    }
+}
+
+
+// OSC 52: "Pc;Pd", selections then the data in base64, decoded as it comes
+// and handed to the host in pieces. Queries ("?") aren't answered.
+
+enum { OSC52_SELECTION, OSC52_DATA, OSC52_IGNORE };
+
+static const int8_t base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    [128 ... 255] = -1,
+};
+
+
+static void osc52_open(struct emuState *S)
+{
+    struct emuOscStream *st = &S->oscStream;
+    st->stage = OSC52_SELECTION;
+    st->nSelection = 0;
+    st->selection[0] = 0;
+    st->bits = st->nBits = 0;
+}
+
+
+static void osc52_data(struct emuState *S, const uint8_t *bytes, size_t len)
+{
+    struct emuOscStream *st = &S->oscStream;
+    size_t i = 0;
+    if(st->stage == OSC52_SELECTION) {
+        for(; i < len && bytes[i] != ';'; i++) {
+            if(st->nSelection < OSC_SELECTION_MAX - 1) {
+                st->selection[st->nSelection++] = bytes[i];
+                st->selection[st->nSelection] = 0;
+            }
+        }
+        if(i == len) return;
+        i++;
+        st->stage = OSC52_DATA;
+        if(i < len && bytes[i] == '?')
+            st->stage = OSC52_IGNORE;
+    }
+    if(st->stage != OSC52_DATA) return;
+
+    uint8_t out[1024];
+    size_t n = 0;
+    uint32_t bits = st->bits;
+    int nBits = st->nBits;
+    while(i < len) {
+        if(n > sizeof(out) - 3) {
+            TerminalEmulator_clipboard(S, st->selection, out, n, 0);
+            n = 0;
+        }
+
+        // Four characters at a time make three bytes, when they're all valid
+        // and line up
+        if(nBits == 0 && i + 4 <= len) {
+            int a = base64_values[bytes[i]], b = base64_values[bytes[i + 1]];
+            int c = base64_values[bytes[i + 2]], d = base64_values[bytes[i + 3]];
+            if(likely((a | b | c | d) >= 0)) {
+                uint32_t v = a << 18 | b << 12 | c << 6 | d;
+                out[n] = v >> 16;
+                out[n + 1] = v >> 8;
+                out[n + 2] = v;
+                n += 3;
+                i += 4;
+                continue;
+            }
+        }
+
+        uint8_t ch = bytes[i++];
+        int v = base64_values[ch];
+        if(unlikely(v < 0)) {
+            // Padding ends a quantum, so what's left over of it is dropped;
+            // junk is skipped
+            if(ch == '=')
+                bits = nBits = 0;
+            continue;
+        }
+        bits = bits << 6 | v;
+        nBits += 6;
+        if(nBits >= 8) {
+            nBits -= 8;
+            out[n++] = bits >> nBits;
+        }
+    }
+    st->bits = bits;
+    st->nBits = nBits;
+    if(n)
+        TerminalEmulator_clipboard(S, st->selection, out, n, 0);
+}
+
+
+static void osc52_close(struct emuState *S, int ok)
+{
+    struct emuOscStream *st = &S->oscStream;
+    if(st->stage == OSC52_DATA || st->cut)
+        TerminalEmulator_clipboard(S, st->selection, NULL, 0, ok && !st->cut ? CLIPBOARD_END : CLIPBOARD_ABORT);
+    else if(ok)
+        TRACE_UNHANDLED();
+}
+
+
+// OSC strings whose handlers take the payload as it comes, rather than the
+// first sizeof(oscBuf) bytes once it's all there: open is called when the
+// number is complete, data with each run of the payload, and close when the
+// string ends (ok) or is cut off by anything else
+struct emuOscHandler {
+    int op;
+    void (*open)(struct emuState *S);
+    void (*data)(struct emuState *S, const uint8_t *bytes, size_t len);
+    void (*close)(struct emuState *S, int ok);
+};
+
+static const struct emuOscHandler osc_streams[] = {
+    { 52, osc52_open, osc52_data, osc52_close },
+};
+
+
+static void osc_open(struct emuState *S)
+{
+    S->oscStream.handler = NULL;
+    S->oscStream.length = 0;
+    S->oscStream.cut = 0;
+    for(int i = 0; i < sizeof(osc_streams) / sizeof(osc_streams[0]); i++) {
+        if(osc_streams[i].op == S->paramVal) {
+            S->oscStream.handler = &osc_streams[i];
+            osc_streams[i].open(S);
+            break;
+        }
+    }
+}
+
+
+static void osc_data(struct emuState *S, const uint8_t *bytes, size_t len)
+{
+    S->oscStream.length += len;
+    if(S->oscStream.handler) {
+        if(likely(!S->oscStream.cut))
+            STAT_TIMED(STAT_OSC, S->oscStream.handler->data(S, bytes, len));
+        return;
+    }
+    size_t room = sizeof(S->oscBuf) - 1 - S->paramPtr;
+    if(len > room) len = room;
+    memcpy(&S->oscBuf[S->paramPtr], bytes, len);
+    S->paramPtr += len;
+}
+
+
+// The string was cut off
+static void osc_abort(struct emuState *S)
+{
+    if(S->oscStream.handler) {
+        S->oscStream.handler->close(S, 0);
+        S->oscStream.handler = NULL;
+    }
+}
+
+
+// The string ended with ST or BEL
+static void osc_dispatch(struct emuState *S)
+{
+    TRACE_OSC(S->paramVal, S->oscStream.length);
+    if(S->oscStream.handler) {
+        STAT(osc++);
+        STAT_TIMED(STAT_OSC, S->oscStream.handler->close(S, 1));
+        S->oscStream.handler = NULL;
+    } else {
+        STAT_TIMED(STAT_OSC, emu_ops_do_osc(S, S->paramVal));
+    }
+    S->state = ST_GROUND;
+}
+
+
+// Picks what takes the string after DCS; anything not taken is skipped
+static void emu_ops_do_dcs(struct emuState *S, uint8_t lastch)
+{
+    switch(PACK2(S->intermed, lastch)) {
+            CASE('q', sixel_start);
+
+        default:
+            TRACE_UNHANDLED();
     }
 }
 
@@ -1271,10 +2720,8 @@ static void emu_ops_do_vt52_ctrl(struct emuState *S, uint8_t ch)
             CASE(0x0d, do_NEL);
             CASE(0x1b, do_ESC);
 
-#ifdef DEBUG
         default:
-            printf("Unknown VT52 control char %s\n", safeHex(ch));
-#endif
+            TRACE_UNHANDLED();
     }
 }
 
@@ -1311,10 +2758,8 @@ static void emu_ops_do_vt52_esc(struct emuState *S, uint8_t ch)
 
             CASE('<', do_VT52_return);
 
-#ifdef DEBUG
         default:
-            printf("Unhandled VT52 ESC %c\n", ch);
-#endif
+            TRACE_UNHANDLED();
     }
 }
 
@@ -1322,14 +2767,67 @@ static void emu_ops_do_vt52_esc(struct emuState *S, uint8_t ch)
 #pragma mark - Ground-state output
 
 
-static void do_unichar(struct emuState *S, uint16_t uc)
+// Wide characters, which take two columns, and ones that take none. The
+// latter would combine with the one before, but as cells have room for just
+// the one character, they're dropped.
+static void __attribute__((noinline)) do_widechar(struct emuState *S, uint32_t uc, int width)
 {
-    if(unlikely(S->wrapnext)) {
+    if(width == 0) return;
+
+    if(S->wrapnext) {
+        if(S->flags & MODE_WRAPAROUND)
+            wrap_line(S);
+        S->wrapnext = 0;
+    }
+
+    // With one column left it goes on the next line, or if text doesn't
+    // wrap, on the last two of this one
+    int edge = S->cCol <= S->rScroll ? S->rScroll + 1 : S->wCols;
+    if(edge - LEFT_EDGE(S) < 2) return;
+    if(edge - S->cCol < 2) {
         if(S->flags & MODE_WRAPAROUND) {
-            S->rows[S->cRow]->flags |= TERMROW_WRAPPED;
-            cursor_index(S, 1);
-            S->cCol = 0;
+            wrap_line(S);
+            edge = S->rScroll + 1;
+            if(edge - S->cCol < 2) return;
+        } else {
+            S->cCol = edge - 2;
         }
+    }
+
+    struct termRow *thisRow = S->rows[S->cRow];
+    ROW_WRITABLE(thisRow);
+
+    if(unlikely(S->flags & MODE_INSERT)) {
+        emu_cells_shift_right(&thisRow->chars[S->cCol], edge - S->cCol, 2, EMPTY_FIELD);
+        row_mend(S, thisRow, edge);
+    }
+
+    thisRow->chars[S->cCol] = APPLY_TEXT(uc);
+    thisRow->chars[S->cCol + 1] = APPLY_TEXT(CELL_SPACER);
+    row_mend(S, thisRow, S->cCol);
+    row_mend(S, thisRow, S->cCol + 2);
+    MARK_DIRTY(thisRow);
+    S->lastChar = uc;
+
+    S->cCol += 2;
+    if(S->cCol == edge) {
+        S->cCol--;
+        S->wrapnext = 1;
+    }
+}
+
+
+static void do_unichar(struct emuState *S, uint32_t uc)
+{
+    int width = emu_char_width(uc);
+    if(unlikely(width != 1)) {
+        do_widechar(S, uc, width);
+        return;
+    }
+
+    if(unlikely(S->wrapnext)) {
+        if(S->flags & MODE_WRAPAROUND)
+            wrap_line(S);
         S->wrapnext = 0;
     }
 
@@ -1340,19 +2838,32 @@ static void do_unichar(struct emuState *S, uint16_t uc)
 
     // simplify alias analysis for the compiler by putting this in a variable
     struct termRow *thisRow = S->rows[S->cRow];
+    ROW_WRITABLE(thisRow);
+
+    // Half of a wide character (every one is U+1100 or above) is going
+    int split = unlikely(CELL_GLYPH(thisRow->chars[S->cCol]) >= 0x1100);
 
     if(unlikely(S->flags & MODE_INSERT)) {
-        int toMove = S->wCols - S->cCol - 1;
-        if(toMove > 0) {
-            memmove(&thisRow->chars[S->cCol + 1], &thisRow->chars[S->cCol], toMove);
-        }
+        int edge = S->cCol <= S->rScroll ? S->rScroll + 1 : S->wCols;
+        int toMove = edge - S->cCol - 1;
+        if(toMove > 0)
+            emu_cells_move(&thisRow->chars[S->cCol + 1], &thisRow->chars[S->cCol], toMove);
+        row_mend(S, thisRow, edge);
+        split = 1;
     }
 
-    thisRow->chars[S->cCol++] = APPLY_ATTR(uc);
-    thisRow->flags |= TERMROW_DIRTY;
+    thisRow->chars[S->cCol] = APPLY_TEXT(uc);
+    if(unlikely(split)) {
+        row_mend(S, thisRow, S->cCol);
+        row_mend(S, thisRow, S->cCol + 1);
+    }
+    S->cCol++;
+    MARK_DIRTY(thisRow);
+    S->lastChar = uc;
 
-    if(unlikely(S->cCol == S->wCols)) {
-        S->cCol = S->wCols - 1;
+    // Text wraps at the right margin, unless it started right of it
+    if(unlikely(S->cCol == S->rScroll + 1 || S->cCol == S->wCols)) {
+        S->cCol--;
         S->wrapnext = 1;
     }
 }
@@ -1459,13 +2970,15 @@ static void emu_ops_text(struct emuState * restrict S, const uint8_t *bytes, siz
                         S->utf8state = 0;
                         break;
 
-                    case 6: // process 4/4
-                        do_unichar(S, ((S->utf8buf[0] & 0x0f) << 18)
+                    case 6: { // process 4/4
+                        uint32_t uc = ((S->utf8buf[0] & 0x07) << 18)
                                    |  ((S->utf8buf[1] & 0x3f) << 12)
                                    |  ((S->utf8buf[2] & 0x3f) << 6)
-                                   |   (c & 0x3f));
+                                   |   (c & 0x3f);
+                        do_unichar(S, uc <= 0x10ffff ? uc : 0xfffd);
                         S->utf8state = 0;
                         break;
+                    }
 
                     case 2: // process 2/3
                     case 4: // process 2/4
@@ -1515,24 +3028,32 @@ static void emu_term_reset(struct emuState *S)
 {
     S->state = ST_GROUND;
     S->utf8state = 0;
+    S->lastChar = 0;
+    if(S->sixel)
+        sixel_free(S);
+    osc_abort(S);
 
     for(int i = 0; i < 258; i++)
         S->palette[i] = (default_colormap[i] << 8) | 0xff;
+    S->paletteVersion++;
 
     S->cRow = S->cCol = S->saveRow = S->saveCol = 0;
 
     S->tScroll = 0;
     S->bScroll = S->wRows - 1;
+    S->lScroll = 0;
+    S->rScroll = S->wCols - 1;
 
     S->flags = MODE_WRAPAROUND | MODE_SHOWCURSOR | MODE_ALLOW_DECCOLM;
     S->cursorAttr = S->saveAttr = 0;
+    S->cursorLink = 0;
 
     S->charset = 0;
     for(int i = 0; i < 4; i++)
         S->charsets[i] = 'B'; // USASCII
 
     for(int i = 0; i < S->wRows; i++)
-        row_fill(S, i, 0, S->wCols, EMPTY_FIELD);
+        row_erase(S, i, 0, S->wCols, EMPTY_FIELD);
 
     for(int i = 0; i < S->wCols; i++) {
         if(i % 8 == 7)
@@ -1541,15 +3062,36 @@ static void emu_term_reset(struct emuState *S)
 }
 
 
+// Rows start out with no cells; emu_term_reset() points them all at a blank row
 static void allocBackBuffers(struct emuState *S)
 {
-    size_t rowSize = sizeof(struct termRow) + sizeof(uint64_t) * S->wCols;
-    S->rowBase = calloc(S->wRows, rowSize);
+    S->rowBase = calloc(S->wRows, sizeof(struct termRow));
     S->rows = calloc(S->wRows, sizeof(struct termRow *));
     S->colFlags = calloc(S->wCols, sizeof(uint8_t));
 
     for(int i = 0; i < S->wRows; i++)
-        S->rows[i] = S->rowBase + i * rowSize;
+        S->rows[i] = (struct termRow *) S->rowBase + i;
+}
+
+
+static void freeBackBuffers(struct termRow **rows, int nRows, void *rowBase,
+                            struct emuBlankRow *blanks, uint64_t *freeCells)
+{
+    for(int r = 0; r < nRows; r++) {
+        TerminalEmulator_freeRowBitmaps(rows[r]);
+        free_slices(rows[r]->slices);
+        if(!(rows[r]->flags & TERMROW_BLANK))
+            free(rows[r]->chars);
+    }
+    for(int i = 0; i < BLANK_ROWS; i++)
+        free(blanks[i].cells);
+    while(freeCells) {
+        uint64_t *next = *(uint64_t **) freeCells;
+        free(freeCells);
+        freeCells = next;
+    }
+    free(rows);
+    free(rowBase);
 }
 
 
@@ -1557,6 +3099,12 @@ void emu_core_init(struct emuState *S, int rows, int cols)
 {
     S->wRows = rows;
     S->wCols = cols;
+    S->resizeBudget = RESIZE_BUDGET_MAX;
+    S->traceEpochTicks = emu_core_ticks();
+    S->traceEpochNs = emu_core_nanotime();
+    S->cellWidth = 10;
+    S->cellHeight = 20;
+    emu_cells_init();
 
     allocBackBuffers(S);
     emu_term_reset(S);
@@ -1565,9 +3113,19 @@ void emu_core_init(struct emuState *S, int rows, int cols)
 
 void emu_core_resize(struct emuState *S, int rows, int cols)
 {
+    if(rows == S->wRows && cols == S->wCols) return;
+
     struct termRow **old_rows = S->rows;
     uint8_t *old_colFlags = S->colFlags;
     void *old_rowBase = S->rowBase;
+    struct emuBlankRow old_blanks[BLANK_ROWS];
+    uint64_t *old_freeCells = S->freeCells;
+
+    // Blank rows and spare buffers are all the old width
+    memcpy(old_blanks, S->blanks, sizeof(old_blanks));
+    memset(S->blanks, 0, sizeof(S->blanks));
+    S->freeCells = NULL;
+    S->nFreeCells = 0;
 
     int old_wRows = S->wRows, old_wCols = S->wCols;
 
@@ -1577,29 +3135,131 @@ void emu_core_resize(struct emuState *S, int rows, int cols)
     allocBackBuffers(S);
     emu_term_reset(S);
 
-    // FIXME: Improve this.
+    int keepCols = cols < old_wCols ? cols : old_wCols;
     for(int r = 0; r < rows && r < old_wRows; r++) {
-        for(int c = 0; c < cols && c < old_wCols; c++)
-            S->rows[r]->chars[c] = old_rows[r]->chars[c];
-        S->rows[r]->flags = TERMROW_DIRTY;
+        struct termRow *from = old_rows[r], *to = S->rows[r];
+        // A blank row stays blank unless widening it would need other cells
+        if((from->flags & TERMROW_BLANK) && (cols <= old_wCols || from->chars[0] == to->chars[0])) {
+            row_blank(S, to, from->chars[0]);
+        } else {
+            ROW_WRITABLE(to);
+            emu_cells_copy(to->chars, from->chars, keepCols);
+            row_mend(S, to, keepCols);
+        }
+        to->flags = TERMROW_DIRTY | (to->flags & TERMROW_BLANK);
+        to->slices = from->slices;
+        from->slices = NULL;
     }
 
-    for(int r = 0; r < old_wRows; r++)
-        TerminalEmulator_freeRowBitmaps(old_rows[r]);
-    free(old_rows);
+    freeBackBuffers(old_rows, old_wRows, old_rowBase, old_blanks, old_freeCells);
     free(old_colFlags);
-    free(old_rowBase);
 
     TerminalEmulator_resize(S);
 }
 
 
+// Replaces a row's cells (wCols of them) and TERMROW_* flags, for hosts
+// restoring a saved screen
+void emu_core_setrow(struct emuState *S, int row, const uint64_t *cells, int flags)
+{
+    struct termRow *r = S->rows[row];
+    if(r->slices)
+        row_drop_slices(S, r);
+    if(emu_cells_find_not(cells, S->wCols, cells[0]) == S->wCols) {
+        uint64_t cell = cells[0];
+        link_check(S, &cell, 1);
+        if(IS_SPACER(cell) || IS_WIDE(cell))
+            cell = (cell & ~0xffffffffULL) | 0x20;
+        row_blank(S, r, cell);
+    } else {
+        ROW_WRITABLE(r);
+        emu_cells_copy(r->chars, cells, S->wCols);
+        link_check(S, r->chars, S->wCols);
+        for(int c = 0; c <= S->wCols; c++)
+            row_mend(S, r, c);
+    }
+    r->flags = (flags & ~TERMROW_BLANK) | (r->flags & TERMROW_BLANK) | TERMROW_DIRTY;
+}
+
+
+// Sets the size of a cell in pixels, which sixel images are drawn to. Graphics
+// already drawn (and any being drawn) were made for the old size, so they go.
+void emu_core_setcellsize(struct emuState *S, int width, int height)
+{
+    CAP_MIN_MAX(width, 1, 256);
+    CAP_MIN_MAX(height, 1, 256);
+    if(width == S->cellWidth && height == S->cellHeight) return;
+    S->cellWidth = width;
+    S->cellHeight = height;
+    if(S->sixel)
+        sixel_free(S);
+    for(int i = 0; i < S->wRows; i++) {
+        if(S->rows[i]->slices)
+            row_drop_slices(S, S->rows[i]);
+    }
+}
+
+
+// The index of the link to uri with id, or 0 if there's none
+int emu_core_findlink(struct emuState *S, const char *uri, const char *id)
+{
+    if(!S->links) return 0;
+    return link_find(S->links, link_hash(uri, id), uri, id);
+}
+
+
+// The URI of link index, and its id ("" if it has none) if id isn't NULL;
+// NULL if there's no such link. Good until the next emu_core_run.
+const char * emu_core_getlink(struct emuState *S, int index, const char **id)
+{
+    struct emuLinks *L = S->links;
+    if(!L || index <= 0 || index >= L->size || !L->entries[index].uri)
+        return NULL;
+    if(id)
+        *id = L->entries[index].id;
+    return L->entries[index].uri;
+}
+
+
+// Puts a link at index, in place of any that's there, for hosts restoring a
+// saved table before the rows that use it. Returns -1 if index is out of range.
+int emu_core_setlink(struct emuState *S, int index, const char *uri, const char *id)
+{
+    if(index <= 0 || index >= LINKS_MAX)
+        return -1;
+    struct emuLinks *L = link_grow(S, index);
+    if(L->entries[index].uri)
+        link_remove(L, index);
+    link_put(L, index, uri, id ? id : "", link_hash(uri, id ? id : ""));
+    return 0;
+}
+
+
+// For hosts restoring a terminal saved part way through a streamed OSC string
+// (the one numbered paramVal). What of it was passed on went to the saved
+// terminal's host, so the rest is dropped and its end reported as a cut-off.
+// Returns -1 if paramVal's strings don't stream.
+int emu_core_cutosc(struct emuState *S, const char *selection)
+{
+    osc_open(S);
+    struct emuOscStream *st = &S->oscStream;
+    if(!st->handler)
+        return -1;
+    strncpy(st->selection, selection, OSC_SELECTION_MAX - 1);
+    st->selection[OSC_SELECTION_MAX - 1] = 0;
+    st->nSelection = strlen(st->selection);
+    st->cut = 1;
+    return 0;
+}
+
+
 void emu_core_free(struct emuState *S)
 {
-    for(int r = 0; r < S->wRows; r++)
-        TerminalEmulator_freeRowBitmaps(S->rows[r]);
-    free(S->rowBase);
-    free(S->rows);
+    if(S->sixel)
+        sixel_free(S);
+    osc_abort(S);
+    link_free(S);
+    freeBackBuffers(S->rows, S->wRows, S->rowBase, S->blanks, S->freeCells);
     free(S->colFlags);
 }
 
@@ -1608,9 +3268,19 @@ size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len)
 {
     int first_ground = -1, ground_len = 0;
 
+#ifndef FVEMU_NO_TRACE
+    // One timestamp per chunk of input: reading the clock for every entry
+    // would cost more than recording it
+    S->traceTicks = emu_core_ticks();
+#endif
+
+    S->resizeBudget += (int64_t) len * RESIZE_CELLS_PER_BYTE;
+    CAP_MAX(S->resizeBudget, RESIZE_BUDGET_MAX);
+
 #define GROUND_FLUSH() do { \
     if(first_ground >= 0) { \
-        emu_ops_text(S, bytes + first_ground, ground_len); \
+        TRACE_TEXT(ground_len); \
+        STAT_TIMED(STAT_TEXT, emu_ops_text(S, bytes + first_ground, ground_len)); \
         first_ground = -1; \
     } \
 } while(0)
@@ -1619,19 +3289,23 @@ size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len)
 
     for(int i = 0; i < len; i++) {
         uint8_t ch = bytes[i];
+        STAT(bytes[S->state]++);
 
         if(unlikely(S->flags & MODE_VT52)) {
             if(ch < 0x20) {
                 GROUND_FLUSH();
                 UTF8_FLUSH();
-                emu_ops_do_vt52_ctrl(S, ch);
+                TRACE(TRACE_VT52_CTRL, ch);
+                STAT_TIMED(STAT_VT52, emu_ops_do_vt52_ctrl(S, ch));
                 continue;
             }
         } else {
-            if(ch < 0x20 && S->state != ST_OSC) {
+            if(ch < 0x20 && S->state != ST_OSC && S->state != ST_DCS_STRING) {
                 GROUND_FLUSH();
                 UTF8_FLUSH();
-                emu_ops_do_ctrl(S, ch);
+                if(ch != 0x1b) // ESC is traced once the sequence is complete
+                    TRACE(TRACE_CTRL, ch);
+                STAT_TIMED(STAT_CTRL, emu_ops_do_ctrl(S, ch));
                 continue;
             }
 
@@ -1640,7 +3314,9 @@ size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len)
                 GROUND_FLUSH();
                 if(S->state == ST_GROUND && S->utf8state == 0) {
                     UTF8_FLUSH();
-                    emu_ops_do_c1(S, ch);
+                    if(ch != 0x9b && ch != 0x9d) // likewise CSI and OSC
+                        TRACE(TRACE_C1, ch);
+                    STAT_TIMED(STAT_ESC, emu_ops_do_c1(S, ch));
                     S->state = ST_GROUND; // FIXME: check this
                     continue;
                 }
@@ -1665,12 +3341,15 @@ size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len)
             case ST_ESC:
                 if(S->flags & MODE_VT52) {
                     S->state = ST_GROUND;
-                    emu_ops_do_vt52_esc(S, ch);
+                    TRACE(TRACE_VT52_ESC, ch);
+                    STAT_TIMED(STAT_VT52, emu_ops_do_vt52_esc(S, ch));
                 } else if(ch < 0x30) {
                     S->intermed = S->intermed ? 255 : ch;
                 } else {
                     S->state = ST_GROUND;
-                    emu_ops_do_esc(S, ch);
+                    if(S->intermed || (ch != '[' && ch != ']' && ch != 'P'))
+                        TRACE(TRACE_ESC, ch);
+                    STAT_TIMED(STAT_ESC, emu_ops_do_esc(S, ch));
                 }
                 break;
 
@@ -1691,41 +3370,103 @@ size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len)
                 } else { // dispatch
                     if(S->paramPtr < MAX_PARAMS)
                         S->params[S->paramPtr++] = S->paramVal;
-                    emu_ops_do_csi(S, ch);
+                    TRACE_CSI(ch);
+                    STAT_TIMED(STAT_CSI, emu_ops_do_csi(S, ch));
                     S->state = ST_GROUND;
                 }
                 break;
 
+            case ST_DCS:
+                // Parameters and intermediates as for CSI
+                if(ch < 0x30 || (ch >= 0x3C && ch < 0x40)) {
+                    S->intermed = S->intermed ? 255 : ch;
+                } else if(ch < 0x3A) {
+                    S->paramVal = 10 * S->paramVal + (ch - 0x30);
+                    CAP_MAX(S->paramVal, 16383);
+                } else if(ch == 0x3B) {
+                    if(S->paramPtr < MAX_PARAMS)
+                        S->params[S->paramPtr++] = S->paramVal;
+                    S->paramVal = 0;
+                } else if(ch >= 0x40) {
+                    if(S->paramPtr < MAX_PARAMS)
+                        S->params[S->paramPtr++] = S->paramVal;
+                    TRACE_DCS(ch);
+                    STAT_TIMED(STAT_DCS, emu_ops_do_dcs(S, ch));
+                    S->state = ST_DCS_STRING;
+                }
+                break;
+
+            case ST_DCS_STRING:
+                if(ch >= 0x20 && ch != 0x9C) {
+                    // Take the whole run at once, not a byte a time. Sixel
+                    // data goes on after a stray high byte, which is skipped
+                    // on its own.
+                    size_t n = 1;
+                    if(S->sixel) {
+                        if(ch < 0x80)
+                            STAT_TIMED(STAT_DCS, n = sixel_feed(S, bytes + i, len - i));
+                    } else {
+                        while(i + n < len && bytes[i + n] >= 0x20 && bytes[i + n] != 0x9C)
+                            n++;
+                    }
+                    STAT(bytes[ST_DCS_STRING] += n - 1);
+                    i += n - 1;
+                } else if(ch == 0x1B || ch == 0x18 || ch == 0x1A || ch == 0x9C) {
+                    // Ended by ST (or any other sequence), or cancelled
+                    if(S->sixel)
+                        sixel_end(S);
+                    S->state = ST_GROUND;
+                    if(ch == 0x1B)
+                        emu_ops_do_ctrl(S, ch);
+                }
+                break;
+
             case ST_OSC:
                 // OSC is heavily underspecified in ECMA48. I've come up with
                 // some rules here that mimic xterm's behavior.
                 if(S->intermed == 0) {
                     if(ch >= 0x30 && ch < 0x3A) {
                         S->paramVal = 10 * S->paramVal + (ch - 0x30);
+                        CAP_MAX(S->paramVal, 16383);
+                        break;
                     } else if(ch == 0x3b) {
                         S->intermed = 1;
+                        osc_open(S);
+                        break;
+                    }
+                } else if(S->intermed == 2) {
+                    // ESC: ST if a backslash follows, otherwise the string is
+                    // cut off and this is the start of another sequence
+                    if(ch == 0x5C) {
+                        osc_dispatch(S);
                     } else {
-                        S->state = ST_GROUND; // eh, whatever
+                        osc_abort(S);
+                        S->state = ST_GROUND;
+                        emu_ops_do_ctrl(S, 0x1B);
+                        i--;
                     }
                     break;
+                } else if((ch >= 0x20 && ch < 0x7f) || (ch >= 0xa0)) {
+                    // ECMA48 allows for "00/08 to 00/13 and 02/00 to 07/14",
+                    // but I've tweaked the conditions a bit to allow UTF8 text
+                    // and disallow control characters. Runs of it go at once.
+                    size_t n = emu_bytes_find_ctrl(bytes + i, len - i);
+                    osc_data(S, bytes + i, n);
+                    STAT(bytes[ST_OSC] += n - 1);
+                    i += n - 1;
+                    break;
                 }
 
-                if(ch == 0x07 || ch == 0x9C || (ch == 0x5C && S->intermed == 2)) {
+                if(ch == 0x07 || ch == 0x9C) {
                     // ECMA48 specifies ST (ESC 0x5C or 0x9C), vt100 uses BEL.
                     // We allow both.
-                    emu_ops_do_osc(S, S->paramVal);
-                    S->state = ST_GROUND;
-                }
-
-                if((ch >= 0x20 && ch < 0x7f) || (ch >= 0xa0)) {
-                    // ECMA48 allows for "00/08 to 00/13 and 02/00 to 07/14",
-                    // but I've tweaked the conditions a bit to allow UTF8 text
-                    // and disallow control characters.
-                    if(S->paramPtr < sizeof(S->oscBuf) - 1)
-                        S->oscBuf[S->paramPtr++] = ch;
+                    osc_dispatch(S);
+                } else if(ch == 0x1B) {
+                    S->intermed = 2;
                 } else {
                     // Invalid characters terminate OSC, so that you don't get
                     // stuck in OSC mode forever.
+                    osc_abort(S);
                     S->state = ST_GROUND;
                 }
                 break;
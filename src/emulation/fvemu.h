@@ -7,10 +7,88 @@
 #define BITMAP_PTRS 2
 #define MAX_PARAMS 16
 
+// Every resize the application asks for costs the new screen size in cells
+// out of a budget that grows by RESIZE_CELLS_PER_BYTE for each byte of input,
+// up to RESIZE_BUDGET_MAX, so streams of them can't dominate parsing time.
+#define RESIZE_CELLS_PER_BYTE   16
+#define RESIZE_BUDGET_MAX       (4 * 1000 * 1000)
+
+// Rows whose cells are all the same value (cleared rows, mostly) don't get
+// cells of their own: they point at one of BLANK_ROWS shared, read-only
+// arrays, and are only given their own copy when something writes to them.
+// Up to FREE_CELLS_MAX buffers of rows that went blank are kept for reuse.
+#define BLANK_ROWS      4
+#define FREE_CELLS_MAX  8
+
+// Sixel images are kept a text row at a time, as slices: each holds the lines
+// of one image that fall on a row (cellHeight of them, width pixels each, from
+// the left edge of column col). So images scroll with the text, go when their
+// rows are cleared, and never take more memory than the screen shows. Pixels
+// index the image's colors; 0 is where nothing was drawn.
+#define SIXEL_COLORS    256 // so registers 0-254
+#define SLICES_MAX      4   // images overlapping on one row
+
+struct emuImage {
+    int refs;
+    uint32_t colors[SIXEL_COLORS]; // RGBA; [0] is transparent unless opaque
+    int opaque;                    // undrawn pixels show register 0
+};
+
+struct emuSlice {
+    struct emuSlice *next; // older slices on the same row
+    struct emuImage *image;
+    int col, width, used;  // used: pixels from the left drawn to so far
+    uint8_t pixels[];      // width * cellHeight
+};
+
+// OSC strings are kept in oscBuf, up to its size, and handed to their handler
+// when they end, except for the kinds that stream (OSC 52, the clipboard):
+// their handler gets the payload a run at a time as it arrives, so however
+// long it is, nothing in here grows with it.
+#define OSC_SELECTION_MAX 16
+
+struct emuOscStream {
+    const struct emuOscHandler *handler; // NULL unless a stream is open
+    uint64_t length;                     // payload bytes so far
+    int stage;
+    char selection[OSC_SELECTION_MAX];   // OSC 52's Pc, NUL-terminated
+    int nSelection;
+    uint32_t bits;                       // base64 not decoded yet
+    int nBits;
+    int cut; // restored part way through: drop the rest and report it cut off
+};
+
+// TerminalEmulator_clipboard flags
+#define CLIPBOARD_END       1 // that's all of it
+#define CLIPBOARD_ABORT     2 // the string was cut off: drop what came
+
+// OSC 8 hyperlinks. A cell's link is an index into the emulator's table of
+// them, in the bits of the low word above the glyph (0 is none), so linking
+// text costs nothing but those bits. Each distinct URI and id is kept once,
+// with a count of the cells and cursors using it that's taken by sweeping the
+// screen when the table runs out of room: the ones nothing uses any more go,
+// so however many links go by, it never holds more than LINKS_MAX.
+#define CELL_LINK_SHIFT 21
+#define CELL_LINK_MASK  (0x7ffULL << CELL_LINK_SHIFT)
+#define CELL_LINK(c)    ((int) (((c) & CELL_LINK_MASK) >> CELL_LINK_SHIFT))
+#define LINKS_MAX       2048 // so indices 1-2047
+
+// The code point in a cell's low bits (FVTERM_GLYPH_MASK). A wide character
+// takes two cells: the second has CELL_SPACER there instead, which no code
+// point is, and the same attributes and link.
+#define CELL_GLYPH(c)   ((uint32_t) (c) & 0x1fffff)
+#define CELL_SPACER     0x110000
+
 struct termRow {
     void *bitmaps[BITMAP_PTRS];
     int flags;
-    uint64_t chars[];
+    uint64_t *chars; // wCols cells, shared if TERMROW_BLANK
+    struct emuSlice *slices;
+};
+
+struct emuBlankRow {
+    uint64_t *cells; // every cell is cells[0]
+    int refs;
 };
 
 enum emuCoreState {
@@ -18,6 +96,61 @@ enum emuCoreState {
     ST_ESC,
     ST_CSI,
     ST_OSC,
+    ST_DCS,         // parameters
+    ST_DCS_STRING,  // the string after them
+    EMU_NSTATES
+};
+
+// Handler classes timed when built with FVEMU_STATS
+enum emuStatClass {
+    STAT_TEXT,
+    STAT_CTRL,
+    STAT_ESC,
+    STAT_CSI,
+    STAT_OSC,
+    STAT_VT52,
+    STAT_DCS,
+    STAT_NCLASSES
+};
+
+// Counters kept by the core when it's built with FVEMU_STATS. Cycles are TSC
+// ticks where available (nanoseconds otherwise) spent in each handler class.
+struct emuStats {
+    uint64_t bytes[EMU_NSTATES];    // input bytes seen in each parser state
+    uint64_t ctrl[32];              // C0 controls dispatched, by code
+    uint64_t esc[128], csi[128];    // dispatches by final byte (C1 counts as ESC)
+    uint64_t osc;                   // OSC strings dispatched
+    uint64_t scrolls, scrolledRows; // scroll operations and rows they moved
+    uint64_t rowsDirtied;           // clean rows that were made dirty
+    uint64_t cycles[STAT_NCLASSES], calls[STAT_NCLASSES];
+};
+
+// Every dispatched sequence (and every run of text) is logged to a small
+// per-emulator ring, so the last TRACE_ENTRIES of them can be dumped after
+// the fact. Define FVEMU_NO_TRACE to compile this out.
+#define TRACE_ENTRIES   256 // must be a power of two
+#define TRACE_PARAMS    7
+
+enum emuTraceKind {
+    TRACE_TEXT = 1, // params[0]: bytes in the run (capped at 65535)
+    TRACE_CTRL,
+    TRACE_ESC,
+    TRACE_C1,
+    TRACE_CSI,
+    TRACE_OSC,      // params[0]: OSC number, params[1]: string length (capped at 65535)
+    TRACE_VT52_CTRL,
+    TRACE_VT52_ESC,
+    TRACE_DCS,      // when the string starts
+};
+
+#define TRACEFLAG_UNHANDLED _BIT(0) // the emulator ignored (part of) it
+
+struct emuTraceEntry {
+    uint64_t ticks;         // when the input it came from arrived (emu_core_ticks)
+    uint8_t kind, flags, intermed, final;
+    uint16_t row, col;      // cursor position before the dispatch
+    uint16_t nParams;       // may be more than TRACE_PARAMS
+    uint16_t params[TRACE_PARAMS];
 };
 
 struct emuState {
@@ -25,13 +158,31 @@ struct emuState {
 
     int cRow, cCol;
     uint32_t palette[256 + 2];
+    int paletteVersion; // bumped whenever palette changes
     int wRows, wCols;
     struct termRow **rows;
     void *rowBase;
     uint8_t *colFlags;
 
+    struct emuBlankRow blanks[BLANK_ROWS];
+    uint64_t *freeCells; // linked through each buffer's first cell
+    int nFreeCells;
+
+    // Cells that resizes requested by the application (rather than the host)
+    // may still allocate; refilled as input is consumed
+    int64_t resizeBudget;
+
+    int tapLines; // report finished lines (TerminalEmulator_lineDone)
+
+    int cellWidth, cellHeight;  // in pixels, for placing graphics
+    struct emuSixel *sixel;     // decoder for the DCS q string being received
+    struct emuOscStream oscStream;
+    struct emuLinks *links;     // the OSC 8 link table, made when first needed
+
     int wrapnext, tScroll, bScroll;
+    int lScroll, rScroll; // left and right margins (DECSLRM)
     uint32_t cursorAttr;
+    uint32_t cursorLink; // the link text is written with, in place (CELL_LINK_MASK)
     uint64_t flags;
 
     int state, paramPtr, paramVal;
@@ -39,6 +190,7 @@ struct emuState {
 
     int utf8state;
     uint8_t utf8buf[4];
+    uint32_t lastChar; // the last character written, for REP
 
     uint8_t charset, charsets[4];
 
@@ -52,12 +204,26 @@ struct emuState {
         int params[MAX_PARAMS];
         char oscBuf[512];
     };
+
+#ifdef FVEMU_STATS
+    struct emuStats stats;
+#endif
+
+#ifndef FVEMU_NO_TRACE
+    struct emuTraceEntry trace[TRACE_ENTRIES];
+    uint32_t traceNext;
+    uint64_t traceTicks;
+#endif
+    uint64_t traceEpochTicks, traceEpochNs; // for converting ticks to time
 };
 
 #define _BIT(n) (1UL<<(n))
 
 #define TERMROW_DIRTY       _BIT(0)
 #define TERMROW_WRAPPED     _BIT(1)
+#define TERMROW_BLANK       _BIT(2) // chars is one of the shared blank rows
+#define TERMROW_TAPPED      _BIT(3) // reported as finished and not written since
+#define TERMROW_CONTINUED   _BIT(4) // goes on from a row that scrolled off, unwritten
 
 #define ATTR_FG_MASK        (0xFFUL   << 0)
 #define ATTR_BG_MASK        (0xFFUL   << 8)
@@ -86,6 +252,10 @@ struct emuState {
 #define MODE_SHOWCURSOR     _BIT(9)
 #define MODE_ALLOW_DECCOLM  _BIT(10)
 #define MODE_VT52           _BIT(11)
+#define MODE_CURSORBLINK    _BIT(12)
+#define MODE_RECT_EXTENT    _BIT(13) // DECSACE 2: DECCARA works on rectangles
+#define MODE_LRMARGINS      _BIT(14) // DECLRMM: CSI s sets left/right margins
+#define MODE_SIXEL_DISPLAY  _BIT(15) // DECSDM: sixel images go top left, don't scroll
 
 #define MODE_MOUSE_DOWN     _BIT(59)
 #define MODE_MOUSE_UP       _BIT(60)
@@ -114,7 +284,15 @@ struct emuState {
 void emu_core_init(struct emuState *S, int rows, int cols);
 void emu_core_resize(struct emuState *S, int rows, int cols);
 size_t emu_core_run(struct emuState *S, const uint8_t *bytes, size_t len);
+void emu_core_setrow(struct emuState *S, int row, const uint64_t *cells, int flags);
+void emu_core_setcellsize(struct emuState *S, int width, int height);
+int emu_core_findlink(struct emuState *S, const char *uri, const char *id);
+const char * emu_core_getlink(struct emuState *S, int index, const char **id);
+int emu_core_setlink(struct emuState *S, int index, const char *uri, const char *id);
+int emu_core_cutosc(struct emuState *S, const char *selection);
 void emu_core_free(struct emuState *S);
+uint64_t emu_core_ticks(void);
+uint64_t emu_core_nanotime(void);
 
 // Functions imported by fvemu
 
@@ -124,5 +302,8 @@ void TerminalEmulator_resize(struct emuState *S);
 void TerminalEmulator_write(struct emuState *S, char *bytes, size_t len);
 void TerminalEmulator_writeStr(struct emuState *S, char *bytes);
 void TerminalEmulator_freeRowBitmaps(struct termRow *r);
+void TerminalEmulator_lineDone(struct emuState *S, int row, int scrolledOff);
+void TerminalEmulator_clipboard(struct emuState *S, const char *selection,
+                                const uint8_t *data, size_t len, int flags);
 
 #endif // _FVEMU_H
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef _FVWIDTH_H
+#define _FVWIDTH_H
+
+#include <stdint.h>
+
+// How many cells characters take, from tables genwidth.py generates from
+// Unicode data into fvwidth.c: emu_width_index picks a code point's block of
+// 256 and emu_width_blocks has their widths, two bits each.
+
+extern const uint8_t emu_width_index[0x1100];
+extern const uint8_t emu_width_blocks[][64];
+
+// 2 for wide characters, 0 for ones that combine with the one before, 1 for
+// the rest
+static inline int emu_char_width(uint32_t ch)
+{
+    if(ch < 0x300 || ch > 0x10ffff)
+        return 1;
+    uint8_t packed = emu_width_blocks[emu_width_index[ch >> 8]][(ch & 0xff) >> 2];
+    return (packed >> ((ch & 3) * 2)) & 3;
+}
+
+#endif // _FVWIDTH_H
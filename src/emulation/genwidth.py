@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Generates fvwidth.c, the tables behind emu_char_width() (see fvwidth.h):
+#
+#   genwidth.py [UNICODE_DATA_DIR] > fvwidth.c
+#
+# Widths come from EastAsianWidth.txt and UnicodeData.txt in UNICODE_DATA_DIR
+# if it's given, and from Python's unicodedata module otherwise. Wide (W) and
+# fullwidth (F) characters take two cells. Nonspacing and enclosing marks,
+# format characters other than SOFT HYPHEN and the Hangul medial vowels and
+# final consonants take none, as they combine with what's before them.
+# Everything else, including ambiguous (A) characters, takes one.
+#
+# The tables are two-stage: the code point's high bits pick one of the
+# distinct 256-character blocks, in which each width takes two bits.
+
+import re
+import sys
+
+MAX = 0x110000
+BLOCK = 256
+PER_BYTE = 4
+
+# Blocks and planes whose unassigned code points default to wide
+CJK_RESERVED = [(0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+                (0x20000, 0x2fffd), (0x30000, 0x3fffd)]
+
+
+def load_files(path):
+    eaw = {}
+    version = "data in " + path
+    for line in open(path + "/EastAsianWidth.txt", encoding="utf-8"):
+        # The first line names the file with its version
+        named = re.match(r"# EastAsianWidth-([0-9.]+)\.txt", line)
+        if named:
+            version = named.group(1)
+        line = line.split("#")[0].strip()
+        if not line:
+            continue
+        cps, width = [f.strip() for f in line.split(";")]
+        lo, _, hi = cps.partition("..")
+        for cp in range(int(lo, 16), int(hi or lo, 16) + 1):
+            eaw[cp] = width
+
+    cat = {}
+    first = None
+    for line in open(path + "/UnicodeData.txt", encoding="utf-8"):
+        fields = line.split(";")
+        cp, name, category = int(fields[0], 16), fields[1], fields[2]
+        if name.endswith(", First>"):
+            first = cp
+            continue
+        for c in range(first if name.endswith(", Last>") else cp, cp + 1):
+            cat[c] = category
+        first = None
+
+    return (lambda cp: eaw.get(cp, "N")), (lambda cp: cat.get(cp, "Cn")), version
+
+
+def load_python():
+    import unicodedata
+    return (lambda cp: unicodedata.east_asian_width(chr(cp)),
+            lambda cp: unicodedata.category(chr(cp)),
+            unicodedata.unidata_version)
+
+
+def width(cp, eaw, category):
+    if 0x1160 <= cp <= 0x11ff:
+        return 0
+    cat = category(cp)
+    if cat in ("Mn", "Me") or (cat == "Cf" and cp != 0xad):
+        return 0
+    # Unassigned code points are wide where the CJK ones will go, whatever
+    # the data says
+    if cat == "Cn":
+        return 2 if any(lo <= cp <= hi for lo, hi in CJK_RESERVED) else 1
+    return 2 if eaw(cp) in ("W", "F") else 1
+
+
+def main():
+    eaw, category, version = load_files(sys.argv[1]) if len(sys.argv) > 1 else load_python()
+    widths = [width(cp, eaw, category) for cp in range(MAX)]
+
+    # emu_char_width() answers 1 below U+0300 without looking
+    assert all(w == 1 for w in widths[0x20:0x300])
+
+    blocks, index = [], []
+    seen = {}
+    for start in range(0, MAX, BLOCK):
+        packed = bytes(sum(widths[start + i + j] << (2 * j) for j in range(PER_BYTE))
+                       for i in range(0, BLOCK, PER_BYTE))
+        if packed not in seen:
+            seen[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(seen[packed])
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write("// Generated by genwidth.py (Unicode %s); don't edit.\n\n" % version)
+    out.write('#include "fvwidth.h"\n\n')
+    out.write("const uint8_t emu_width_index[%d] = {\n" % len(index))
+    for i in range(0, len(index), 16):
+        out.write("    " + " ".join("%d," % b for b in index[i:i + 16]) + "\n")
+    out.write("};\n\n")
+    out.write("const uint8_t emu_width_blocks[%d][%d] = {\n" % (len(blocks), BLOCK // PER_BYTE))
+    for block in blocks:
+        out.write("    {\n")
+        for i in range(0, len(block), 16):
+            out.write("        " + " ".join("0x%02x," % b for b in block[i:i + 16]) + "\n")
+        out.write("    },\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
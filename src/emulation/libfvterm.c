@@ -2,9 +2,91 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "libfvterm.h"
-#include "emu_core.h"
+#include "fvemu.h"
+#include "fvcells.h"
+#include "fvwidth.h"
+#include "DefaultColors.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+
+
+static uint64_t record_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+static int varint_encode(uint8_t *buf, uint64_t val)
+{
+    int n = 0;
+    do {
+        buf[n] = val & 0x7f;
+        val >>= 7;
+        if(val) buf[n] |= 0x80;
+        n++;
+    } while(val);
+    return n;
+}
+
+
+static void record_varint(FILE *fp, uint64_t val)
+{
+    uint8_t buf[10];
+    fwrite(buf, 1, varint_encode(buf, val), fp);
+}
+
+
+static void record_chunk(struct fvterm *self, int type, const void *data, size_t len)
+{
+    uint64_t now = record_now();
+    fputc(type, self->record);
+    record_varint(self->record, now - self->recordTime);
+    record_varint(self->record, len);
+    fwrite(data, 1, len, self->record);
+    self->recordTime = now;
+}
+
+
+// A line for callbacks.line being put together, row by row
+struct lineBuf {
+    char *text;
+    size_t len, size;
+    struct fvtermSpan *spans;
+    int nSpans, maxSpans;
+    // The spans' URIs are copied here, as the cells' links may be gone by the
+    // time a line that scrolled off is finished; uriAt is where each span's
+    // starts, plus one (0 for none)
+    char *uris;
+    size_t urisLen, urisSize;
+    size_t *uriAt;
+};
+
+struct fvtermLines {
+    // The rows that have scrolled off so far of a line that's still going
+    // (open), and room for lines finished while still on screen
+    struct lineBuf pending, scratch;
+    int open;
+};
+
+
+static void lines_free(struct fvtermLines *lines)
+{
+    if(!lines) return;
+    struct lineBuf *bufs[] = { &lines->pending, &lines->scratch };
+    for(int i = 0; i < 2; i++) {
+        free(bufs[i]->text);
+        free(bufs[i]->spans);
+        free(bufs[i]->uris);
+        free(bufs[i]->uriAt);
+    }
+    free(lines);
+}
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -12,7 +94,7 @@
 
 struct fvterm * fvterm_init(int rows, int cols)
 {
-    struct fvterm *self = malloc(sizeof(struct fvterm));
+    struct fvterm *self = calloc(1, sizeof(struct fvterm));
     self->state = malloc(sizeof(struct emuState));
     bzero(self->state, sizeof(struct emuState));
     emu_core_init(self->state, rows, cols);
@@ -23,20 +105,40 @@ struct fvterm * fvterm_init(int rows, int cols)
 
 void fvterm_free(struct fvterm *self)
 {
+    lines_free(self->lines);
     emu_core_free(self->state);
     free(self->state);
     free(self);
 }
 
 
+void fvterm_setcallbacks(struct fvterm *self, const struct fvtermCallbacks *callbacks, void *ctx)
+{
+    if(callbacks)
+        self->callbacks = *callbacks;
+    else
+        bzero(&self->callbacks, sizeof(self->callbacks));
+    self->ctx = ctx;
+    self->state->tapLines = self->callbacks.line != NULL;
+}
+
+
 void fvterm_write(struct fvterm *self, const uint8_t *data, size_t len)
 {
+    if(self->record)
+        record_chunk(self, FVREC_INPUT, data, len);
     emu_core_run(self->state, data, len);
 }
 
 
 void fvterm_setsize(struct fvterm *self, int rows, int cols)
 {
+    if(self->record) {
+        uint8_t buf[20];
+        int n = varint_encode(buf, rows);
+        n += varint_encode(buf + n, cols);
+        record_chunk(self, FVREC_SIZE, buf, n);
+    }
     emu_core_resize(self->state, rows, cols);
 }
 
@@ -70,6 +172,1029 @@ uint64_t fvterm_getglyph(struct fvterm *self, int row, int col)
 }
 
 
+// How many columns a character takes: 2 for wide ones, which are followed by
+// an FVTERM_GLYPH_SPACER cell, 0 for ones the emulator drops (combining
+// marks and the like), otherwise 1
+int fvterm_charwidth(uint32_t ch)
+{
+    return emu_char_width(ch);
+}
+
+
+// Copies rows x cols cells starting at top/left into cells, row-major, and
+// each row's TERMROW_* flags into flags if it isn't NULL. The region must lie
+// entirely on screen. Returns the number of cells copied, or -1.
+int fvterm_getregion(struct fvterm *self, int top, int left, int rows, int cols,
+                     uint64_t *cells, int *flags)
+{
+    struct emuState *S = self->state;
+    if(top < 0 || left < 0 || rows < 0 || cols < 0) return -1;
+    if(top + rows > S->wRows || left + cols > S->wCols) return -1;
+
+    for(int r = 0; r < rows; r++) {
+        struct termRow *row = S->rows[top + r];
+        emu_cells_copy(cells + r * cols, &row->chars[left], cols);
+        if(flags) flags[r] = row->flags;
+    }
+    return rows * cols;
+}
+
+
+// Copies a whole row (wCols cells) and optionally its flags
+int fvterm_getrow(struct fvterm *self, int row, uint64_t *cells, int *flags)
+{
+    return fvterm_getregion(self, row, 0, 1, self->state->wCols, cells, flags);
+}
+
+
+// Fills in screen and, unless they're NULL, copies every cell and row flag
+// into cells (rows * cols) and flags (rows). Call with NULL arrays first to
+// find out how big they need to be. Returns the number of cells.
+int fvterm_getscreen(struct fvterm *self, struct fvtermScreen *screen,
+                     uint64_t *cells, int *flags)
+{
+    struct emuState *S = self->state;
+    if(screen) {
+        *screen = (struct fvtermScreen) {
+            .rows = S->wRows, .cols = S->wCols,
+            .cursorRow = S->cRow, .cursorCol = S->cCol,
+            .scrollTop = S->tScroll, .scrollBottom = S->bScroll,
+            .cursorAttr = S->cursorAttr,
+            .modes = S->flags,
+            .scrollLeft = S->lScroll, .scrollRight = S->rScroll,
+        };
+    }
+    if(cells)
+        return fvterm_getregion(self, 0, 0, S->wRows, S->wCols, cells, flags);
+    if(flags) {
+        for(int r = 0; r < S->wRows; r++)
+            flags[r] = S->rows[r]->flags;
+    }
+    return S->wRows * S->wCols;
+}
+
+
+// Fills in up to max of the graphics on a row, newest (topmost) first, and
+// returns how many there are; call with max 0 to count them
+int fvterm_getgraphics(struct fvterm *self, int row, struct fvtermGraphic *graphics, int max)
+{
+    struct emuState *S = self->state;
+    if(row < 0 || row >= S->wRows) return -1;
+
+    int n = 0;
+    for(struct emuSlice *s = S->rows[row]->slices; s; s = s->next, n++) {
+        if(n >= max) continue;
+        graphics[n] = (struct fvtermGraphic) {
+            .col = s->col, .width = s->width, .height = S->cellHeight, .used = s->used,
+            .pixels = s->pixels, .colors = s->image->colors,
+        };
+    }
+    return n;
+}
+
+
+// Sixel images are drawn at this many pixels per cell (10x20 until it's set).
+// Changing it drops the graphics already on the screen.
+void fvterm_setcellsize(struct fvterm *self, int width, int height)
+{
+    emu_core_setcellsize(self->state, width, height);
+}
+
+
+// The URI a cell of this terminal's screen links to with OSC 8, and its id
+// ("" if it has none) if id isn't NULL; NULL if it isn't linked. A link only
+// lasts while something on the screen uses it, so look up the links of cells
+// kept after they scroll off (or take them from the line callback) before
+// then. Valid until the next fvterm_write.
+const char * fvterm_getlink(struct fvterm *self, uint64_t cell, const char **id)
+{
+    return emu_core_getlink(self->state, CELL_LINK(cell), id);
+}
+
+
+static int utf8_encode(char *out, uint32_t ch)
+{
+    if(ch < 0x80) {
+        out[0] = ch;
+        return 1;
+    } else if(ch < 0x800) {
+        out[0] = 0xc0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3f);
+        return 2;
+    } else if(ch < 0x10000) {
+        out[0] = 0xe0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3f);
+        out[2] = 0x80 | (ch & 0x3f);
+        return 3;
+    } else {
+        out[0] = 0xf0 | (ch >> 18);
+        out[1] = 0x80 | ((ch >> 12) & 0x3f);
+        out[2] = 0x80 | ((ch >> 6) & 0x3f);
+        out[3] = 0x80 | (ch & 0x3f);
+        return 4;
+    }
+}
+
+
+static int sgr_color(char *out, int base, int index)
+{
+    if(index < 8)
+        return sprintf(out, ";%d", base + index);
+    if(index < 16)
+        return sprintf(out, ";%d", base + 60 + index - 8);
+    return sprintf(out, ";%d;5;%d", base + 8, index);
+}
+
+
+static const struct {
+    uint32_t bit;
+    int on, off;
+} sgrFlags[] = {
+    { ATTR_BOLD, 1, 22 },
+    { ATTR_FAINT, 2, 22 },
+    { ATTR_ITALIC, 3, 23 },
+    { ATTR_UNDERLINE, 4, 24 },
+    { ATTR_BLINK, 5, 25 },
+    { ATTR_REVERSE, 7, 27 },
+    { ATTR_INVIS, 8, 28 },
+    { ATTR_STRIKE, 9, 29 },
+};
+
+
+// Parameters (each with a leading ';') that take the SGR state from "from"
+// to "to", without resetting first
+static int sgr_params(char *out, uint32_t from, uint32_t to)
+{
+    int n = 0;
+    // 22 clears both bold and faint, so it may have to be followed by either
+    uint32_t intensity = ATTR_BOLD | ATTR_FAINT;
+    if((from & intensity) & ~(to & intensity)) {
+        n += sprintf(out + n, ";22");
+        from &= ~intensity;
+    }
+    for(int i = 0; i < sizeof(sgrFlags) / sizeof(sgrFlags[0]); i++) {
+        uint32_t bit = sgrFlags[i].bit;
+        if((to & bit) && !(from & bit))
+            n += sprintf(out + n, ";%d", sgrFlags[i].on);
+        else if(!(to & bit) && (from & bit))
+            n += sprintf(out + n, ";%d", sgrFlags[i].off);
+    }
+
+    uint32_t fg = ATTR_FG_MASK | ATTR_CUSTFG, bg = ATTR_BG_MASK | ATTR_CUSTBG;
+    if((from & fg) != (to & fg)) {
+        if(to & ATTR_CUSTFG)
+            n += sgr_color(out + n, 30, to & ATTR_FG_MASK);
+        else
+            n += sprintf(out + n, ";39");
+    }
+    if((from & bg) != (to & bg)) {
+        if(to & ATTR_CUSTBG)
+            n += sgr_color(out + n, 40, (to & ATTR_BG_MASK) >> 8);
+        else
+            n += sprintf(out + n, ";49");
+    }
+    return n;
+}
+
+
+// Writes the SGR sequence that changes a terminal's attributes from "from" to
+// "to" (as in the high half of a cell), the shorter of an incremental one and
+// a reset followed by what's set, and returns its length: 0 if they're the
+// same. out must have room for FVTERM_SGR_MAX bytes.
+int fvterm_sgr(char *out, uint32_t from, uint32_t to)
+{
+    if(from == to) return 0;
+
+    char incr[FVTERM_SGR_MAX], reset[FVTERM_SGR_MAX];
+    int ni = sgr_params(incr, from, to);
+    int nr = to ? sgr_params(reset, 0, to) + 2 : 0; // ";0" or nothing
+
+    int n;
+    if(!to)
+        n = sprintf(out, "\e[");
+    else if(nr <= ni)
+        n = sprintf(out, "\e[0%s", reset);
+    else
+        n = sprintf(out, "\e[%s", incr + 1);
+    out[n++] = 'm';
+    return n;
+}
+
+
+// Export output, with snprintf semantics: everything is counted, but only
+// what fits (whole characters, and room for the NUL) is written
+struct exportBuf {
+    char *buf;
+    size_t len;
+    size_t pos, fill; // bytes counted, bytes written
+};
+
+
+static inline void export_put(struct exportBuf *w, const char *bytes, size_t n)
+{
+    if(w->fill == w->pos && w->pos + n < w->len) {
+        memcpy(w->buf + w->pos, bytes, n);
+        w->fill += n;
+    }
+    w->pos += n;
+}
+
+
+// A blank that FVTERM_EXPORT_TRIM may drop: one that shows nothing, even with
+// its attributes
+static inline int export_blank(uint64_t cell, int flags)
+{
+    uint32_t ch = cell & FVTERM_GLYPH_MASK;
+    if(ch != ' ' && ch != 0) return 0;
+    if(!(flags & FVTERM_EXPORT_SGR)) return 1;
+    return !((cell >> 32) & (ATTR_CUSTBG | ATTR_REVERSE | ATTR_UNDERLINE | ATTR_STRIKE));
+}
+
+
+// Switches the link text is exported in to link, by index into S's table
+static void export_link(struct exportBuf *w, struct emuState *S, int link)
+{
+    const char *id = "";
+    const char *uri = link ? emu_core_getlink(S, link, &id) : NULL;
+    export_put(w, "\e]8;", 4);
+    if(*id) {
+        export_put(w, "id=", 3);
+        export_put(w, id, strlen(id));
+    }
+    export_put(w, ";", 1);
+    if(uri)
+        export_put(w, uri, strlen(uri));
+    export_put(w, "\e\\", 2);
+}
+
+
+#define EXPORT_BLOCK 16
+
+// Appends the text of one row. Most rows are mostly ASCII in one set of
+// attributes, so cells are taken EXPORT_BLOCK at a time: if every one of a
+// block is printable ASCII in the current attributes (and link), the block is
+// just their low bytes, in a loop the compiler can vectorize. Links are only
+// exported with FVTERM_EXPORT_LINKS, from S's table.
+static void export_row(struct exportBuf *w, struct emuState *S, const uint64_t *cells, int cols,
+                       int flags, uint32_t *attr, int *link, int wrapped)
+{
+    int end = cols;
+    if((flags & FVTERM_EXPORT_TRIM) && !wrapped) {
+        while(end > 0 && export_blank(cells[end - 1], flags))
+            end--;
+    }
+
+    int links = S && (flags & FVTERM_EXPORT_LINKS);
+    uint64_t want = ((uint64_t) *attr << 32) | ((uint64_t) *link << CELL_LINK_SHIFT);
+    uint64_t keep = ((flags & FVTERM_EXPORT_SGR) ? 0xffffffff00000000ULL : 0) |
+                    (links ? CELL_LINK_MASK : 0);
+    int c = 0;
+    while(c < end) {
+        if(c + EXPORT_BLOCK <= end) {
+            uint64_t bad = 0;
+            for(int i = 0; i < EXPORT_BLOCK; i++) {
+                uint64_t cell = cells[c + i];
+                bad |= ((cell & keep) ^ want) | ((uint32_t) ((cell & FVTERM_GLYPH_MASK) - 0x20) > 0x5e);
+            }
+            if(!bad) {
+                if(w->fill == w->pos && w->pos + EXPORT_BLOCK < w->len) {
+                    char *out = w->buf + w->pos;
+                    for(int i = 0; i < EXPORT_BLOCK; i++)
+                        out[i] = (char) cells[c + i];
+                    w->fill += EXPORT_BLOCK;
+                }
+                w->pos += EXPORT_BLOCK;
+                c += EXPORT_BLOCK;
+                continue;
+            }
+        }
+
+        // The hard way, for one block
+        int stop = c + EXPORT_BLOCK < end ? c + EXPORT_BLOCK : end;
+        for(; c < stop; c++) {
+            uint64_t cell = cells[c];
+            if((flags & FVTERM_EXPORT_SGR) && (uint32_t) (cell >> 32) != *attr) {
+                char sgr[FVTERM_SGR_MAX];
+                export_put(w, sgr, fvterm_sgr(sgr, *attr, cell >> 32));
+                *attr = cell >> 32;
+            }
+            if(links && CELL_LINK(cell) != *link) {
+                *link = CELL_LINK(cell);
+                export_link(w, S, *link);
+            }
+            want = ((uint64_t) *attr << 32) | ((uint64_t) *link << CELL_LINK_SHIFT);
+            uint32_t ch = cell & FVTERM_GLYPH_MASK;
+            if(ch == FVTERM_GLYPH_SPACER) continue; // the wide character's
+            if(ch == 0) ch = ' ';
+            char enc[4];
+            export_put(w, enc, utf8_encode(enc, ch));
+        }
+    }
+
+    if(!wrapped) {
+        // Every line stands on its own
+        if(*link) {
+            export_link(w, S, 0);
+            *link = 0;
+        }
+        if(*attr) {
+            export_put(w, "\e[m", 3);
+            *attr = 0;
+        }
+        export_put(w, "\n", 1);
+    }
+}
+
+
+// Writes the text of rows top..top+rows-1 to buf as UTF-8, one line per row,
+// each ending in a newline, with the FVTERM_EXPORT_* flags applied. Like
+// snprintf, at most len bytes including a terminating NUL are written, and the
+// return value is the length the whole text needs; (size_t) -1 if the rows
+// aren't on screen.
+size_t fvterm_export(struct fvterm *self, int top, int rows, int flags, char *buf, size_t len)
+{
+    struct emuState *S = self->state;
+    if(top < 0 || rows < 0 || top + rows > S->wRows) return -1;
+
+    struct exportBuf w = { .buf = buf, .len = len };
+    uint32_t attr = 0;
+    int link = 0;
+    for(int r = top; r < top + rows; r++) {
+        int wrapped = (flags & FVTERM_EXPORT_JOIN) && r + 1 < top + rows &&
+                      (S->rows[r]->flags & TERMROW_WRAPPED);
+        export_row(&w, S, S->rows[r]->chars, S->wCols, flags, &attr, &link, wrapped);
+    }
+    if(len > 0)
+        buf[w.fill] = 0;
+    return w.pos;
+}
+
+
+// The same for rows of cells kept by the caller, e.g. scrollback saved with
+// fvterm_getrow(): rows * cols cells, and the rows' flags (may be NULL).
+// There's no link table to go with them, so FVTERM_EXPORT_LINKS does nothing.
+size_t fvterm_exportcells(const uint64_t *cells, const int *rowFlags, int rows, int cols,
+                          int flags, char *buf, size_t len)
+{
+    if(rows < 0 || cols < 0) return -1;
+
+    struct exportBuf w = { .buf = buf, .len = len };
+    uint32_t attr = 0;
+    int link = 0;
+    for(int r = 0; r < rows; r++) {
+        int wrapped = (flags & FVTERM_EXPORT_JOIN) && rowFlags && r + 1 < rows &&
+                      (rowFlags[r] & TERMROW_WRAPPED);
+        export_row(&w, NULL, cells + (size_t) r * cols, cols, flags, &attr, &link, wrapped);
+    }
+    if(len > 0)
+        buf[w.fill] = 0;
+    return w.pos;
+}
+
+
+// fvterm_export() without any flags: every cell of every row
+size_t fvterm_getutf8(struct fvterm *self, int top, int rows, char *buf, size_t len)
+{
+    return fvterm_export(self, top, rows, 0, buf, len);
+}
+
+
+static inline int line_blank(uint64_t cell)
+{
+    uint32_t ch = cell & FVTERM_GLYPH_MASK;
+    return ch == ' ' || ch == 0;
+}
+
+
+// Starts a span at byte at, linked to uri
+static struct fvtermSpan * line_span(struct lineBuf *b, uint32_t at, uint32_t attr, const char *uri)
+{
+    if(b->nSpans == b->maxSpans) {
+        b->maxSpans = b->maxSpans ? b->maxSpans * 2 : 16;
+        b->spans = realloc(b->spans, b->maxSpans * sizeof(struct fvtermSpan));
+        b->uriAt = realloc(b->uriAt, b->maxSpans * sizeof(size_t));
+    }
+    b->uriAt[b->nSpans] = 0;
+    if(uri) {
+        size_t len = strlen(uri) + 1;
+        if(b->urisLen + len > b->urisSize) {
+            b->urisSize = (b->urisLen + len) * 2;
+            b->uris = realloc(b->uris, b->urisSize);
+        }
+        memcpy(b->uris + b->urisLen, uri, len);
+        b->uriAt[b->nSpans] = b->urisLen + 1;
+        b->urisLen += len;
+    }
+    struct fvtermSpan *span = &b->spans[b->nSpans++];
+    *span = (struct fvtermSpan) { .start = at, .attr = attr };
+    return span;
+}
+
+
+// Adds a row's cells to a line; the last row of one loses its trailing blanks.
+// Links are looked up in S's table.
+static void line_append(struct lineBuf *b, struct emuState *S, const uint64_t *cells, int cols, int last)
+{
+    int end = cols;
+    if(last) {
+        while(end > 0 && line_blank(cells[end - 1]))
+            end--;
+    }
+
+    size_t need = b->len + (size_t) end * 4 + 1;
+    if(need > b->size) {
+        b->size = need * 2;
+        b->text = realloc(b->text, b->size);
+    }
+
+    // The link of the cell before and its URI, and the link the last span
+    // is known to have (-1 if it's from an earlier row)
+    int link = 0, spanLink = -1;
+    const char *uri = NULL;
+
+    char *out = b->text + b->len;
+    for(int c = 0; c < end; c++) {
+        uint64_t cell = cells[c];
+        uint32_t ch = cell & FVTERM_GLYPH_MASK;
+        uint32_t attr = cell >> 32;
+        if(!(cell >> CELL_LINK_SHIFT) && ch - 0x20 <= 0x5e) {
+            *out++ = (char) ch;
+            continue;
+        }
+        if(ch == FVTERM_GLYPH_SPACER) continue;
+
+        if(CELL_LINK(cell) != link) {
+            link = CELL_LINK(cell);
+            uri = link ? emu_core_getlink(S, link, NULL) : NULL;
+        }
+
+        int n = utf8_encode(out, ch ? ch : ' ');
+        if(attr || uri) {
+            uint32_t at = out - b->text;
+            struct fvtermSpan *span = b->nSpans ? &b->spans[b->nSpans - 1] : NULL;
+            if(span && span->attr == attr && span->start + span->len == at && spanLink != link) {
+                // Continuing one from an earlier row, if it has the same URI
+                size_t u = b->uriAt[b->nSpans - 1];
+                if(uri ? u && strcmp(b->uris + u - 1, uri) == 0 : !u)
+                    spanLink = link;
+            }
+            if(!span || span->attr != attr || span->start + span->len != at || spanLink != link) {
+                span = line_span(b, at, attr, uri);
+                spanLink = link;
+            }
+            span->len += n;
+        }
+        out += n;
+    }
+    b->len = out - b->text;
+    *out = 0;
+}
+
+
+static void line_emit(struct fvterm *self, struct lineBuf *b)
+{
+    if(!b->text)
+        line_append(b, NULL, NULL, 0, 0); // so there's a string
+    for(int i = 0; i < b->nSpans; i++)
+        b->spans[i].uri = b->uriAt[i] ? b->uris + b->uriAt[i] - 1 : NULL;
+    self->callbacks.line(self->ctx, b->text, b->len, b->spans, b->nSpans);
+    b->len = 0;
+    b->nSpans = 0;
+    b->urisLen = 0;
+    if(b == &self->lines->pending)
+        self->lines->open = 0;
+}
+
+
+// Hands every line still on the screen to callbacks.line, as if the screen
+// had scrolled away: the rows up to the cursor or the last one with anything
+// on it, whichever is further down. For when the session ends.
+void fvterm_flushlines(struct fvterm *self)
+{
+    struct emuState *S = self->state;
+    if(!self->callbacks.line) return;
+
+    int last = S->cCol > 0 ? S->cRow : S->cRow - 1;
+    for(int r = S->wRows - 1; r > last; r--) {
+        const uint64_t *cells = S->rows[r]->chars;
+        int c = S->wCols;
+        while(c > 0 && line_blank(cells[c - 1]))
+            c--;
+        if(c > 0) {
+            last = r;
+            break;
+        }
+    }
+
+    for(int r = 0; r <= last; r++) {
+        if(r == last || !(S->rows[r]->flags & TERMROW_WRAPPED))
+            TerminalEmulator_lineDone(S, r, 0);
+    }
+    if(self->lines && self->lines->open)
+        line_emit(self, &self->lines->pending);
+}
+
+
+// Starts recording everything written to (and by) this terminal to fp, in
+// the format described in libfvterm.h. Pass NULL to stop; the caller owns fp
+// either way.
+int fvterm_record(struct fvterm *self, FILE *fp)
+{
+    if(self->record)
+        fflush(self->record);
+    self->record = fp;
+    if(!fp) return 0;
+
+    self->recordTime = record_now();
+    fwrite(FVREC_MAGIC, 1, strlen(FVREC_MAGIC), fp);
+    fputc(FVREC_VERSION, fp);
+    record_varint(fp, self->state->wRows);
+    record_varint(fp, self->state->wCols);
+    return ferror(fp) ? -1 : 0;
+}
+
+
+// Anything bigger than this in a saved state is taken as corruption
+#define STATE_MAX_CELLS     (1 << 24)
+#define STATE_MAX_SECTION   (16 << 20)
+
+struct stateBuf {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+
+static void state_put(struct stateBuf *b, uint64_t val)
+{
+    if(b->len + 10 > b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 256;
+        b->data = realloc(b->data, b->cap);
+    }
+    b->len += varint_encode(b->data + b->len, val);
+}
+
+
+static void state_put_bytes(struct stateBuf *b, const void *bytes, size_t len)
+{
+    state_put(b, len);
+    if(b->len + len > b->cap) {
+        b->cap = 2 * (b->len + len);
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, bytes, len);
+    b->len += len;
+}
+
+
+// Writes b as one section and empties it for the next
+static void state_section(FILE *fp, int tag, struct stateBuf *b)
+{
+    fputc(tag, fp);
+    record_varint(fp, b->len);
+    fwrite(b->data, 1, b->len, fp);
+    b->len = 0;
+}
+
+
+// Runs of equal values: a blank row or the tab stops take a few bytes
+static void state_put_runs(struct stateBuf *b, const uint64_t *vals, const uint8_t *bytes, int count)
+{
+    for(int i = 0; i < count; ) {
+        uint64_t val = vals ? vals[i] : bytes[i];
+        int run = 1;
+        while(i + run < count && (vals ? vals[i + run] : bytes[i + run]) == val)
+            run++;
+        state_put(b, run);
+        state_put(b, val);
+        i += run;
+    }
+}
+
+
+// Saves everything needed to rebuild this terminal with fvterm_restore(), in
+// the format described in libfvterm.h. The screen is written a row at a time,
+// so the state is never held in memory as a whole. The trace ring, counters
+// and callbacks aren't saved.
+int fvterm_save(struct fvterm *self, FILE *fp)
+{
+    struct emuState *S = self->state;
+    struct stateBuf b = { 0 };
+
+    fwrite(FVSTATE_MAGIC, 1, strlen(FVSTATE_MAGIC), fp);
+    fputc(FVSTATE_VERSION, fp);
+
+    state_put(&b, S->wRows);
+    state_put(&b, S->wCols);
+    state_section(fp, FVSTATE_GEOMETRY, &b);
+
+    state_put(&b, S->cRow);
+    state_put(&b, S->cCol);
+    state_put(&b, S->wrapnext);
+    state_put(&b, S->tScroll);
+    state_put(&b, S->bScroll);
+    state_put(&b, S->cursorAttr);
+    state_put(&b, S->flags);
+    state_put(&b, S->charset);
+    for(int i = 0; i < 4; i++)
+        state_put(&b, S->charsets[i]);
+    state_put(&b, S->resizeBudget);
+    state_put(&b, S->lastChar);
+    state_section(fp, FVSTATE_CURSOR, &b);
+
+    state_put(&b, S->saveRow);
+    state_put(&b, S->saveCol);
+    state_put(&b, S->saveAttr);
+    state_put(&b, S->saveFlags);
+    state_put(&b, S->saveCharset);
+    for(int i = 0; i < 4; i++)
+        state_put(&b, S->saveCharsets[i]);
+    state_section(fp, FVSTATE_SAVED, &b);
+
+    state_put(&b, S->lScroll);
+    state_put(&b, S->rScroll);
+    state_section(fp, FVSTATE_MARGINS, &b);
+
+    state_put_runs(&b, NULL, S->colFlags, S->wCols);
+    state_section(fp, FVSTATE_COLUMNS, &b);
+
+    int changed = 0;
+    for(int i = 0; i < 258; i++)
+        changed += S->palette[i] != ((default_colormap[i] << 8) | 0xff);
+    state_put(&b, changed);
+    for(int i = 0; i < 258; i++) {
+        if(S->palette[i] == ((default_colormap[i] << 8) | 0xff)) continue;
+        state_put(&b, i);
+        state_put(&b, S->palette[i]);
+    }
+    state_section(fp, FVSTATE_PALETTE, &b);
+
+    state_put(&b, S->state);
+    state_put(&b, S->intermed);
+    state_put(&b, S->vt52Hack);
+    state_put(&b, S->utf8state);
+    for(int i = 0; i < 4; i++)
+        state_put(&b, S->utf8buf[i]);
+    state_put(&b, S->paramPtr);
+    state_put(&b, (uint32_t) S->paramVal);
+    if(S->state == ST_OSC) {
+        state_put_bytes(&b, S->oscBuf, S->paramPtr);
+    } else {
+        for(int i = 0; i < MAX_PARAMS; i++)
+            state_put(&b, (uint32_t) S->params[i]);
+    }
+    state_section(fp, FVSTATE_PARSER, &b);
+
+    // Only that there was one: a restored copy reports its end as a cut-off,
+    // as the payload so far went to this terminal's host
+    if(S->oscStream.handler) {
+        state_put_bytes(&b, S->oscStream.selection, strlen(S->oscStream.selection));
+        state_section(fp, FVSTATE_OSC, &b);
+    }
+
+    state_put_bytes(&b, self->title, strlen(self->title));
+    state_section(fp, FVSTATE_TITLE, &b);
+
+    // Before the rows, which refer to them
+    if(S->links || S->cursorLink) {
+        int count = 0;
+        for(int i = 1; i < LINKS_MAX; i++)
+            count += emu_core_getlink(S, i, NULL) != NULL;
+        state_put(&b, CELL_LINK(S->cursorLink));
+        state_put(&b, count);
+        for(int i = 1; i < LINKS_MAX; i++) {
+            const char *id, *uri = emu_core_getlink(S, i, &id);
+            if(!uri) continue;
+            state_put(&b, i);
+            state_put_bytes(&b, uri, strlen(uri));
+            state_put_bytes(&b, id, strlen(id));
+        }
+        state_section(fp, FVSTATE_LINKS, &b);
+    }
+
+    for(int r = 0; r < S->wRows; r++) {
+        struct termRow *row = S->rows[r];
+        state_put(&b, row->flags & ~(TERMROW_DIRTY | TERMROW_BLANK | TERMROW_CONTINUED));
+        if(row->flags & TERMROW_BLANK) {
+            state_put(&b, S->wCols);
+            state_put(&b, row->chars[0]);
+        } else {
+            state_put_runs(&b, row->chars, NULL, S->wCols);
+        }
+        state_section(fp, FVSTATE_ROW, &b);
+    }
+
+    state_section(fp, FVSTATE_END, &b);
+    free(b.data);
+    return ferror(fp) ? -1 : 0;
+}
+
+
+struct stateReader {
+    const uint8_t *p, *end;
+    int bad;
+};
+
+
+static uint64_t state_get(struct stateReader *rd)
+{
+    uint64_t val = 0;
+    for(int shift = 0; rd->p < rd->end && shift < 64; shift += 7) {
+        uint8_t b = *rd->p++;
+        val |= (uint64_t) (b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return val;
+    }
+    rd->bad = 1;
+    return 0;
+}
+
+
+// Reads a value that must be below limit
+static uint64_t state_get_max(struct stateReader *rd, uint64_t limit)
+{
+    uint64_t val = state_get(rd);
+    if(val >= limit) rd->bad = 1;
+    return val < limit ? val : 0;
+}
+
+
+static int state_get_runs(struct stateReader *rd, uint64_t *vals, uint8_t *bytes, int count)
+{
+    for(int i = 0; i < count && !rd->bad; ) {
+        uint64_t run = state_get_max(rd, count - i + 1);
+        uint64_t val = state_get(rd);
+        if(run == 0 || (bytes && val > 255)) return -1;
+        for(uint64_t j = 0; j < run; j++, i++) {
+            if(vals) vals[i] = val;
+            else bytes[i] = val;
+        }
+    }
+    return rd->bad ? -1 : 0;
+}
+
+
+static int state_read_varint(FILE *fp, uint64_t *out)
+{
+    uint64_t val = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        int ch = fgetc(fp);
+        if(ch == EOF) return -1;
+        val |= (uint64_t) (ch & 0x7f) << shift;
+        if(!(ch & 0x80)) {
+            *out = val;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+// Reads a string saved with state_put_bytes into str, which has room for size
+// bytes including the NUL
+static int state_get_string(struct stateReader *rd, char *str, size_t size)
+{
+    uint64_t len = state_get_max(rd, size);
+    if(rd->bad || len > rd->end - rd->p) return -1;
+    memcpy(str, rd->p, len);
+    str[len] = 0;
+    rd->p += len;
+    return 0;
+}
+
+
+static int state_restore_section(struct fvterm *self, int tag, struct stateReader *rd,
+                                 uint64_t *cells, int *row)
+{
+    struct emuState *S = self->state;
+    switch(tag) {
+        case FVSTATE_CURSOR:
+            S->cRow = state_get_max(rd, S->wRows);
+            S->cCol = state_get_max(rd, S->wCols);
+            S->wrapnext = state_get_max(rd, 2);
+            S->tScroll = state_get_max(rd, S->wRows);
+            S->bScroll = state_get_max(rd, S->wRows);
+            S->cursorAttr = state_get(rd);
+            S->flags = state_get(rd);
+            S->charset = state_get_max(rd, 256);
+            for(int i = 0; i < 4; i++)
+                S->charsets[i] = state_get_max(rd, 256);
+            S->resizeBudget = state_get_max(rd, RESIZE_BUDGET_MAX + 1);
+            // Not in states saved before REP was kept
+            if(rd->p < rd->end)
+                S->lastChar = state_get_max(rd, 0x110000);
+            if(S->tScroll > S->bScroll) return -1;
+            break;
+
+        case FVSTATE_SAVED:
+            S->saveRow = state_get_max(rd, S->wRows);
+            S->saveCol = state_get_max(rd, S->wCols);
+            S->saveAttr = state_get(rd);
+            S->saveFlags = state_get(rd);
+            S->saveCharset = state_get_max(rd, 256);
+            for(int i = 0; i < 4; i++)
+                S->saveCharsets[i] = state_get_max(rd, 256);
+            break;
+
+        case FVSTATE_MARGINS:
+            S->lScroll = state_get_max(rd, S->wCols);
+            S->rScroll = state_get_max(rd, S->wCols);
+            if(S->lScroll > S->rScroll) return -1;
+            break;
+
+        case FVSTATE_COLUMNS:
+            return state_get_runs(rd, NULL, S->colFlags, S->wCols);
+
+        case FVSTATE_PALETTE: {
+            int changed = state_get_max(rd, 259);
+            for(int i = 0; i < changed && !rd->bad; i++) {
+                int which = state_get_max(rd, 258);
+                S->palette[which] = state_get(rd);
+            }
+            S->paletteVersion++;
+            break;
+        }
+
+        case FVSTATE_PARSER:
+            S->state = state_get_max(rd, EMU_NSTATES);
+            S->intermed = state_get_max(rd, 256);
+            S->vt52Hack = state_get_max(rd, 256);
+            S->utf8state = state_get_max(rd, 7);
+            for(int i = 0; i < 4; i++)
+                S->utf8buf[i] = state_get_max(rd, 256);
+            S->paramPtr = state_get_max(rd, sizeof(S->oscBuf));
+            S->paramVal = (uint32_t) state_get(rd);
+            bzero(S->oscBuf, sizeof(S->oscBuf));
+            if(S->state == ST_OSC) {
+                uint64_t len = state_get(rd);
+                if(len != S->paramPtr || len > rd->end - rd->p) return -1;
+                memcpy(S->oscBuf, rd->p, len);
+                rd->p += len;
+            } else {
+                if(S->paramPtr > MAX_PARAMS) return -1;
+                for(int i = 0; i < MAX_PARAMS; i++)
+                    S->params[i] = (uint32_t) state_get(rd);
+            }
+            break;
+
+        case FVSTATE_TITLE:
+            return state_get_string(rd, self->title, sizeof(self->title));
+
+        case FVSTATE_OSC: {
+            // After FVSTATE_PARSER, which has the string's number
+            char selection[OSC_SELECTION_MAX];
+            if(state_get_string(rd, selection, sizeof(selection)) < 0 ||
+               S->state != ST_OSC || emu_core_cutosc(S, selection) < 0)
+                return -1;
+            break;
+        }
+
+        case FVSTATE_LINKS: {
+            int cursor = state_get_max(rd, LINKS_MAX);
+            int count = state_get_max(rd, LINKS_MAX);
+            char uri[sizeof(S->oscBuf)], id[sizeof(S->oscBuf)];
+            for(int i = 0; i < count && !rd->bad; i++) {
+                int index = state_get_max(rd, LINKS_MAX);
+                if(state_get_string(rd, uri, sizeof(uri)) < 0 ||
+                   state_get_string(rd, id, sizeof(id)) < 0 ||
+                   emu_core_setlink(S, index, uri, id) < 0)
+                    return -1;
+            }
+            if(cursor && !emu_core_getlink(S, cursor, NULL)) return -1;
+            S->cursorLink = (uint32_t) cursor << CELL_LINK_SHIFT;
+            break;
+        }
+
+        case FVSTATE_ROW: {
+            if(*row >= S->wRows) return -1;
+            int flags = state_get(rd);
+            if(state_get_runs(rd, cells, NULL, S->wCols) < 0) return -1;
+            emu_core_setrow(S, (*row)++, cells, flags);
+            break;
+        }
+
+        default:
+            break; // from a newer version; skip it
+    }
+    return rd->bad ? -1 : 0;
+}
+
+
+// Rebuilds a terminal saved with fvterm_save(), reading fp up to the end of
+// the saved state. Returns NULL if it isn't a saved state this version
+// understands or is damaged.
+struct fvterm * fvterm_restore(FILE *fp)
+{
+    char magic[5];
+    if(fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+       memcmp(magic, FVSTATE_MAGIC, sizeof(magic)) != 0)
+        return NULL;
+    int version = fgetc(fp);
+    if(version < 1 || version > FVSTATE_VERSION)
+        return NULL;
+
+    struct fvterm *self = NULL;
+    uint8_t *payload = NULL;
+    uint64_t *cells = NULL;
+    size_t payloadCap = 0;
+    int row = 0, ok = 0;
+
+    for(;;) {
+        int tag = fgetc(fp);
+        uint64_t len;
+        if(tag == EOF || state_read_varint(fp, &len) < 0 || len > STATE_MAX_SECTION)
+            break;
+        if(len > payloadCap)
+            payload = realloc(payload, payloadCap = len);
+        if(fread(payload, 1, len, fp) != len)
+            break;
+        struct stateReader rd = { payload, payload + len, 0 };
+
+        if(tag == FVSTATE_END) {
+            ok = self && row == self->state->wRows;
+            break;
+        }
+
+        if(!self) {
+            if(tag != FVSTATE_GEOMETRY) break;
+            uint64_t rows = state_get(&rd), cols = state_get(&rd);
+            if(rd.bad || rows < 1 || cols < 1 || rows * cols > STATE_MAX_CELLS)
+                break;
+            self = fvterm_init(rows, cols);
+            cells = malloc(cols * sizeof(uint64_t));
+        } else if(state_restore_section(self, tag, &rd, cells, &row) < 0) {
+            break;
+        }
+    }
+
+    free(payload);
+    free(cells);
+    if(!ok && self) {
+        fvterm_free(self);
+        self = NULL;
+    }
+    return self;
+}
+
+
+// Copies the core's counters (see struct emuStats in fvemu.h) into stats,
+// optionally zeroing them afterwards. Returns -1 if the library was built
+// without FVEMU_STATS.
+int fvterm_getstats(struct fvterm *self, struct emuStats *stats, int reset)
+{
+#ifdef FVEMU_STATS
+    if(stats)
+        *stats = self->state->stats;
+    if(reset)
+        bzero(&self->state->stats, sizeof(self->state->stats));
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+// Copies up to max of the most recent trace entries into entries, oldest
+// first, and returns how many there were.
+int fvterm_gettrace(struct fvterm *self, struct emuTraceEntry *entries, int max)
+{
+#ifndef FVEMU_NO_TRACE
+    struct emuState *S = self->state;
+    uint32_t count = S->traceNext < TRACE_ENTRIES ? S->traceNext : TRACE_ENTRIES;
+    if(count > max) count = max;
+
+    for(uint32_t i = 0; i < count; i++)
+        entries[i] = S->trace[(S->traceNext - count + i) & (TRACE_ENTRIES - 1)];
+    return count;
+#else
+    return 0;
+#endif
+}
+
+
+// Writes the trace ring to fp in the format described in libfvterm.h, for
+// fvtrace to decode
+int fvterm_dumptrace(struct fvterm *self, FILE *fp)
+{
+    struct emuState *S = self->state;
+    struct emuTraceEntry entries[TRACE_ENTRIES];
+    int count = fvterm_gettrace(self, entries, TRACE_ENTRIES);
+
+    uint64_t ticks = emu_core_ticks() - S->traceEpochTicks;
+    uint64_t ns = emu_core_nanotime() - S->traceEpochNs;
+
+    struct fvtraceHeader hdr = {
+        .magic = FVTRACE_MAGIC,
+        .version = FVTRACE_VERSION,
+        .entrySize = sizeof(struct emuTraceEntry),
+        .count = count,
+        .nsPerTick = ticks ? (double) ns / ticks : 1.0,
+    };
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(entries, sizeof(struct emuTraceEntry), count, fp);
+    return ferror(fp) ? -1 : 0;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 
 
@@ -81,6 +1206,12 @@ void TerminalEmulator_writeStr(struct emuState *S, char *bytes)
 void TerminalEmulator_write(struct emuState *S, char *bytes, size_t len)
 {
     struct fvterm *self = S->parent;
+    if(self->record)
+        record_chunk(self, FVREC_OUTPUT, bytes, len);
+    if(self->callbacks.write) {
+        self->callbacks.write(self->ctx, bytes, len);
+        return;
+    }
     if(self->outputp + len > sizeof(self->output)) return;
     memcpy(&self->output[self->outputp], bytes, len);
     self->outputp += len;
@@ -90,6 +1221,8 @@ void TerminalEmulator_bell(struct emuState *S)
 {
     struct fvterm *self = S->parent;
     self->beeps++;
+    if(self->callbacks.bell)
+        self->callbacks.bell(self->ctx);
 }
 
 void TerminalEmulator_setTitle(struct emuState *S, const char *title)
@@ -97,14 +1230,73 @@ void TerminalEmulator_setTitle(struct emuState *S, const char *title)
     struct fvterm *self = S->parent;
     strncpy(self->title, title, sizeof(self->title));
     self->title[sizeof(self->title) - 1] = 0;
+    if(self->callbacks.title)
+        self->callbacks.title(self->ctx, self->title);
 }
 
 void TerminalEmulator_resize(struct emuState *S)
 {
-    // ...
+    struct fvterm *self = S->parent;
+    if(self->callbacks.resize)
+        self->callbacks.resize(self->ctx, S->wRows, S->wCols);
 }
 
 void TerminalEmulator_freeRowBitmaps(struct termRow *r)
 {
     // nothing
 }
+
+// Without a callback, the clipboard isn't ours to set
+void TerminalEmulator_clipboard(struct emuState *S, const char *selection,
+                                const uint8_t *data, size_t len, int flags)
+{
+    struct fvterm *self = S->parent;
+    if(self->callbacks.clipboard)
+        self->callbacks.clipboard(self->ctx, selection, data, len, flags);
+}
+
+// The line ending at row is done: either row is about to scroll off the top,
+// or a line feed is leaving it and it didn't wrap
+void TerminalEmulator_lineDone(struct emuState *S, int row, int scrolledOff)
+{
+    struct fvterm *self = S->parent;
+    if(!self->callbacks.line) return;
+    if(!self->lines)
+        self->lines = calloc(1, sizeof(struct fvtermLines));
+    struct fvtermLines *lines = self->lines;
+
+    // The line that scrolled off goes on in row 0 only while it's
+    // TERMROW_CONTINUED: once that's erased or written to, or the margins
+    // change, the line ended at the top of the screen
+    struct termRow *r = S->rows[row];
+    struct termRow *next = scrolledOff ? r : S->rows[0];
+    if(lines->open && !(next->flags & TERMROW_CONTINUED))
+        line_emit(self, &lines->pending);
+
+    // Rows are TERMROW_TAPPED from when they're reported until they're next
+    // written to, so moving back over them doesn't repeat them
+    if(r->flags & TERMROW_TAPPED) return;
+
+    if(scrolledOff) {
+        int wrapped = r->flags & TERMROW_WRAPPED;
+        r->flags &= ~TERMROW_CONTINUED;
+        line_append(&lines->pending, S, r->chars, S->wCols, !wrapped);
+        if(wrapped && row < S->bScroll) {
+            lines->open = 1;
+            S->rows[row + 1]->flags |= TERMROW_CONTINUED;
+        } else {
+            line_emit(self, &lines->pending);
+        }
+        return;
+    }
+
+    int start = row;
+    while(start > 0 && (S->rows[start - 1]->flags & (TERMROW_WRAPPED | TERMROW_TAPPED)) == TERMROW_WRAPPED)
+        start--;
+    struct lineBuf *b = start == 0 && lines->open ? &lines->pending : &lines->scratch;
+    for(int i = start; i <= row; i++) {
+        line_append(b, S, S->rows[i]->chars, S->wCols, i == row);
+        S->rows[i]->flags = (S->rows[i]->flags | TERMROW_TAPPED) & ~TERMROW_CONTINUED;
+    }
+    line_emit(self, b);
+}
@@ -2,22 +2,187 @@
 #define _LIBFVTERM_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
+struct emuStats;
+struct emuTraceEntry;
+
+// A run of a finished line's text in attributes other than the default, or
+// linked with OSC 8: len bytes from byte start, in attr (the high half of the
+// cells), linked to uri (NULL if it isn't)
+struct fvtermSpan {
+    uint32_t start, len;
+    uint32_t attr;
+    const char *uri;
+};
+
+// Optional hooks for hosts that want events as they happen. Any left NULL
+// fall back to the defaults: responses are buffered in output, bells are
+// counted and the title is copied.
+//
+// line is called with each logical line (rows joined where they wrapped) as
+// it's finished: when a line feed leaves it or it scrolls off the top of the
+// screen. text is UTF-8 without trailing blanks or a newline, NUL-terminated,
+// and only valid until the callback returns, as are the spans and their URIs.
+//
+// clipboard gets what OSC 52 sets the clipboard to, decoded, a piece at a time
+// as it arrives: any number of calls with data, then one with no data and
+// FVTERM_CLIPBOARD_END, or FVTERM_CLIPBOARD_ABORT if the string was cut off.
+// selection is OSC 52's Pc ("c", "p", "s0", ...), empty for the default.
+struct fvtermCallbacks {
+    void (*write)(void *ctx, const void *bytes, size_t len);
+    void (*resize)(void *ctx, int rows, int cols);
+    void (*bell)(void *ctx);
+    void (*title)(void *ctx, const char *title);
+    void (*line)(void *ctx, const char *text, size_t len,
+                 const struct fvtermSpan *spans, int nSpans);
+    void (*clipboard)(void *ctx, const char *selection, const void *data, size_t len, int flags);
+};
+
+// clipboard callback flags
+#define FVTERM_CLIPBOARD_END    1
+#define FVTERM_CLIPBOARD_ABORT  2
+
+struct fvtermLines;
+
 struct fvterm {
     struct emuState *state;
     char output[1024], title[256];
     int beeps, outputp;
+
+    FILE *record;
+    uint64_t recordTime;
+
+    struct fvtermCallbacks callbacks;
+    void *ctx;
+
+    struct fvtermLines *lines; // lines for callbacks.line still being put together
+};
+
+// Session recordings start with FVREC_MAGIC, a version byte and the initial
+// rows and cols as varints. Each record after that is a type byte, the time
+// since the previous record in microseconds, the payload length (all as
+// unsigned LEB128 varints) and then the payload itself. FVREC_SIZE payloads
+// are two varints, rows then cols.
+
+#define FVREC_MAGIC     "FVREC"
+#define FVREC_VERSION   1
+
+#define FVREC_INPUT     'I' // bytes passed to fvterm_write
+#define FVREC_OUTPUT    'O' // responses the emulator sent to the host
+#define FVREC_SIZE      'S' // fvterm_setsize
+
+// Saved states (fvterm_save) start with FVSTATE_MAGIC and a version byte,
+// followed by sections: a tag byte, the payload length as a varint and the
+// payload, in which every number is an unsigned varint. Readers skip tags they
+// don't know. FVSTATE_GEOMETRY comes first and FVSTATE_END last, with one
+// FVSTATE_ROW per screen row in between, top to bottom.
+
+#define FVSTATE_MAGIC       "FVSTA"
+#define FVSTATE_VERSION     1
+
+#define FVSTATE_GEOMETRY    'G' // rows, cols
+#define FVSTATE_CURSOR      'C' // position, margins, attributes, modes, charsets, lastChar
+#define FVSTATE_SAVED       'D' // the DECSC cursor
+#define FVSTATE_COLUMNS     'T' // colFlags (tab stops), as runs
+#define FVSTATE_PALETTE     'P' // count, then index/color pairs that aren't the default
+#define FVSTATE_PARSER      'X' // parser state, including a partial sequence
+#define FVSTATE_OSC         'O' // OSC 52's selection, if its string was being streamed
+#define FVSTATE_TITLE       'N'
+#define FVSTATE_MARGINS     'M' // left and right margins
+#define FVSTATE_LINKS       'L' // cursor's link, count, then (index, URI, id) for each
+#define FVSTATE_ROW         'R' // flags, then (count, cell) runs covering the row
+#define FVSTATE_END         'E'
+
+// fvterm_diff flags
+#define FVTERM_DIFF_REP     1 // the receiving terminal has REP (CSI b)
+
+// fvterm_export flags
+#define FVTERM_EXPORT_JOIN  1 // rows that wrapped continue the same line
+#define FVTERM_EXPORT_TRIM  2 // no blanks at the ends of lines
+#define FVTERM_EXPORT_SGR   4 // with SGR sequences for the attributes
+#define FVTERM_EXPORT_LINKS 8 // with OSC 8 around linked text (fvterm_export only)
+
+// Room fvterm_sgr needs
+#define FVTERM_SGR_MAX      64
+
+// The Unicode code point in a cell; the rest is its link (see fvterm_getlink)
+// and attributes
+#define FVTERM_GLYPH_MASK 0x1fffff
+
+// The glyph of the cell after a wide character, which takes two; it has the
+// same attributes and link
+#define FVTERM_GLYPH_SPACER 0x110000
+
+// Trace dumps are an fvtraceHeader followed by count emuTraceEntry structs
+// (see fvemu.h), oldest first, all in the dumping machine's byte order.
+#define FVTRACE_MAGIC   "FVTRC"
+#define FVTRACE_VERSION 1
+
+struct fvtraceHeader {
+    char magic[5];
+    uint8_t version;
+    uint16_t entrySize;
+    uint32_t count;
+    double nsPerTick;
+};
+
+// Filled in by fvterm_getscreen
+struct fvtermScreen {
+    int rows, cols;
+    int cursorRow, cursorCol;
+    int scrollTop, scrollBottom;
+    uint32_t cursorAttr;
+    uint64_t modes; // MODE_* flags from fvemu.h
+    int scrollLeft, scrollRight;
+};
+
+// A sixel image's part of a row, filled in by fvterm_getgraphics: width x
+// height pixels (height is the cell height) from the left edge of column col,
+// of which the first used columns have been drawn to. Each pixel indexes
+// colors (RGBA, as in the palette); 0 is left transparent if colors[0] is.
+// Only valid until the next fvterm_write.
+struct fvtermGraphic {
+    int col, width, height, used;
+    const uint8_t *pixels; // width * height, row-major
+    const uint32_t *colors;
 };
 
 struct fvterm * fvterm_init(int rows, int cols);
 void fvterm_free(struct fvterm *self);
 
+void fvterm_setcallbacks(struct fvterm *self, const struct fvtermCallbacks *callbacks, void *ctx);
+void fvterm_flushlines(struct fvterm *self);
+
 void fvterm_write(struct fvterm *self, const uint8_t *data, size_t len);
 void fvterm_setsize(struct fvterm *self, int rows, int cols);
 void fvterm_getsize(struct fvterm *self, int *rows, int *cols);
 void fvterm_getcursor(struct fvterm *self, int *row, int *col);
 int fvterm_getrowflags(struct fvterm *self, int row);
 uint64_t fvterm_getglyph(struct fvterm *self, int row, int col);
+int fvterm_charwidth(uint32_t ch);
+
+int fvterm_getrow(struct fvterm *self, int row, uint64_t *cells, int *flags);
+int fvterm_getregion(struct fvterm *self, int top, int left, int rows, int cols,
+                     uint64_t *cells, int *flags);
+int fvterm_getscreen(struct fvterm *self, struct fvtermScreen *screen,
+                     uint64_t *cells, int *flags);
+int fvterm_getgraphics(struct fvterm *self, int row, struct fvtermGraphic *graphics, int max);
+void fvterm_setcellsize(struct fvterm *self, int width, int height);
+const char * fvterm_getlink(struct fvterm *self, uint64_t cell, const char **id);
+size_t fvterm_getutf8(struct fvterm *self, int top, int rows, char *buf, size_t len);
+size_t fvterm_export(struct fvterm *self, int top, int rows, int flags, char *buf, size_t len);
+size_t fvterm_exportcells(const uint64_t *cells, const int *rowFlags, int rows, int cols,
+                          int flags, char *buf, size_t len);
+int fvterm_sgr(char *out, uint32_t from, uint32_t to);
+
+int fvterm_record(struct fvterm *self, FILE *fp);
+int fvterm_save(struct fvterm *self, FILE *fp);
+struct fvterm * fvterm_restore(FILE *fp);
+long fvterm_diff(struct fvterm *from, struct fvterm *to, int flags, FILE *fp);
+int fvterm_getstats(struct fvterm *self, struct emuStats *stats, int reset);
+int fvterm_gettrace(struct fvterm *self, struct emuTraceEntry *entries, int max);
+int fvterm_dumptrace(struct fvterm *self, FILE *fp);
 
-#endif // _LIBFVTERM_H
\ No newline at end of file
+#endif // _LIBFVTERM_H
@@ -0,0 +1,385 @@
+// Headless PTY host: runs a child on a pseudo-terminal and feeds everything it
+// writes through libfvterm. Uses epoll on Linux and poll() elsewhere.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pwd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "fvhost.h"
+
+
+static uint64_t host_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#pragma mark - Polling
+
+
+#ifdef __linux__
+
+static int poller_init(struct fvhost *h)
+{
+    h->poller = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = h->master };
+    if(h->poller < 0 || epoll_ctl(h->poller, EPOLL_CTL_ADD, h->master, &ev) < 0)
+        return -1;
+    return 0;
+}
+
+
+static void poller_want_write(struct fvhost *h, int want)
+{
+    if(h->wantWrite == want) return;
+    h->wantWrite = want;
+    struct epoll_event ev = {
+        .events = EPOLLIN | (want ? EPOLLOUT : 0),
+        .data.fd = h->master,
+    };
+    epoll_ctl(h->poller, EPOLL_CTL_MOD, h->master, &ev);
+}
+
+
+// Returns -1 on error (including EINTR), otherwise sets readable/writable
+static int poller_wait(struct fvhost *h, int timeoutMs, int *readable, int *writable)
+{
+    struct epoll_event ev;
+    int n = epoll_wait(h->poller, &ev, 1, timeoutMs);
+    if(n < 0) return -1;
+    *readable = n > 0 && (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR));
+    *writable = n > 0 && (ev.events & EPOLLOUT);
+    return 0;
+}
+
+#else
+
+static int poller_init(struct fvhost *h)
+{
+    h->poller = -1;
+    return 0;
+}
+
+
+static void poller_want_write(struct fvhost *h, int want)
+{
+    h->wantWrite = want;
+}
+
+
+static int poller_wait(struct fvhost *h, int timeoutMs, int *readable, int *writable)
+{
+    struct pollfd pfd = {
+        .fd = h->master,
+        .events = POLLIN | (h->wantWrite ? POLLOUT : 0),
+    };
+    int n = poll(&pfd, 1, timeoutMs);
+    if(n < 0) return -1;
+    *readable = n > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+    *writable = n > 0 && (pfd.revents & POLLOUT);
+    return 0;
+}
+
+#endif
+
+
+#pragma mark - Output to the child
+
+
+// Writes as much pending output as the PTY will take, and asks to be woken
+// up when it can take the rest
+static void flush_out(struct fvhost *h)
+{
+    size_t done = 0;
+    while(done < h->outLen) {
+        ssize_t n = write(h->master, h->out + done, h->outLen - done);
+        if(n > 0)
+            done += n;
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+
+    h->bytesOut += done;
+    h->outLen -= done;
+    memmove(h->out, h->out + done, h->outLen);
+    poller_want_write(h, h->outLen > 0);
+}
+
+
+static void queue_out(struct fvhost *h, const void *bytes, size_t len)
+{
+    if(h->outLen + len > h->outCap) {
+        h->outCap = 2 * (h->outLen + len);
+        h->out = realloc(h->out, h->outCap);
+    }
+    memcpy(h->out + h->outLen, bytes, len);
+    h->outLen += len;
+}
+
+
+// Emulator responses are queued rather than written straight away, so
+// everything one chunk of input produces goes out in a single write
+static void host_write(void *ctx, const void *bytes, size_t len)
+{
+    queue_out(ctx, bytes, len);
+}
+
+
+static void host_resize(void *ctx, int rows, int cols)
+{
+    struct fvhost *h = ctx;
+    struct winsize ws = { .ws_row = rows, .ws_col = cols };
+    // The kernel sends SIGWINCH to the foreground process group for us
+    ioctl(h->master, TIOCSWINSZ, &ws);
+}
+
+
+static void host_line(void *ctx, const char *text, size_t len,
+                      const struct fvtermSpan *spans, int nSpans)
+{
+    struct fvhost *h = ctx;
+    fwrite(text, 1, len, h->lines);
+    fputc('\n', h->lines);
+}
+
+
+#pragma mark - Public interface
+
+
+// Starts argv (or the user's shell if argv is NULL) on a new PTY of the given
+// size and returns the non-blocking master side, or -1 if the PTY or process
+// couldn't be created.
+int fvhost_openpty(int rows, int cols, char *const argv[], pid_t *pidOut)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0) return -1;
+    if(grantpt(master) < 0 || unlockpt(master) < 0) {
+        close(master);
+        return -1;
+    }
+
+    // Open the slave before forking: if the child hadn't opened it yet by the
+    // time we first poll, the master would report a hangup
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if(slave < 0) {
+        close(master);
+        return -1;
+    }
+
+    struct winsize ws = { .ws_row = rows, .ws_col = cols };
+    ioctl(master, TIOCSWINSZ, &ws);
+
+    // Look this up before forking
+    struct passwd *pwd = getpwuid(getuid());
+    char *shell = (pwd && pwd->pw_shell) ? pwd->pw_shell : "/bin/sh";
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        close(slave);
+        close(master);
+        return -1;
+    } else if(pid == 0) {
+        setsid();
+#ifdef TIOCSCTTY
+        ioctl(slave, TIOCSCTTY, 0);
+#endif
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        if(slave > 2) close(slave);
+        close(master);
+
+        setenv("TERM", "xterm", 1);
+
+        if(argv && argv[0])
+            execvp(argv[0], argv);
+        else
+            execl(shell, "-", NULL);
+        fprintf(stderr, "failed to exec %s: %s\n", argv ? argv[0] : shell, strerror(errno));
+        _exit(255);
+    }
+
+    close(slave);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+
+    *pidOut = pid;
+    return master;
+}
+
+
+// Starts argv (or the user's shell if argv is NULL) on a new PTY of the given
+// size. Returns NULL if the PTY or process couldn't be created.
+struct fvhost * fvhost_spawn(int rows, int cols, char *const argv[])
+{
+    pid_t pid;
+    int master = fvhost_openpty(rows, cols, argv, &pid);
+    if(master < 0) return NULL;
+
+    struct fvhost *h = calloc(1, sizeof(struct fvhost));
+    h->pid = pid;
+    h->master = master;
+    h->alive = 1;
+    h->bufSize = FVHOST_MIN_BUF;
+    h->buf = malloc(h->bufSize);
+
+    if(poller_init(h) < 0) {
+        fvhost_free(h);
+        return NULL;
+    }
+
+    h->term = fvterm_init(rows, cols);
+    struct fvtermCallbacks callbacks = {
+        .write = host_write,
+        .resize = host_resize,
+    };
+    fvterm_setcallbacks(h->term, &callbacks, h);
+    return h;
+}
+
+
+// Waits up to timeoutMs for the child to produce output, then drains the PTY
+// into the emulator. Returns the number of bytes processed, 0 on timeout or
+// signal, or -1 once the child has gone away.
+int fvhost_run(struct fvhost *h, int timeoutMs)
+{
+    if(!h->alive) return -1;
+
+    int readable, writable;
+    if(poller_wait(h, timeoutMs, &readable, &writable) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    if(writable)
+        flush_out(h);
+    if(!readable)
+        return 0;
+
+    size_t len = 0;
+    int eof = 0;
+    while(len < h->bufSize) {
+        ssize_t n = read(h->master, h->buf + len, h->bufSize - len);
+        if(n > 0) {
+            len += n;
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // EAGAIN means we've caught up; EOF or EIO that the child is gone
+            eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+    }
+
+    if(len > 0) {
+        uint64_t t0 = host_now();
+        fvterm_write(h->term, h->buf, len);
+        h->parseNs += host_now() - t0;
+        h->bytesIn += len;
+        h->wakeups++;
+        if(h->outLen > 0)
+            flush_out(h);
+    }
+
+    // Grow while the child is outrunning us, shrink once it goes quiet
+    if(len == h->bufSize && h->bufSize < FVHOST_MAX_BUF) {
+        h->bufSize *= 2;
+        h->buf = realloc(h->buf, h->bufSize);
+        h->quietWakeups = 0;
+    } else if(len < h->bufSize / 8 && h->bufSize > FVHOST_MIN_BUF) {
+        if(++h->quietWakeups >= 64) {
+            h->bufSize /= 2;
+            h->buf = realloc(h->buf, h->bufSize);
+            h->quietWakeups = 0;
+        }
+    } else {
+        h->quietWakeups = 0;
+    }
+
+    if(eof) {
+        h->alive = 0;
+        waitpid(h->pid, &h->status, 0);
+        return len > 0 ? len : -1;
+    }
+    return len;
+}
+
+
+// Resizes the emulator and the PTY together
+void fvhost_resize(struct fvhost *h, int rows, int cols)
+{
+    fvterm_setsize(h->term, rows, cols);
+}
+
+
+// Sends input (keystrokes, pastes) to the child
+int fvhost_send(struct fvhost *h, const void *bytes, size_t len)
+{
+    if(!h->alive) return -1;
+    queue_out(h, bytes, len);
+    flush_out(h);
+    return 0;
+}
+
+
+// Writes each line of the session's output to fp as it's finished, as text
+// without any escape sequences; see fvtermCallbacks.line. Passing NULL writes
+// out the lines still on the screen and stops.
+void fvhost_taplines(struct fvhost *h, FILE *fp)
+{
+    if(!fp && h->lines)
+        fvterm_flushlines(h->term);
+    h->lines = fp;
+    struct fvtermCallbacks callbacks = {
+        .write = host_write,
+        .resize = host_resize,
+        .line = fp ? host_line : NULL,
+    };
+    fvterm_setcallbacks(h->term, &callbacks, h);
+}
+
+
+// Runs until the child exits and returns its exit status (128 + the signal
+// number if it was killed)
+int fvhost_wait(struct fvhost *h)
+{
+    while(fvhost_run(h, -1) >= 0)
+        ;
+    if(WIFSIGNALED(h->status))
+        return 128 + WTERMSIG(h->status);
+    return WEXITSTATUS(h->status);
+}
+
+
+void fvhost_free(struct fvhost *h)
+{
+    if(h->master >= 0)
+        close(h->master); // the child gets SIGHUP
+    if(h->poller >= 0)
+        close(h->poller);
+    if(h->alive)
+        waitpid(h->pid, &h->status, WNOHANG);
+    if(h->term)
+        fvterm_free(h->term);
+    free(h->buf);
+    free(h->out);
+    free(h);
+}
@@ -0,0 +1,46 @@
+#ifndef _FVHOST_H
+#define _FVHOST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "libfvterm.h"
+
+// Input is drained from the PTY into one buffer per wakeup and handed to the
+// emulator in a single call. The buffer starts at FVHOST_MIN_BUF, doubles
+// whenever a wakeup fills it and shrinks again once output goes quiet.
+#define FVHOST_MIN_BUF  (64 << 10)
+#define FVHOST_MAX_BUF  (1 << 20)
+
+struct fvhost {
+    struct fvterm *term;
+    pid_t pid;
+    int master, poller;
+    int alive, status;
+
+    uint8_t *buf;
+    size_t bufSize;
+    int quietWakeups; // consecutive wakeups that used < 1/8 of buf
+
+    // Responses that the PTY wouldn't take yet
+    uint8_t *out;
+    size_t outLen, outCap;
+    int wantWrite;
+
+    FILE *lines; // where finished lines go (fvhost_taplines)
+
+    uint64_t bytesIn, bytesOut, wakeups;
+    uint64_t parseNs; // time spent inside the emulator
+};
+
+int fvhost_openpty(int rows, int cols, char *const argv[], pid_t *pid);
+struct fvhost * fvhost_spawn(int rows, int cols, char *const argv[]);
+int fvhost_run(struct fvhost *h, int timeoutMs);
+void fvhost_resize(struct fvhost *h, int rows, int cols);
+int fvhost_send(struct fvhost *h, const void *bytes, size_t len);
+void fvhost_taplines(struct fvhost *h, FILE *fp);
+int fvhost_wait(struct fvhost *h);
+void fvhost_free(struct fvhost *h);
+
+#endif // _FVHOST_H
@@ -0,0 +1,622 @@
+// Multi-session host: many PTYs, each with its own emulator, served by a fixed
+// pool of worker threads. See fvpool.h for how sessions are scheduled.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "fvhost.h"
+#include "fvpool.h"
+
+
+static uint64_t pool_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#pragma mark - Work-stealing deque
+
+
+// Following Lê et al., "Correct and Efficient Work-Stealing for Weak Memory
+// Models". Only the owning worker may push or pop.
+static void deque_push(struct fvpoolDeque *d, struct fvpoolSession *s)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    // Never full: a worker only pushes the rest of one batch, and only when
+    // its deque is empty
+    __atomic_store_n(&d->slots[b & (FVPOOL_DEQUE_SIZE - 1)], s, __ATOMIC_RELAXED);
+    // A release store rather than the paper's fence: the same ordering, but
+    // one ThreadSanitizer can see, so what was written to s shows as published
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+
+static struct fvpoolSession * deque_pop(struct fvpoolDeque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if(t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    struct fvpoolSession *s = __atomic_load_n(&d->slots[b & (FVPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if(t == b) {
+        // Last one: race any thief for it
+        if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            s = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return s;
+}
+
+
+static struct fvpoolSession * deque_steal(struct fvpoolDeque *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if(t >= b) return NULL;
+
+    struct fvpoolSession *s = __atomic_load_n(&d->slots[t & (FVPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL; // lost to the owner or another thief
+    return s;
+}
+
+
+#pragma mark - Sessions
+
+
+static void queue_out(struct fvpoolSession *s, const void *bytes, size_t len)
+{
+    if(s->outLen + len > s->outCap) {
+        s->outCap = 2 * (s->outLen + len);
+        s->out = realloc(s->out, s->outCap);
+    }
+    memcpy(s->out + s->outLen, bytes, len);
+    s->outLen += len;
+}
+
+
+// Writes as much pending output as the PTY will take; call with s->lock held
+static void flush_out(struct fvpoolSession *s)
+{
+    size_t done = 0;
+    while(done < s->outLen) {
+        ssize_t n = write(s->fd, s->out + done, s->outLen - done);
+        if(n > 0)
+            done += n;
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+
+    s->bytesOut += done;
+    s->outLen -= done;
+    memmove(s->out, s->out + done, s->outLen);
+}
+
+
+static void session_write(void *ctx, const void *bytes, size_t len)
+{
+    struct fvpoolSession *s = ctx;
+    pthread_mutex_lock(&s->lock);
+    queue_out(s, bytes, len);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+static void session_resize(void *ctx, int rows, int cols)
+{
+    struct fvpoolSession *s = ctx;
+    struct winsize ws = { .ws_row = rows, .ws_col = cols };
+    ioctl(s->fd, TIOCSWINSZ, &ws);
+}
+
+
+// Hands the session back to epoll. Only the worker that currently owns the
+// session may do this: once re-armed, any worker may pick it up.
+static void session_arm(struct fvpoolSession *s, int op)
+{
+    pthread_mutex_lock(&s->lock);
+    s->running = 0;
+    s->armedOut = s->outLen > 0;
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT | (s->armedOut ? EPOLLOUT : 0),
+        .data.ptr = s,
+    };
+    pthread_mutex_unlock(&s->lock);
+
+    epoll_ctl(s->pool->epfd, op, s->fd, &ev);
+}
+
+
+// Makes the calling worker the one running the session, unless another
+// already is (or the child has exited). Queued on a deque counts as running.
+static int session_claim(struct fvpoolSession *s)
+{
+    pthread_mutex_lock(&s->lock);
+    int claimed = !s->running;
+    s->running = 1;
+    pthread_mutex_unlock(&s->lock);
+    return claimed;
+}
+
+
+static void session_exited(struct fvpool *p, struct fvpoolSession *s)
+{
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    waitpid(s->pid, &s->status, 0);
+
+    pthread_mutex_lock(&p->lock);
+    s->alive = 0;
+    if(--p->live == 0)
+        pthread_cond_broadcast(&p->allExited);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+static int log2_bucket(uint64_t ns)
+{
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < FVPOOL_LATENCY_BUCKETS ? bucket : FVPOOL_LATENCY_BUCKETS - 1;
+}
+
+
+// One scheduling slice: flush pending responses, then parse at most the
+// pool's budget of the session's output
+static void session_run(struct fvpoolWorker *w, struct fvpoolSession *s)
+{
+    struct fvpool *p = w->pool;
+    uint64_t cpu0 = thread_cpu_ns();
+
+    pthread_mutex_lock(&s->lock);
+    if(s->outLen > 0)
+        flush_out(s);
+    pthread_mutex_unlock(&s->lock);
+
+    size_t len = 0;
+    int eof = 0;
+    while(len < p->budget) {
+        ssize_t n = read(s->fd, w->buf + len, p->budget - len);
+        if(n > 0) {
+            len += n;
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // EAGAIN means we've caught up; EOF or EIO that the child is gone
+            eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+    }
+
+    if(len > 0) {
+        fvterm_write(s->term, w->buf, len);
+        s->bytesIn += len;
+
+        pthread_mutex_lock(&s->lock);
+        if(s->outLen > 0)
+            flush_out(s);
+        pthread_mutex_unlock(&s->lock);
+
+        uint64_t latency = pool_now() - s->readyAt;
+        s->latency[log2_bucket(latency)]++;
+        if(latency > s->latencyMaxNs)
+            s->latencyMaxNs = latency;
+    }
+
+    s->runs++;
+    s->budgetRuns += len == p->budget;
+    s->cpuNs += thread_cpu_ns() - cpu0;
+
+    if(eof)
+        session_exited(p, s);
+    else
+        session_arm(s, EPOLL_CTL_MOD);
+}
+
+
+#pragma mark - Workers
+
+
+static void kick(struct fvpool *p)
+{
+    uint64_t one = 1;
+    if(write(p->kickfd, &one, sizeof(one)) < 0) {
+        // Already pending, which is all we wanted
+    }
+}
+
+
+// Has a worker run a session that nobody is running, so it gets re-armed
+// with whatever it now wants
+static void kick_session(struct fvpool *p, struct fvpoolSession *s)
+{
+    pthread_mutex_lock(&p->lock);
+    if(!s->kicked) {
+        s->kicked = 1;
+        s->nextKicked = p->kicked;
+        p->kicked = s;
+    }
+    pthread_mutex_unlock(&p->lock);
+    kick(p);
+}
+
+
+// The kick eventfd is one-shot too, so each kick wakes a single idle worker
+static void rearm_kick(struct fvpool *p)
+{
+    uint64_t count;
+    if(read(p->kickfd, &count, sizeof(count)) < 0) {
+        // Someone else drained it first
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    epoll_ctl(p->epfd, EPOLL_CTL_MOD, p->kickfd, &ev);
+}
+
+
+static struct fvpoolSession * steal(struct fvpoolWorker *w)
+{
+    struct fvpool *p = w->pool;
+    if(p->nWorkers < 2) return NULL;
+
+    // Start at a random victim so thieves don't all pile onto worker 0
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    int start = w->rng % p->nWorkers;
+    for(int i = 0; i < p->nWorkers; i++) {
+        struct fvpoolWorker *victim = &p->workers[(start + i) % p->nWorkers];
+        if(victim == w) continue;
+        struct fvpoolSession *s = deque_steal(&victim->deque);
+        if(s) {
+            w->steals++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+
+// Blocks until some sessions are ready, runs the first and queues the rest
+// where other workers can steal them
+static struct fvpoolSession * poll_ready(struct fvpoolWorker *w)
+{
+    struct fvpool *p = w->pool;
+    struct epoll_event events[FVPOOL_BATCH];
+
+    __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+    // Check once more now that pushers can see we're idle, or we could sleep
+    // through work that was queued just before
+    struct fvpoolSession *stolen = steal(w);
+    int n = stolen ? 0 : epoll_wait(p->epfd, events, FVPOOL_BATCH, -1);
+    __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+    if(stolen) return stolen;
+    w->polls++;
+
+    struct fvpoolSession *ready[FVPOOL_BATCH];
+    int nReady = 0, kicked = 0;
+    for(int i = 0; i < n; i++) {
+        struct fvpoolSession *s = events[i].data.ptr;
+        if(s) {
+            ready[nReady++] = s;
+            continue;
+        }
+        rearm_kick(p);
+        if(p->stopping)
+            kick(p); // pass it on to the next worker
+        else
+            kicked = 1;
+    }
+
+    // Kicked sessions join the batch as far as there's room, and the next
+    // worker takes the rest
+    if(kicked) {
+        pthread_mutex_lock(&p->lock);
+        while(p->kicked && nReady < FVPOOL_BATCH) {
+            struct fvpoolSession *s = p->kicked;
+            p->kicked = s->nextKicked;
+            s->kicked = 0;
+            ready[nReady++] = s;
+        }
+        if(p->kicked)
+            kick(p);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    uint64_t now = pool_now();
+    struct fvpoolSession *first = NULL;
+    int queued = 0;
+    for(int i = 0; i < nReady; i++) {
+        struct fvpoolSession *s = ready[i];
+        if(!session_claim(s)) continue;
+        s->readyAt = now;
+        if(!first) {
+            first = s;
+        } else {
+            deque_push(&w->deque, s);
+            queued++;
+        }
+    }
+
+    if(queued && __atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) > 0)
+        kick(p);
+    return first;
+}
+
+
+static void * worker_main(void *arg)
+{
+    struct fvpoolWorker *w = arg;
+    struct fvpool *p = w->pool;
+
+    while(!__atomic_load_n(&p->stopping, __ATOMIC_ACQUIRE)) {
+        struct fvpoolSession *s = deque_pop(&w->deque);
+        if(!s) s = steal(w);
+        if(!s) s = poll_ready(w);
+        if(!s) continue;
+
+        uint64_t t0 = pool_now();
+        session_run(w, s);
+        w->busyNs += pool_now() - t0;
+        w->runs++;
+    }
+    return NULL;
+}
+
+
+#pragma mark - Public interface
+
+
+// Creates a pool of the given number of worker threads that can host up to
+// maxSessions sessions. A budget of 0 means FVPOOL_DEFAULT_BUDGET.
+struct fvpool * fvpool_create(int workers, int maxSessions, size_t budget)
+{
+    if(workers < 1 || maxSessions < 1) return NULL;
+
+    struct fvpool *p = calloc(1, sizeof(struct fvpool));
+    p->nWorkers = workers;
+    p->maxSessions = maxSessions;
+    p->budget = budget ? budget : FVPOOL_DEFAULT_BUDGET;
+    p->sessions = calloc(maxSessions, sizeof(struct fvpoolSession *));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->allExited, NULL);
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    p->kickfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    if(p->epfd < 0 || p->kickfd < 0 || epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->kickfd, &ev) < 0) {
+        fvpool_free(p);
+        return NULL;
+    }
+
+    if(posix_memalign((void **) &p->workers, 64, workers * sizeof(struct fvpoolWorker)) != 0) {
+        fvpool_free(p);
+        return NULL;
+    }
+    memset(p->workers, 0, workers * sizeof(struct fvpoolWorker));
+    for(int i = 0; i < workers; i++) {
+        struct fvpoolWorker *w = &p->workers[i];
+        w->pool = p;
+        w->index = i;
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        w->buf = malloc(p->budget);
+    }
+    return p;
+}
+
+
+// Starts argv (or the user's shell) on a new PTY and adds it to the pool.
+// Returns the session id, or -1 if the pool is full or the spawn failed.
+// Sessions may be added before or after fvpool_start().
+int fvpool_spawn(struct fvpool *p, int rows, int cols, char *const argv[])
+{
+    pthread_mutex_lock(&p->lock);
+    int id = p->nSessions < p->maxSessions ? p->nSessions++ : -1;
+    pthread_mutex_unlock(&p->lock);
+    if(id < 0) return -1;
+
+    struct fvpoolSession *s = calloc(1, sizeof(struct fvpoolSession));
+    s->pool = p;
+    s->id = id;
+    s->running = 1; // until it's first armed
+    s->fd = fvhost_openpty(rows, cols, argv, &s->pid);
+    pthread_mutex_init(&s->lock, NULL);
+    if(s->fd >= 0) {
+        s->term = fvterm_init(rows, cols);
+        struct fvtermCallbacks callbacks = {
+            .write = session_write,
+            .resize = session_resize,
+        };
+        fvterm_setcallbacks(s->term, &callbacks, s);
+    }
+
+    // Published under the lock, as fvpool_send() may be looking for it
+    pthread_mutex_lock(&p->lock);
+    p->sessions[id] = s;
+    if(s->fd >= 0) {
+        s->alive = 1;
+        p->live++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if(s->fd < 0)
+        return -1; // stays in the table, not alive, so ids remain dense
+
+    session_arm(s, EPOLL_CTL_ADD);
+    return id;
+}
+
+
+int fvpool_start(struct fvpool *p)
+{
+    for(int i = 0; i < p->nWorkers; i++) {
+        if(pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]) != 0)
+            return -1;
+        p->started = i + 1;
+    }
+    return 0;
+}
+
+
+// Blocks until every session's child has exited
+void fvpool_wait(struct fvpool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while(p->live > 0)
+        pthread_cond_wait(&p->allExited, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+// Sends input to a session's child. Whatever the PTY won't take right away
+// goes out once it will, when the session is next run.
+int fvpool_send(struct fvpool *p, int id, const void *bytes, size_t len)
+{
+    pthread_mutex_lock(&p->lock);
+    struct fvpoolSession *s = id >= 0 && id < p->nSessions ? p->sessions[id] : NULL;
+    int alive = s && s->alive;
+    pthread_mutex_unlock(&p->lock);
+    if(!alive) return -1;
+
+    pthread_mutex_lock(&s->lock);
+    queue_out(s, bytes, len);
+    flush_out(s);
+    // A worker running it arms it for EPOLLOUT when it's done; otherwise
+    // one has to be woken to
+    int stuck = s->outLen > 0 && !s->running && !s->armedOut;
+    pthread_mutex_unlock(&s->lock);
+
+    if(stuck)
+        kick_session(p, s);
+    return 0;
+}
+
+
+// Fills in one session's counters, or the totals over all sessions if id is
+// -1. Counters are updated without locking, so they're only exact once the
+// sessions concerned have exited.
+int fvpool_stats(struct fvpool *p, int id, struct fvpoolStats *stats)
+{
+    pthread_mutex_lock(&p->lock);
+    int nSessions = p->nSessions;
+    pthread_mutex_unlock(&p->lock);
+
+    int first = id, last = id;
+    if(id == -1) {
+        first = 0;
+        last = nSessions - 1;
+    } else if(id < 0 || id >= nSessions) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    uint64_t latency[FVPOOL_LATENCY_BUCKETS] = { 0 };
+    uint64_t samples = 0;
+    for(int i = first; i <= last; i++) {
+        pthread_mutex_lock(&p->lock);
+        struct fvpoolSession *s = p->sessions[i];
+        pthread_mutex_unlock(&p->lock);
+        if(!s) continue; // still being spawned
+        stats->sessions++;
+        stats->alive += s->alive;
+        // The first failure, if any, for totals
+        int status = WIFSIGNALED(s->status) ? 128 + WTERMSIG(s->status) : WEXITSTATUS(s->status);
+        if(!stats->status)
+            stats->status = status;
+        stats->bytesIn += s->bytesIn;
+        stats->bytesOut += s->bytesOut;
+        stats->runs += s->runs;
+        stats->budgetRuns += s->budgetRuns;
+        stats->cpuNs += s->cpuNs;
+        if(s->latencyMaxNs > stats->latencyMaxNs)
+            stats->latencyMaxNs = s->latencyMaxNs;
+        for(int b = 0; b < FVPOOL_LATENCY_BUCKETS; b++) {
+            latency[b] += s->latency[b];
+            samples += s->latency[b];
+        }
+    }
+
+    uint64_t seen = 0;
+    for(int b = 0; b < FVPOOL_LATENCY_BUCKETS && samples; b++) {
+        seen += latency[b];
+        uint64_t bound = 2ULL << b;
+        if(!stats->latencyP50Ns && seen * 2 >= samples)
+            stats->latencyP50Ns = bound;
+        if(!stats->latencyP99Ns && seen * 100 >= samples * 99)
+            stats->latencyP99Ns = bound;
+    }
+    return 0;
+}
+
+
+// Stops the workers and waits for them to finish, after which their counters
+// can be read. Sessions aren't run any more, but stay open.
+void fvpool_stop(struct fvpool *p)
+{
+    if(!p->started) return;
+    __atomic_store_n(&p->stopping, 1, __ATOMIC_RELEASE);
+    kick(p);
+    for(int i = 0; i < p->started; i++)
+        pthread_join(p->workers[i].thread, NULL);
+    p->started = 0;
+}
+
+
+// Stops the workers, then closes every session (their children get SIGHUP)
+void fvpool_free(struct fvpool *p)
+{
+    fvpool_stop(p);
+
+    for(int i = 0; i < p->nSessions; i++) {
+        struct fvpoolSession *s = p->sessions[i];
+        if(!s) continue;
+        if(s->fd >= 0)
+            close(s->fd);
+        if(s->alive)
+            waitpid(s->pid, &s->status, WNOHANG);
+        if(s->term)
+            fvterm_free(s->term);
+        pthread_mutex_destroy(&s->lock);
+        free(s->out);
+        free(s);
+    }
+
+    if(p->workers) {
+        for(int i = 0; i < p->nWorkers; i++)
+            free(p->workers[i].buf);
+        free(p->workers);
+    }
+    if(p->epfd >= 0)
+        close(p->epfd);
+    if(p->kickfd >= 0)
+        close(p->kickfd);
+    pthread_cond_destroy(&p->allExited);
+    pthread_mutex_destroy(&p->lock);
+    free(p->sessions);
+    free(p);
+}
@@ -0,0 +1,118 @@
+#ifndef _FVPOOL_H
+#define _FVPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "libfvterm.h"
+
+// Many PTY sessions multiplexed over a fixed pool of worker threads (Linux
+// only: it relies on epoll).
+//
+// Every session's master is registered EPOLLONESHOT in one shared epoll set,
+// so a readable session is handed to exactly one worker and stays disabled
+// until that worker re-arms it. The epoll ready list is the global run queue:
+// an idle worker takes up to FVPOOL_BATCH ready sessions from it, runs one and
+// pushes the rest on its own work-stealing deque, where other idle workers can
+// take them. A run parses at most the pool's byte budget before the session is
+// re-armed, which puts a flooding session back at the end of the ready list
+// behind everyone else instead of letting it hold a worker.
+//
+// Input that fvpool_send() can't write at once needs the session armed for
+// EPOLLOUT, which only a worker running it may do. If none is, the session is
+// put on the pool's kicked list and an idle worker woken to run it. A session
+// that turns up while it's already running is dropped, as the worker running
+// it re-arms it when done.
+#define FVPOOL_BATCH            8
+#define FVPOOL_DEQUE_SIZE       8   // power of two, >= FVPOOL_BATCH - 1
+#define FVPOOL_DEFAULT_BUDGET   (32 << 10)
+#define FVPOOL_LATENCY_BUCKETS  40  // log2 of nanoseconds
+
+struct fvpoolSession {
+    struct fvterm *term;
+    struct fvpool *pool;
+    int id, fd;
+    pid_t pid;
+    int alive, status;
+
+    // Responses and fvpool_send() input the PTY wouldn't take yet. Guarded by
+    // lock, since fvpool_send() may be called from any thread.
+    pthread_mutex_t lock;
+    uint8_t *out;
+    size_t outLen, outCap;
+    // Also under lock: set while a worker runs the session (and from when
+    // the child exits), and whether it was last armed for EPOLLOUT
+    int running, armedOut;
+
+    // On the pool's list of sessions kicked by fvpool_send(), under its lock
+    int kicked;
+    struct fvpoolSession *nextKicked;
+
+    uint64_t readyAt; // when a worker took it off the ready list
+
+    uint64_t bytesIn, bytesOut;
+    uint64_t runs, budgetRuns; // runs, and runs that used the whole budget
+    uint64_t cpuNs;            // thread CPU time spent on this session
+    uint64_t latencyMaxNs;
+    uint32_t latency[FVPOOL_LATENCY_BUCKETS]; // ready -> parsed, per run
+};
+
+// Chase-Lev deque: the owner pushes and pops at the bottom, thieves take from
+// the top. Indices only ever grow; slots are index & (FVPOOL_DEQUE_SIZE - 1).
+struct fvpoolDeque {
+    int64_t top;
+    char pad[64 - sizeof(int64_t)];
+    int64_t bottom;
+    struct fvpoolSession *slots[FVPOOL_DEQUE_SIZE];
+};
+
+struct fvpoolWorker {
+    struct fvpool *pool;
+    pthread_t thread;
+    int index;
+    uint64_t rng;
+    uint8_t *buf;
+
+    struct fvpoolDeque deque __attribute__((aligned(64)));
+
+    uint64_t runs, steals, polls;
+    uint64_t busyNs;
+};
+
+struct fvpool {
+    struct fvpoolWorker *workers;
+    int nWorkers, started;
+    int epfd, kickfd;
+    size_t budget;
+
+    struct fvpoolSession **sessions;
+    int nSessions, maxSessions;
+
+    int idle;  // workers (about to be) blocked in epoll_wait
+    int live;  // sessions whose child hasn't exited
+    struct fvpoolSession *kicked;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t allExited;
+};
+
+struct fvpoolStats {
+    int sessions, alive, status;
+    uint64_t bytesIn, bytesOut;
+    uint64_t runs, budgetRuns;
+    uint64_t cpuNs;
+    // Upper bounds of the histogram buckets the percentiles fall in
+    uint64_t latencyP50Ns, latencyP99Ns, latencyMaxNs;
+};
+
+struct fvpool * fvpool_create(int workers, int maxSessions, size_t budget);
+int fvpool_spawn(struct fvpool *p, int rows, int cols, char *const argv[]);
+int fvpool_start(struct fvpool *p);
+void fvpool_wait(struct fvpool *p);
+int fvpool_send(struct fvpool *p, int id, const void *bytes, size_t len);
+int fvpool_stats(struct fvpool *p, int id, struct fvpoolStats *stats);
+void fvpool_stop(struct fvpool *p);
+void fvpool_free(struct fvpool *p);
+
+#endif // _FVPOOL_H
@@ -0,0 +1,150 @@
+// fvhost - runs a command on a PTY with the emulator core, no display.
+//
+// Useful for driving the core with real programs and for measuring how fast
+// it keeps up with them. A summary is written to stderr as JSON when the
+// command exits; -d also prints the final screen, and -l writes the output
+// as plain lines of text as it goes, like a log. If stdout is a terminal and
+// no size is given, the PTY follows that terminal's size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "fvhost.h"
+
+
+static volatile sig_atomic_t gotWinch;
+
+static void on_winch(int sig)
+{
+    gotWinch = 1;
+}
+
+
+static int tty_size(int *rows, int *cols)
+{
+    struct winsize ws;
+    if(ioctl(1, TIOCGWINSZ, &ws) < 0 || ws.ws_row == 0 || ws.ws_col == 0)
+        return -1;
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+    return 0;
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r rows] [-c cols] [-o recording] [-l lines] [-d] [-q] [command [args...]]\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int rows = 0, cols = 0, dump = 0, quiet = 0;
+    const char *recordPath = NULL, *linesPath = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "+r:c:o:l:dq")) != -1) {
+        switch(opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'o': recordPath = optarg; break;
+            case 'l': linesPath = optarg; break;
+            case 'd': dump = 1; break;
+            case 'q': quiet = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    int follow = !rows && !cols && tty_size(&rows, &cols) == 0;
+    if(!rows) rows = 24;
+    if(!cols) cols = 80;
+    if(rows < 2 || cols < 2) usage(argv[0]);
+
+    if(follow) {
+        struct sigaction sa = { .sa_handler = on_winch };
+        sigaction(SIGWINCH, &sa, NULL);
+    }
+
+    struct fvhost *h = fvhost_spawn(rows, cols, optind < argc ? argv + optind : NULL);
+    if(!h) {
+        perror("fvhost_spawn");
+        return 1;
+    }
+
+    FILE *record = NULL;
+    if(recordPath) {
+        if(!(record = fopen(recordPath, "wb"))) {
+            perror(recordPath);
+            return 1;
+        }
+        fvterm_record(h->term, record);
+    }
+
+    FILE *lines = NULL;
+    if(linesPath) {
+        if(!(lines = fopen(linesPath, "w"))) {
+            perror(linesPath);
+            return 1;
+        }
+        fvhost_taplines(h, lines);
+    }
+
+    uint64_t start = now_ns();
+    while(fvhost_run(h, -1) >= 0) {
+        if(gotWinch) {
+            gotWinch = 0;
+            if(tty_size(&rows, &cols) == 0)
+                fvhost_resize(h, rows, cols);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    int status = WIFSIGNALED(h->status) ? 128 + WTERMSIG(h->status) : WEXITSTATUS(h->status);
+
+    if(record) {
+        fvterm_record(h->term, NULL);
+        fclose(record);
+    }
+
+    if(lines) {
+        fvhost_taplines(h, NULL);
+        fclose(lines);
+    }
+
+    if(dump) {
+        fvterm_getsize(h->term, &rows, &cols);
+        size_t len = fvterm_getutf8(h->term, 0, rows, NULL, 0);
+        char *text = malloc(len + 1);
+        fvterm_getutf8(h->term, 0, rows, text, len + 1);
+        fwrite(text, 1, len, stdout);
+        free(text);
+    }
+
+    if(!quiet) {
+        fprintf(stderr, "{\"status\": %d, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                        "\"elapsed_ns\": %llu, \"parse_ns\": %llu, \"mb_per_s\": %.1f, "
+                        "\"wakeups\": %llu, \"avg_chunk\": %.0f, \"buf_size\": %zu}\n",
+                status, (unsigned long long) h->bytesIn, (unsigned long long) h->bytesOut,
+                (unsigned long long) elapsed, (unsigned long long) h->parseNs,
+                elapsed ? (h->bytesIn / 1048576.0) / (elapsed / 1e9) : 0.0,
+                (unsigned long long) h->wakeups,
+                h->wakeups ? (double) h->bytesIn / h->wakeups : 0.0, h->bufSize);
+    }
+
+    fvhost_free(h);
+    return status;
+}
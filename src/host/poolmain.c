@@ -0,0 +1,120 @@
+// fvpool - runs many copies of a command, each on its own PTY and emulator,
+// over a fixed pool of worker threads.
+//
+// Meant for measuring how the pool scales: run the same workload with -w 1,
+// 2, 4... and compare mb_per_s. Writes a JSON summary to stdout once every
+// copy has exited, with one line per session under -v.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fvpool.h"
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void print_stats(const struct fvpoolStats *st)
+{
+    printf("\"bytes_in\": %llu, \"bytes_out\": %llu, \"runs\": %llu, \"budget_runs\": %llu, "
+           "\"cpu_ns\": %llu, \"latency_p50_ns\": %llu, \"latency_p99_ns\": %llu, "
+           "\"latency_max_ns\": %llu",
+           (unsigned long long) st->bytesIn, (unsigned long long) st->bytesOut,
+           (unsigned long long) st->runs, (unsigned long long) st->budgetRuns,
+           (unsigned long long) st->cpuNs, (unsigned long long) st->latencyP50Ns,
+           (unsigned long long) st->latencyP99Ns, (unsigned long long) st->latencyMaxNs);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-w workers] [-n sessions] [-b budget] [-r rows] [-c cols] [-v] "
+                    "command [args...]\n", argv0);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int workers = sysconf(_SC_NPROCESSORS_ONLN), sessions = 1;
+    int rows = 24, cols = 80, verbose = 0;
+    size_t budget = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "+w:n:b:r:c:v")) != -1) {
+        switch(opt) {
+            case 'w': workers = atoi(optarg); break;
+            case 'n': sessions = atoi(optarg); break;
+            case 'b': budget = strtoul(optarg, NULL, 0); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind >= argc || workers < 1 || sessions < 1 || rows < 2 || cols < 2)
+        usage(argv[0]);
+
+    struct fvpool *p = fvpool_create(workers, sessions, budget);
+    if(!p) {
+        perror("fvpool_create");
+        return 1;
+    }
+
+    // Spawn everything first so the clock only covers the emulation
+    for(int i = 0; i < sessions; i++) {
+        if(fvpool_spawn(p, rows, cols, argv + optind) < 0) {
+            perror("fvpool_spawn");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    if(fvpool_start(p) < 0) {
+        perror("fvpool_start");
+        return 1;
+    }
+    fvpool_wait(p);
+    uint64_t elapsed = now_ns() - start;
+    fvpool_stop(p); // so the workers' counters hold still
+
+    struct fvpoolStats total;
+    fvpool_stats(p, -1, &total);
+    printf("{\"workers\": %d, \"sessions\": %d, \"budget\": %zu, \"status\": %d, "
+           "\"elapsed_ns\": %llu, \"mb_per_s\": %.1f, ",
+           workers, sessions, p->budget, total.status, (unsigned long long) elapsed,
+           elapsed ? (total.bytesIn / 1048576.0) / (elapsed / 1e9) : 0.0);
+    print_stats(&total);
+
+    printf(",\n \"per_worker\": [");
+    for(int i = 0; i < workers; i++) {
+        struct fvpoolWorker *w = &p->workers[i];
+        printf("%s\n  {\"runs\": %llu, \"steals\": %llu, \"polls\": %llu, \"busy_ns\": %llu}",
+               i ? "," : "", (unsigned long long) w->runs, (unsigned long long) w->steals,
+               (unsigned long long) w->polls, (unsigned long long) w->busyNs);
+    }
+    printf("\n ]");
+
+    if(verbose) {
+        printf(",\n \"per_session\": [");
+        for(int i = 0; i < sessions; i++) {
+            struct fvpoolStats st;
+            fvpool_stats(p, i, &st);
+            printf("%s\n  {\"id\": %d, \"status\": %d, ", i ? "," : "", i, st.status);
+            print_stats(&st);
+            printf("}");
+        }
+        printf("\n ]");
+    }
+    printf("}\n");
+
+    fvpool_free(p);
+    return total.status;
+}
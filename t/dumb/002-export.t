@@ -0,0 +1,16 @@
+RES 20 4
+IN Hello, world\r\n
+IN 0123456789012345678901234
+TEXT 0 1 - Hello, world\s\s\s\s\s\s\s\s\n
+TEXT 0 1 t Hello, world\n
+TEXT 0 4 t Hello, world\n01234567890123456789\n01234\n\n
+
+# A row that wrapped runs on into the next, blanks and all
+TEXT 1 2 j 0123456789012345678901234\s\s\s\s\s\s\s\s\s\s\s\s\s\s\s\n
+TEXT 1 2 jt 0123456789012345678901234\n
+TEXT 1 1 jt 01234567890123456789\n
+
+# Attributes, reset at the end of every line
+IN \r\n\1b[1;31mred\1b[m \1b[44m  \1b[m
+TEXT 3 1 st \1b[1;31mred\1b[m \1b[44m\s\s\1b[m\n
+TEXT 3 1 t red\n
@@ -0,0 +1,88 @@
+RES 10 4
+TAP
+
+# A line is finished when a line feed leaves it, without trailing blanks
+IN one  \r\n
+LINE one
+IN \r\n
+LINE
+NOLINE
+
+# Rows that wrapped are one line. Row 0 scrolls off, but it's been seen.
+IN 0123456789abc\r\n
+LINE 0123456789abc
+NOLINE
+
+# Moving back over finished lines doesn't finish them again
+IN \1b[2;1H\n\n
+NOLINE
+
+# Unless they've changed since
+IN \1b[3;1HX\1b[4;1H\n\n
+LINE
+LINE
+NOLINE
+IN \n
+LINE
+LINE Xbc
+NOLINE
+
+# Rows that were cleared and scroll off are empty lines, as they would be in
+# the scrollback
+IN \1b[2J\1b[4;1H0123456789ABCDEFGHIJ0123456789tail
+LINE
+LINE
+LINE
+NOLINE
+
+# A line that started scrolling off is finished by the row that ends it
+IN \1b[1S\1b[1S
+NOLINE
+IN \1b[2;5H\r\n
+LINE 0123456789ABCDEFGHIJ0123456789tail
+IN \1b[1S
+NOLINE
+
+# Cleared rows don't run on into the next any more
+IN \1b[2J\1b[1;1H0123456789ab\1b[2J\1b[1;1Hx\1b[2;1Hy\r\n
+LINE y
+IN \1b[5S
+LINE x
+LINE
+LINE
+NOLINE
+
+# Attributes become spans, in bytes
+IN \1b[1;1H\1b[1mbold\1b[m \1b[31m\c3\a9t\c3\a9\1b[m\r\n
+LINE bold \c3\a9t\c3\a9
+SPAN 0 4 10000
+SPAN 5 5 400001
+IN rest
+FLUSH
+LINE rest
+NOLINE
+
+# The start of a line that scrolled off only goes on in row 0 while row 0 is
+# what came after it: erasing the screen finishes it, before what follows
+RES 10 3
+IN \1b[2J\1b[HAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA
+NOLINE
+IN \1b[2J\1b[Hfoo\r\n
+LINE AAAAAAAAAA
+LINE foo
+NOLINE
+IN \1b[2J\1b[HAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\1b[2J\1b[3;1Hfoo\r\n
+LINE AAAAAAAAAA
+LINE foo
+LINE
+NOLINE
+
+# So does writing over row 0, and setting the margins
+IN \1b[2J\1b[HAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\1b[Hxyz\1b[3;6H\r\n
+LINE AAAAAAAAAA
+LINE xyzAAAAAAAAAAAAAAAAAAAAAA
+NOLINE
+IN \1b[2J\1b[HAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\1b[1;2r\1b[3;6H\r\n\1b[r
+LINE AAAAAAAAAA
+LINE AAAAAAAAAAAAAAAAAAAAAAAAA
+NOLINE
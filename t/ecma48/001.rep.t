@@ -0,0 +1,54 @@
+RES 10 4
+
+# REP repeats the last character written, in the attributes now in effect
+IN ab\1b[b
+OUT 0 0 abb
+CURSOR 0 3
+IN \1b[1m\1b[3b
+OUT 0 0 abbbbb
+ATTR 0 2 1 0
+ATTR 0 3 3 10000
+CURSOR 0 6
+
+# Runs wrap like anything else written
+IN \1b[m\1b[2;9Hx\1b[4b
+OUT 1 8 xx
+OUT 2 0 xxx
+CURSOR 2 3
+
+# And a run that ends on the last column leaves the cursor waiting there
+IN \1b[3;1Hy\1b[9b
+OUT 2 0 yyyyyyyyyy
+CURSOR 2 9
+IN z
+OUT 3 0 z
+
+# Without wraparound, everything beyond the margin lands on the last column
+IN \1b[?7l\1b[1;1H\1b[2Kq\1b[20b
+OUT 0 0 qqqqqqqqqq
+CURSOR 0 9
+IN \1b[?7h
+
+# In insert mode the run pushes the rest of the row along
+IN \1b[4;1H\1b[2K0123\1b[4;1H-\1b[4h\1b[2b\1b[4l
+OUT 3 0 ---123\s\s\s\s
+CURSOR 3 3
+
+# Huge counts scroll the screen full of the character
+IN \1b[2J\1b[1;1H#\1b[16383b
+OUT 0 0 ##########
+OUT 2 0 ##########
+OUT 3 0 ####\s\s\s\s\s\s
+CURSOR 3 4
+
+# Between left and right margins, the rows after the first are as wide as them
+IN \1b[?69h\1b[2;8s\1b[1;1Hx\1b[705b
+CURSOR 3 6
+IN \1b[s\1b[?69l
+
+# A restored copy repeats the same character
+IN \1b[2J\1b[1;1Hx
+RESTORE
+IN \1b[3b
+OUT 0 0 xxxx
+CURSOR 0 4
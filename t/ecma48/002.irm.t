@@ -0,0 +1,18 @@
+RES 10 3
+
+IN abcdefgh\r
+IN \1b[4hXY
+OUT 0 0 XYabcdefgh
+CURSOR 0 2
+
+# The last cell falls off the end
+IN Z
+OUT 0 0 XYZabcdefg
+
+# ICH and DCH shift whole cells too
+IN \1b[4l\1b[1;2H\1b[3@
+OUT 0 0 X\s\s\sYZabcd
+IN \1b[4P
+OUT 0 0 XZabcd\s\s\s\s
+
+# vim: set syn=conf:
@@ -1,8 +1,40 @@
+from __future__ import print_function
 import sys, os, re
 from ctypes import *
 
 ##############################################################################
 
+GLYPH_MASK = 0x1fffff
+SPACER = 0x110000
+
+EXPORT_FLAGS = {"j": 1, "t": 2, "s": 4, "l": 8} # join, trim, SGR, links
+
+class FvtermScreen(Structure):
+    _fields_ = [("rows", c_int), ("cols", c_int),
+                ("cursorRow", c_int), ("cursorCol", c_int),
+                ("scrollTop", c_int), ("scrollBottom", c_int),
+                ("cursorAttr", c_uint32), ("modes", c_uint64),
+                ("scrollLeft", c_int), ("scrollRight", c_int)]
+
+class FvtermSpan(Structure):
+    _fields_ = [("start", c_uint32), ("len", c_uint32), ("attr", c_uint32),
+                ("uri", c_char_p)]
+
+class FvtermGraphic(Structure):
+    _fields_ = [("col", c_int), ("width", c_int), ("height", c_int), ("used", c_int),
+                ("pixels", POINTER(c_uint8)), ("colors", POINTER(c_uint32))]
+
+LINE_FUNC = CFUNCTYPE(None, c_void_p, POINTER(c_char), c_size_t,
+                      POINTER(FvtermSpan), c_int)
+
+CLIPBOARD_FUNC = CFUNCTYPE(None, c_void_p, c_char_p, POINTER(c_char), c_size_t, c_int)
+
+CLIPBOARD_FLAGS = {"end": 1, "abort": 2}
+
+class FvtermCallbacks(Structure):
+    _fields_ = [("write", c_void_p), ("resize", c_void_p), ("bell", c_void_p),
+                ("title", c_void_p), ("line", LINE_FUNC), ("clipboard", CLIPBOARD_FUNC)]
+
 class Fvterm(c_void_p):
     @classmethod
     def init(cls, rows, cols):
@@ -24,9 +56,85 @@ class Fvterm(c_void_p):
         Fvterm.lib.fvterm_getcursor(self, byref(r), byref(c))
         return (r.value, c.value)
     def getrowflags(self, r):
-        return Fvterm.lib.fvterm_getrowflags(r)
+        return Fvterm.lib.fvterm_getrowflags(self, r)
     def getglyph(self, r, c):
         return Fvterm.lib.fvterm_getglyph(self, r, c)
+    def getregion(self, top, left, rows, cols):
+        cells = (c_uint64 * (rows * cols))()
+        flags = (c_int * rows)()
+        if Fvterm.lib.fvterm_getregion(self, top, left, rows, cols, cells, flags) < 0:
+            return None
+        return list(cells), list(flags)
+    def getscreen(self):
+        screen = FvtermScreen()
+        n = Fvterm.lib.fvterm_getscreen(self, byref(screen), None, None)
+        cells = (c_uint64 * n)()
+        flags = (c_int * screen.rows)()
+        Fvterm.lib.fvterm_getscreen(self, byref(screen), cells, flags)
+        return screen, list(cells), list(flags)
+    def getutf8(self, top, rows):
+        n = Fvterm.lib.fvterm_getutf8(self, top, rows, None, 0)
+        buf = create_string_buffer(n + 1)
+        Fvterm.lib.fvterm_getutf8(self, top, rows, buf, n + 1)
+        return buf.raw[:n].decode("utf-8")
+    def export(self, top, rows, flags):
+        n = Fvterm.lib.fvterm_export(self, top, rows, flags, None, 0)
+        buf = create_string_buffer(n + 1)
+        Fvterm.lib.fvterm_export(self, top, rows, flags, buf, n + 1)
+        return buf.raw[:n].decode("utf-8")
+    def getgraphics(self, row):
+        n = Fvterm.lib.fvterm_getgraphics(self, row, None, 0)
+        graphics = (FvtermGraphic * max(n, 1))()
+        Fvterm.lib.fvterm_getgraphics(self, row, graphics, n)
+        return list(graphics)[:n]
+    def setcellsize(self, w, h):
+        Fvterm.lib.fvterm_setcellsize(self, w, h)
+    def getlink(self, cell):
+        # (uri, id) of the cell's link, or None
+        id = c_char_p()
+        uri = Fvterm.lib.fvterm_getlink(self, cell, byref(id))
+        return uri and (uri.decode("latin-1"), id.value.decode("latin-1"))
+    def taplines(self):
+        # Finished lines pile up in self.lines as (text, spans)
+        self.lines = []
+        def line(ctx, text, n, spans, nSpans):
+            self.lines.append((string_at(text, n).decode("utf-8"),
+                               [(spans[i].start, spans[i].len, spans[i].attr,
+                                 spans[i].uri and spans[i].uri.decode("latin-1"))
+                                for i in range(nSpans)]))
+        self.sethooks(line=LINE_FUNC(line))
+    def tapclipboard(self):
+        # Finished OSC 52 transfers pile up in self.clips as (selection,
+        # data, flags), with the pieces they came in joined
+        self.clips, self.clipData = [], b""
+        def clipboard(ctx, selection, data, n, flags):
+            self.clipData += string_at(data, n) if n else b""
+            if flags:
+                self.clips.append((selection.decode("latin-1"), self.clipData, flags))
+                self.clipData = b""
+        self.sethooks(clipboard=CLIPBOARD_FUNC(clipboard))
+    def sethooks(self, **hooks):
+        if not hasattr(self, "hooks"):
+            self.hooks = {}
+        self.hooks.update(hooks)
+        self.callbacks = FvtermCallbacks(**self.hooks)
+        Fvterm.lib.fvterm_setcallbacks(self, byref(self.callbacks), None)
+    def flushlines(self):
+        Fvterm.lib.fvterm_flushlines(self)
+    def restore(self):
+        # Carries on as a copy rebuilt from a saved state, with the same hooks
+        fp = Fvterm.libc.tmpfile()
+        Fvterm.lib.fvterm_save(self, fp)
+        Fvterm.libc.rewind(fp)
+        copy = Fvterm.lib.fvterm_restore(fp)
+        Fvterm.libc.fclose(fp)
+        if not copy:
+            return False
+        Fvterm.lib.fvterm_free(self)
+        self.value = copy
+        if hasattr(self, "hooks"):
+            self.sethooks()
+        return True
 
     @classmethod
     def loadlib(cls, path):
@@ -47,6 +155,38 @@ class Fvterm(c_void_p):
         fvterm.fvterm_getrowflags.argtypes = [Fvterm, c_int]
         fvterm.fvterm_getglyph.restype = c_int64
         fvterm.fvterm_getglyph.argtypes = [Fvterm, c_int, c_int]
+        fvterm.fvterm_getregion.restype = c_int
+        fvterm.fvterm_getregion.argtypes = [Fvterm, c_int, c_int, c_int, c_int,
+                                            POINTER(c_uint64), POINTER(c_int)]
+        fvterm.fvterm_getscreen.restype = c_int
+        fvterm.fvterm_getscreen.argtypes = [Fvterm, POINTER(FvtermScreen),
+                                            POINTER(c_uint64), POINTER(c_int)]
+        fvterm.fvterm_getutf8.restype = c_size_t
+        fvterm.fvterm_getutf8.argtypes = [Fvterm, c_int, c_int, c_char_p, c_size_t]
+        fvterm.fvterm_export.restype = c_size_t
+        fvterm.fvterm_export.argtypes = [Fvterm, c_int, c_int, c_int, c_char_p, c_size_t]
+        fvterm.fvterm_setcallbacks.restype = None
+        fvterm.fvterm_setcallbacks.argtypes = [Fvterm, POINTER(FvtermCallbacks), c_void_p]
+        fvterm.fvterm_flushlines.restype = None
+        fvterm.fvterm_flushlines.argtypes = [Fvterm]
+        fvterm.fvterm_getgraphics.restype = c_int
+        fvterm.fvterm_getgraphics.argtypes = [Fvterm, c_int, POINTER(FvtermGraphic), c_int]
+        fvterm.fvterm_setcellsize.restype = None
+        fvterm.fvterm_setcellsize.argtypes = [Fvterm, c_int, c_int]
+        fvterm.fvterm_getlink.restype = c_char_p
+        fvterm.fvterm_getlink.argtypes = [Fvterm, c_uint64, POINTER(c_char_p)]
+        fvterm.fvterm_save.restype = c_int
+        fvterm.fvterm_save.argtypes = [Fvterm, c_void_p]
+        fvterm.fvterm_restore.restype = c_void_p
+        fvterm.fvterm_restore.argtypes = [c_void_p]
+
+        Fvterm.libc = libc = CDLL(None)
+        libc.tmpfile.restype = c_void_p
+        libc.tmpfile.argtypes = []
+        libc.rewind.restype = None
+        libc.rewind.argtypes = [c_void_p]
+        libc.fclose.restype = c_int
+        libc.fclose.argtypes = [c_void_p]
 
 ##############################################################################
 
@@ -99,6 +239,8 @@ class TestRunner(object):
 
     def do_IN(self, term):
         text = self.getLine()
+        if not isinstance(text, bytes):
+            text = text.encode("latin-1")
         term.write(text, len(text))
 
     def do_RES(self, term):
@@ -120,14 +262,14 @@ class TestRunner(object):
 
     def do_DUMP(self, term):
         mode = self.getWord()
-        rows, cols = term.getsize()
-        print "Dump:"
-        cr, cc = term.getcursor()
+        screen, cells, flags = term.getscreen()
+        rows, cols = screen.rows, screen.cols
+        print("Dump:")
+        cr, cc = screen.cursorRow, screen.cursorCol
         for r in range(rows):
             text = "%3d: |" % r
             for c in range(cols):
-                glyph = term.getglyph(r, c)
-                gchar = glyph & 0xffff
+                gchar = cells[r * cols + c] & GLYPH_MASK
                 if r == cr and c == cc:
                     text += "\033[7m"
                 if gchar >= 0x20 and gchar < 0x7f:
@@ -136,16 +278,172 @@ class TestRunner(object):
                     text += "\033[1m?"
                 text += "\033[m"
             text += "|"
-            print text
+            print(text)
 
     def do_OUT(self, term):
         row, col = self.getInt(), self.getInt()
         text = self.getLine()
+        region = term.getregion(row, col, 1, len(text))
+        if region is None:
+            raise CheckFailed("Text runs off the screen @ %d/%d" % (row, col))
         for i, ch in enumerate(text):
-            glyph = term.getglyph(row, col + i)
-            if ord(ch) != (glyph & 0xffff):
+            glyph = region[0][i] & GLYPH_MASK
+            if ord(ch) != glyph:
                 raise CheckFailed("Wrong glyph @ col %d: wanted %02x, got %02x" % (
-                    col + i, ord(ch), glyph & 0xffff))
+                    col + i, ord(ch), glyph))
+
+    def do_GLYPHS(self, term):
+        # GLYPHS row col glyph...: the code points (in hex) of cells from
+        # row/col, with - for the spacer after a wide character
+        row, col = self.getInt(), self.getInt()
+        want = [SPACER if w == "-" else int(w, 16) for w in self.getLine().split()]
+        region = term.getregion(row, col, 1, len(want))
+        if region is None:
+            raise CheckFailed("Cells run off the screen @ %d/%d" % (row, col))
+        for i, cell in enumerate(region[0]):
+            if cell & GLYPH_MASK != want[i]:
+                raise CheckFailed("Wrong glyph @ col %d: wanted %x, got %x" % (
+                    col + i, want[i], cell & GLYPH_MASK))
+
+    def do_ATTR(self, term):
+        # ATTR row col count attr: the attributes (high half, in hex) of count
+        # cells from row/col
+        row, col, count = self.getInt(), self.getInt(), self.getInt()
+        attr = int(self.getWord(), 16)
+        region = term.getregion(row, col, 1, count)
+        if region is None:
+            raise CheckFailed("Cells run off the screen @ %d/%d" % (row, col))
+        for i, cell in enumerate(region[0]):
+            if cell >> 32 != attr:
+                raise CheckFailed("Wrong attributes @ col %d: wanted %x, got %x" % (
+                    col + i, attr, cell >> 32))
+
+    def do_TEXT(self, term):
+        # TEXT row rows flags text: the rows as fvterm_export gives them, with
+        # flags a combination of EXPORT_FLAGS letters, or - for none, and
+        # UTF-8 given as bytes
+        row, rows = self.getInt(), self.getInt()
+        flags = 0
+        for f in self.getWordRaw().strip("-"):
+            flags |= EXPORT_FLAGS[f]
+        text = self.getLine().encode("latin-1").decode("utf-8")
+        got = term.export(row, rows, flags)
+        if got != text:
+            raise CheckFailed("Wrong text: wanted %r, got %r" % (text, got))
+
+    def do_RESTORE(self, term):
+        # Saves the terminal and goes on with a copy restored from that
+        if not term.restore():
+            raise CheckFailed("Saved state didn't restore")
+
+    def do_TAP(self, term):
+        term.taplines()
+
+    def do_FLUSH(self, term):
+        term.flushlines()
+
+    def do_LINE(self, term):
+        # LINE text: the oldest line finished since TAP that hasn't been
+        # checked yet, with UTF-8 given as bytes
+        text = self.getLine().encode("latin-1").decode("utf-8")
+        if not term.lines:
+            raise CheckFailed("No line finished: wanted %r" % text)
+        got, self.flags["spans"] = term.lines.pop(0)
+        if got != text:
+            raise CheckFailed("Wrong line: wanted %r, got %r" % (text, got))
+
+    def do_SPAN(self, term):
+        # SPAN start len attr [uri]: one of the spans of the last line checked
+        span = (self.getInt(), self.getInt(), int(self.getWord(), 16), self.getWord() or None)
+        if span not in self.flags.get("spans", []):
+            raise CheckFailed("No span %r in %r" % (span, self.flags.get("spans")))
+
+    def do_NOLINE(self, term):
+        if term.lines:
+            raise CheckFailed("Unexpected line: %r" % term.lines[0][0])
+
+    def do_LINK(self, term):
+        # LINK row col count uri [id]: count cells from row/col link to uri
+        # with id (none if it's left out), or to nothing if uri is -
+        row, col, count = self.getInt(), self.getInt(), self.getInt()
+        uri, id = self.getWord(), self.getWord()
+        want = None if uri == "-" else (uri, id)
+        region = term.getregion(row, col, 1, count)
+        if region is None:
+            raise CheckFailed("Cells run off the screen @ %d/%d" % (row, col))
+        for i, cell in enumerate(region[0]):
+            got = term.getlink(cell)
+            if got != want:
+                raise CheckFailed("Wrong link @ col %d: wanted %r, got %r" % (col + i, want, got))
+
+    def do_CELLSIZE(self, term):
+        term.setcellsize(self.getInt(), self.getInt())
+
+    def do_GRAPHICS(self, term):
+        # GRAPHICS row count: how many images have a slice on the row
+        row, count = self.getInt(), self.getInt()
+        got = len(term.getgraphics(row))
+        if got != count:
+            raise CheckFailed("Wrong graphics on row %d: wanted %d, got %d" % (row, count, got))
+
+    def do_GRAPHIC(self, term):
+        # GRAPHIC row index col used: where the index'th (newest first) starts
+        # and how many pixels across have been drawn
+        row, index, col, used = self.getInt(), self.getInt(), self.getInt(), self.getInt()
+        graphics = term.getgraphics(row)
+        if index >= len(graphics):
+            raise CheckFailed("No graphic %d on row %d" % (index, row))
+        g = graphics[index]
+        if (g.col, g.used) != (col, used):
+            raise CheckFailed("Wrong graphic: wanted col %d used %d, got col %d used %d" % (
+                col, used, g.col, g.used))
+
+    def do_PIXEL(self, term):
+        # PIXEL row index x y rgba: a pixel of the index'th graphic on the row,
+        # x and y within the row's slice, as its color in hex
+        row, index, x, y = self.getInt(), self.getInt(), self.getInt(), self.getInt()
+        rgba = int(self.getWord(), 16)
+        graphics = term.getgraphics(row)
+        if index >= len(graphics):
+            raise CheckFailed("No graphic %d on row %d" % (index, row))
+        g = graphics[index]
+        if x >= g.width or y >= g.height:
+            raise CheckFailed("Pixel %d/%d is outside the %dx%d slice" % (x, y, g.width, g.height))
+        got = g.colors[g.pixels[y * g.width + x]]
+        if got != rgba:
+            raise CheckFailed("Wrong pixel @ %d/%d: wanted %08x, got %08x" % (x, y, rgba, got))
+
+    def do_CLIPTAP(self, term):
+        term.tapclipboard()
+
+    def do_CLIP(self, term):
+        # CLIP selection end|abort data: the oldest OSC 52 transfer finished
+        # since CLIPTAP that hasn't been checked yet; - for no selection
+        selection = self.getWord().strip("-")
+        flags = CLIPBOARD_FLAGS[self.getWord()]
+        data = self.getLine().encode("latin-1")
+        if not term.clips:
+            raise CheckFailed("No clipboard transfer: wanted %r" % data)
+        got = term.clips.pop(0)
+        if got != (selection, data, flags):
+            raise CheckFailed("Wrong clipboard transfer: wanted %r, got %r" % (
+                (selection, data, flags), got))
+
+    def do_CLIPLEN(self, term):
+        # CLIPLEN selection end|abort bytes: likewise, for long ones
+        selection = self.getWord().strip("-")
+        flags = CLIPBOARD_FLAGS[self.getWord()]
+        size = self.getInt()
+        if not term.clips:
+            raise CheckFailed("No clipboard transfer: wanted %d bytes" % size)
+        got = term.clips.pop(0)
+        if (got[0], len(got[1]), got[2]) != (selection, size, flags):
+            raise CheckFailed("Wrong clipboard transfer: wanted %r, got %r" % (
+                (selection, size, flags), (got[0], len(got[1]), got[2])))
+
+    def do_NOCLIP(self, term):
+        if term.clips:
+            raise CheckFailed("Unexpected clipboard transfer: %r" % (term.clips[0],))
 
     def do_CURSOR(self, term):
         xrow, xcol = self.getInt(), self.getInt()
@@ -156,7 +454,7 @@ class TestRunner(object):
 
 
 def runTest(testPath):
-    testFile = file(testPath, "r")
+    testFile = open(testPath, "r")
 
     term = Fvterm.init(24, 80)
     flags = {}
@@ -167,8 +465,8 @@ def runTest(testPath):
         lr = TestRunner(line, flags)
         try:
             lr.doCommand(term)
-        except CheckFailed, e:
-            print "%s:%d: %s" % (testPath, lineno, e)
+        except CheckFailed as e:
+            print("%s:%d: %s" % (testPath, lineno, e))
             errors += 1
 
     if errors > 0: lr.do_DUMP(term)
@@ -184,8 +482,8 @@ if __name__ == '__main__':
         errors += runTest(arg)
         tests += 1
     if errors == 0:
-        print "%d tests passed" % tests
+        print("%d tests passed" % tests)
         sys.exit(0)
     else:
-        print "%d error(s)" % errors
+        print("%d error(s)" % errors)
         sys.exit(1)
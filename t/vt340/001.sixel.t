@@ -0,0 +1,91 @@
+RES 10 5
+CELLSIZE 2 4
+
+# Six pixels a sixel, so with 4-line cells bands straddle rows
+IN \1b[2;3H\1bPq#1~~-~\1b\5c
+GRAPHICS 0 0
+GRAPHICS 1 1
+GRAPHIC 1 0 2 2
+PIXEL 1 0 1 3 3333ccff
+GRAPHIC 2 0 2 2
+PIXEL 2 0 0 1 3333ccff
+PIXEL 2 0 1 1 3333ccff
+PIXEL 2 0 0 2 3333ccff
+GRAPHIC 3 0 2 1
+PIXEL 3 0 0 3 3333ccff
+GRAPHICS 4 0
+
+# Undrawn pixels are register 0 unless P2 is 1
+PIXEL 2 0 1 2 000000ff
+CURSOR 4 2
+
+# The payload can come a piece at a time, even mid-command
+IN \1b[H\1b[2J\1bPq#3;2;100
+IN ;0;0!5
+IN ~
+GRAPHIC 0 0 0 5
+IN $#4;1;0;50;100~\1b\5c
+PIXEL 0 0 0 0 0000ffff
+PIXEL 1 0 4 1 ff0000ff
+CURSOR 2 0
+
+IN \1b[H\1b[2J\1bP0;1q??N\1b\5c
+PIXEL 0 0 2 3 000000ff
+PIXEL 0 0 0 3 00000000
+
+# Images taller than the room below the cursor scroll the screen, and the
+# cursor goes under them
+IN \1b[H\1b[2JA\r\nB\r\nC\r\nD\r\nE\1b[5;1H\1bPq#2~-~-~\1b\5c
+OUT 0 0 \s
+CURSOR 4 0
+GRAPHICS 0 1
+PIXEL 3 0 0 1 cc2121ff
+PIXEL 3 0 0 2 000000ff
+GRAPHICS 4 0
+
+# Erasing the rows takes the image with them
+IN \1b[2J
+GRAPHICS 0 0
+GRAPHICS 3 0
+
+# Clipped at the right edge
+IN \1b[1;9H\1bPq!10~\1b\5c
+GRAPHIC 0 0 8 4
+
+# DECSDM: top left, no scrolling, cursor stays
+IN \1b[H\1b[2J\1b[?80h\1b[3;4H\1bPq~-~-~-~\1b\5c
+GRAPHIC 0 0 0 1
+GRAPHIC 4 0 0 1
+CURSOR 2 3
+IN \1b[?80l
+
+# Other sequences end the string, CAN cancels it; neither loses the image
+IN \1b[H\1b[2J\1bPq~\1b[3;3HX
+OUT 2 2 X
+GRAPHICS 0 1
+IN \1bPq~\18Y
+OUT 4 3 Y
+GRAPHICS 2 1
+
+# Strings for anything else are skipped
+IN \1b[H\1b[2J\1bP$qm\1b\5cZ
+OUT 0 0 Z
+GRAPHICS 0 0
+
+# Changing the cell size drops them
+IN \1bPq~\1b\5c
+GRAPHICS 1 1
+CELLSIZE 3 6
+GRAPHICS 1 0
+
+# A stray high byte in the data is skipped, and so are UTF-8 ones
+IN \1b[H\1b[2J\1bPq#1;2;100;0;0#1~~\80~~\c3\a9~~~~\1b\5c
+GRAPHIC 0 0 0 8
+
+# Changing attributes leaves images be, over the stream or a rectangle
+IN \1b[H\1b[2J\1b[2;3H\1bPq#1~~-~\1b\5c\1b[1;1;5;10;1$r
+GRAPHICS 1 1
+GRAPHICS 2 1
+IN \1b[2*x\1b[1;1;5;10;4$r\1b[*x
+GRAPHICS 1 1
+GRAPHICS 2 1
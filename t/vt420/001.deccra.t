@@ -0,0 +1,27 @@
+RES 10 5
+
+IN 0123456789\r\nabcdefghij\r\nABCDEFGHIJ\r\n
+CURSOR 3 0
+
+# Copy rows 1-2, columns 2-4 to row 3, column 6
+IN \1b[2;2;3;4;1;4;6;1$v
+OUT 3 0 \s\s\s\s\sbcd\s\s
+OUT 4 0 \s\s\s\s\sBCD\s\s
+CURSOR 3 0
+
+# Overlapping copies come out as if the source had been copied first
+IN \1b[1;1;1;8;1;1;3;1$v
+OUT 0 0 0101234567
+IN \1b[2;1;3;10;1;3;1;1$v
+OUT 2 0 abcdefghij
+OUT 3 0 ABCDEFGHIJ
+OUT 1 0 abcdefghij
+
+# The destination is clipped by the screen
+IN \1b[1;1;2;10;1;5;8;1$v
+OUT 4 7 010
+OUT 4 0 \s\s\s\s\sBC010
+
+# Rows count from the top margin in origin mode
+IN \1b[2;4r\1b[?6h\1b[1;1;1;2;1;3;9;1$v\1b[?6l\1b[r
+OUT 3 8 ab
@@ -0,0 +1,29 @@
+RES 10 5
+
+IN 0123456789\r\nabcdefghij\r\nABCDEFGHIJ\r\n
+
+# DECFRA fills with a character in the current attributes
+IN \1b[1m\1b[42;2;3;3;5$x\1b[m
+OUT 0 0 0123456789
+OUT 1 0 ab***fghij
+OUT 2 0 AB***FGHIJ
+ATTR 1 2 3 10000
+ATTR 1 5 5 0
+CURSOR 3 0
+
+# Anything but a graphic character is ignored
+IN \1b[10;1;1;5;10$x
+OUT 0 0 0123456789
+
+# Defaults are the whole screen, and backwards rectangles do nothing
+IN \1b[43;3;9;2;1$x
+OUT 2 0 AB***FGHIJ
+IN \1b[43$x
+OUT 0 0 ++++++++++
+OUT 4 0 ++++++++++
+
+# DECERA erases, clipped to the screen
+IN \1b[4;8;99;99$z
+OUT 3 0 +++++++\s\s\s
+OUT 4 0 +++++++\s\s\s
+OUT 2 0 ++++++++++
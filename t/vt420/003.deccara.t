@@ -0,0 +1,44 @@
+RES 10 5
+
+IN 0123456789\r\nabcdefghij\r\nABCDEFGHIJ\r\n
+
+# By default DECCARA works on the stream of cells from top left to bottom
+# right, leaving the characters alone
+IN \1b[1;8;2;3;1;4$r
+OUT 0 0 0123456789
+ATTR 0 0 7 0
+ATTR 0 7 3 30000
+ATTR 1 0 3 30000
+ATTR 1 3 7 0
+
+# After DECSACE 2 it works on the rectangle
+IN \1b[2*x\1b[1;2;3;3;7$r
+ATTR 0 0 1 0
+ATTR 0 1 2 80000
+ATTR 0 3 4 0
+ATTR 0 7 3 30000
+ATTR 1 0 1 30000
+ATTR 1 1 2 b0000
+ATTR 2 1 2 80000
+ATTR 2 3 7 0
+
+# The off attributes and 0 take them away again
+IN \1b[1;1;2;10;24$r
+ATTR 0 1 2 80000
+ATTR 1 0 1 10000
+ATTR 1 1 2 90000
+IN \1b[1;1;5;10;0$r
+ATTR 0 0 10 0
+ATTR 1 0 10 0
+ATTR 2 0 10 0
+
+# Colors stay
+IN \1b[4;1H\1b[31mred\1b[m\1b[4;1;4;10;5$r
+ATTR 3 0 3 440001
+
+# A stream that starts right of the screen takes in none of its top row
+IN \1b[0*x\1b[5;1Hhello\1b[4;99;5;3;1$r
+ATTR 3 0 3 440001
+ATTR 3 3 7 40000
+ATTR 4 0 3 10000
+ATTR 4 3 7 0
@@ -0,0 +1,59 @@
+RES 10 5
+
+IN 0123456789abcdefghijABCDEFGHIJklmnopqrstKLMNOPQRST
+CURSOR 4 9
+
+# CSI s only sets margins once DECLRMM is on
+IN \1b[3;6s
+CURSOR 4 9
+IN \1b[?69h\1b[3;6s
+CURSOR 0 0
+
+# Scrolling only moves what's between them
+IN \1b[S
+OUT 0 0 01cdef6789
+OUT 1 0 abCDEFghij
+OUT 2 0 ABmnopGHIJ
+OUT 3 0 klMNOPqrst
+OUT 4 0 KL\s\s\s\sQRST
+
+# So do IL and DL, which need the cursor between them
+IN \1b[1;1H\1b[L
+OUT 0 0 01cdef6789
+IN \1b[2;3H\1b[M
+OUT 1 0 abmnopghij
+OUT 2 0 ABMNOPGHIJ
+OUT 3 0 kl\s\s\s\sqrst
+OUT 4 0 KL\s\s\s\sQRST
+
+# ICH and DCH shift cells up to the right margin
+IN \1b[2;4H\1b[@
+OUT 1 0 abm\snoghij
+IN \1b[2P
+OUT 1 0 abmo\s\sghij
+
+# Text wraps at the right margin, back to the left one
+IN \1b[4;5HXYZW
+OUT 3 0 kl\s\sXYqrst
+OUT 4 0 KLZW\s\sQRST
+CURSOR 4 4
+
+# CR goes to the left margin, unless the cursor is left of it already
+IN \r
+CURSOR 4 2
+IN \1b[1;2H\r
+CURSOR 0 0
+
+# Origin mode counts columns from the left margin too
+IN \1b[?6h\1b[1;1H
+CURSOR 0 2
+IN \1b[1;9H
+CURSOR 0 5
+IN \1b[?6l
+
+# Turning DECLRMM off brings back the full width
+IN \1b[?69l\1b[S
+OUT 0 0 abmo\s\sghij
+OUT 4 0 \s\s\s\s\s\s\s\s\s\s
+
+# vim: set syn=conf:
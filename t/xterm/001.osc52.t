@@ -0,0 +1,55 @@
+CLIPTAP
+
+# The payload is decoded as it comes, however it's split up
+IN \1b]52;c;aGVs
+IN bG8gd29y
+IN bGQ=\07
+CLIP c end hello world
+
+# Padding ends a quantum, and data can go on after it
+IN \1b]52;c;aGVsbG8=IHdvcmxk\07
+CLIP c end hello world
+IN \1b]52;c;aA==aQ==\07
+CLIP c end hi
+
+# ST ends it too; no selection means the default
+IN \1b]52;;Zm9v\1b\5c
+CLIP - end foo
+
+# Nothing after the selection clears it
+IN \1b]52;p;\07
+CLIP p end
+
+# Queries aren't answered
+IN \1b]52;c;?\07
+NOCLIP
+
+# Any other sequence cuts it off, and still happens
+IN \1b]52;c;Zm9v\1b[2;3HX
+CLIP c abort foo
+OUT 1 2 X
+
+# So does a control character
+IN \1b]52;c;YmFy\18Y
+CLIP c abort bar
+OUT 1 3 Y
+
+# Far longer than the strings other OSCs keep
+IN \1b]52;s0;
+REP 5000 IN QUFBQUFBQUFBQUFB
+IN \07
+CLIPLEN s0 end 60000
+
+# Other OSCs are unaffected
+IN \1b]2;title\1b\5cZ
+OUT 1 4 Z
+NOCLIP
+
+# A copy restored part way through didn't pass the start on, so it reports
+# the end as a cut-off (and the original is cut off when it's freed)
+IN \1b[H\1b]52;c;Zm9v
+RESTORE
+CLIP c abort foo
+IN YmFy\07Z
+CLIP c abort
+OUT 0 0 Z
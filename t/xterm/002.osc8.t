@@ -0,0 +1,48 @@
+# Text between OSC 8 with a URI and OSC 8 without one is linked
+IN \1b]8;;http://a.example/\07link\1b]8;;\07 text
+LINK 0 0 4 http://a.example/
+LINK 0 4 5 -
+
+# Only id means anything among the parameters; ST ends it too
+IN \r\n\1b]8;x=1:id=7:y=2;http://b.example/\1b\5cone\1b]8;;\1b\5c
+LINK 1 0 3 http://b.example/ 7
+
+# Erasing takes links away, and so does writing over them unlinked
+IN \1b[1;2H\1b[K
+LINK 0 0 1 http://a.example/
+LINK 0 1 3 -
+IN \1b[2;1HX
+LINK 1 0 1 -
+LINK 1 1 2 http://b.example/ 7
+
+# Links move with the text when it scrolls
+IN \1b[24;1H\1b]8;;http://c.example/\07bottom\1b]8;;\07\n
+OUT 22 0 bottom
+LINK 22 0 6 http://c.example/
+LINK 23 0 6 -
+
+# They're exported with the text if asked for
+TEXT 22 1 t bottom\n
+TEXT 22 1 tl \1b]8;;http://c.example/\1b\5cbottom\1b]8;;\1b\5c\n
+TEXT 0 1 tl X\1b]8;id=7;http://b.example/\1b\5cne\1b]8;;\1b\5c\n
+
+# A URI longer than OSC strings are kept is no link, rather than the wrong one
+IN \1b[H\1b[2J\1b]8;;http://
+REP 60 IN long.example/
+IN \07long\1b]8;;\07
+LINK 0 0 4 -
+
+# However many links go by, the ones still on the screen stay
+IN \1b[H\1b[2J\1b[6;1H\1b]8;;http://keep.example/\07keep\1b]8;;\07\1b[H
+SEQ 1 5000 IN \1b]8;;http://\#.example/\07x\r
+IN \1b]8;;\07
+LINK 0 0 1 http://5000.example/
+LINK 5 0 4 http://keep.example/
+
+# Finished lines carry their links in the spans
+IN \1b[H\1b[2J
+TAP
+IN \1b]8;;http://d.example/\07ab\1b[1mcd\1b[m\1b]8;;\07ef\r\n
+LINE abcdef
+SPAN 0 2 0 http://d.example/
+SPAN 2 2 10000 http://d.example/
@@ -0,0 +1,66 @@
+# Wide characters take two cells: the character, then a spacer
+IN \e6\bc\a2a
+GLYPHS 0 0 6f22 - 61
+CURSOR 0 3
+IN \r\n\f0\9f\98\80
+GLYPHS 1 0 1f600 -
+
+# One that doesn't fit in the last column goes on the next line
+IN \1b[3;80H\e6\bc\a2
+GLYPHS 2 79 20
+GLYPHS 3 0 6f22 -
+CURSOR 3 2
+
+# One that just fits leaves a wrap pending, like any character
+IN \1b[5;79H\e6\bc\a2
+GLYPHS 4 78 6f22 -
+CURSOR 4 79
+IN x
+GLYPHS 5 0 78
+
+# Without wraparound, it takes the last two columns
+IN \1b[?7l\1b[7;80H\e6\bc\a2\1b[?7h
+GLYPHS 6 78 6f22 -
+
+# Writing over either half of one blanks the other
+IN \1b[8;1H\e6\bc\a2\e5\ad\97\1b[8;2Hx
+GLYPHS 7 0 20 78 5b57 -
+IN \1b[8;3Hy
+GLYPHS 7 2 79 20
+
+# So does erasing either half
+IN \1b[9;1H\e6\bc\a2\e5\ad\97\1b[9;2H\1b[X
+GLYPHS 8 0 20 20 5b57 -
+IN \1b[9;4H\1b[K
+GLYPHS 8 2 20 20
+
+# Deleting and inserting move them whole, or split them
+IN \1b[10;1Ha\e6\bc\a2b\1b[10;1H\1b[P
+GLYPHS 9 0 6f22 - 62
+IN \1b[10;2H\1b[P
+GLYPHS 9 0 20 62 20
+IN \1b[11;79H\e6\bc\a2\1b[11;1H\1b[@
+GLYPHS 10 78 20 20
+IN \1b[12;1H\e6\bc\a2\1b[4h\1b[12;2Hz\1b[4l
+GLYPHS 11 0 20 7a 20
+
+# Combining characters have nowhere to go
+IN \1b[13;1He\cc\81x
+GLYPHS 12 0 65 78
+CURSOR 12 2
+
+# REP repeats them whole
+IN \1b[14;1H\e6\bc\a2\1b[2b
+GLYPHS 13 0 6f22 - 6f22 - 6f22 -
+
+# Text has them once
+TEXT 0 1 t \e6\bc\a2a\n
+TAP
+IN \1b[20;1H\e6\bc\a2x\r\n
+LINE \e6\bc\a2x
+
+# Huge REP counts go by rows' worths of them, not of cells
+RES 9 4
+IN \1b[2J\1b[H\e4\b8\ad\1b[904b
+GLYPHS 3 0 4e2d - 20
+CURSOR 3 2